@@ -0,0 +1,303 @@
+#include "array.h"
+#include "value.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+Array *newArray(int count) {
+  Array *array = malloc(sizeof(Array));
+  if (array == NULL) {
+    exit(1);
+  }
+  array->numeric = true;
+  array->count = count;
+  array->capacity = count < 8 ? 8 : count;
+  array->as.numbers = calloc(array->capacity, sizeof(double));
+  if (array->as.numbers == NULL) {
+    exit(1);
+  }
+  return array;
+}
+
+void freeArray(Array *array) {
+  if (array->numeric) {
+    free(array->as.numbers);
+  } else {
+    free(array->as.values);
+  }
+  free(array);
+}
+
+static void makeGeneric(Array *array) {
+  Value *values = malloc(array->capacity * sizeof(Value));
+  if (values == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < array->count; i++) {
+    values[i] = makeNumber(array->as.numbers[i]);
+  }
+  free(array->as.numbers);
+  array->as.values = values;
+  array->numeric = false;
+}
+
+Value arrayGet(Array *array, int index) {
+  if (array->numeric) {
+    return makeNumber(array->as.numbers[index]);
+  }
+  return array->as.values[index];
+}
+
+void arraySet(Array *array, int index, Value value) {
+  if (array->numeric) {
+    if (value.type == VAL_NUMBER) {
+      array->as.numbers[index] = value.as.number;
+      return;
+    }
+    makeGeneric(array);
+  }
+  array->as.values[index] = value;
+}
+
+void arrayPush(Array *array, Value value) {
+  if (array->capacity <= array->count) {
+    array->capacity = array->capacity < 8 ? 8 : array->capacity * 2;
+    size_t size = array->numeric ? sizeof(double) : sizeof(Value);
+    void *elements = realloc(array->numeric ? (void *)array->as.numbers
+                                            : (void *)array->as.values,
+                             array->capacity * size);
+    if (elements == NULL) {
+      exit(1);
+    }
+    if (array->numeric) {
+      array->as.numbers = elements;
+    } else {
+      array->as.values = elements;
+    }
+  }
+  arraySet(array, array->count++, value);
+}
+
+int arrayIndex(Array *array, Value index) {
+  if (index.type != VAL_NUMBER) {
+    return -1;
+  }
+  double number = index.as.number;
+  if (!(number >= 0 && number < array->count) || number != (int)number) {
+    return -1;
+  }
+  return (int)number;
+}
+
+// GCC vector extensions, which compile to SSE2 on any x86-64 and to AVX2 in
+// the clones picked at load time on machines that have it.
+#if defined(__x86_64__) && defined(__linux__)
+#define BULK_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define BULK_KERNEL
+#endif
+
+#define LANES 4
+
+typedef double Lanes __attribute__((vector_size(LANES * sizeof(double))));
+typedef int64_t LaneMask __attribute__((vector_size(LANES * sizeof(double))));
+// Lets Lanes be read and written at any double's alignment. The helpers
+// take pointers, since passing vectors this wide by value depends on
+// whether AVX is enabled.
+typedef Lanes UnalignedLanes
+    __attribute__((aligned(sizeof(double)), may_alias));
+
+#define LOAD_LANES(numbers) (*(const UnalignedLanes *)(numbers))
+#define STORE_LANES(numbers, lanes) (*(UnalignedLanes *)(numbers) = (lanes))
+
+static inline double addLanes(const Lanes *lanes) {
+  return ((*lanes)[0] + (*lanes)[1]) + ((*lanes)[2] + (*lanes)[3]);
+}
+
+// Takes each lane of numbers that is less than the one in least, so a NaN
+// in numbers is passed over.
+static inline void keepLess(Lanes *least, const double *numbers) {
+  Lanes lanes = LOAD_LANES(numbers);
+  LaneMask less = lanes < *least;
+  *least = (Lanes)(((LaneMask)lanes & less) | ((LaneMask)*least & ~less));
+}
+
+static inline void keepGreater(Lanes *greatest, const double *numbers) {
+  Lanes lanes = LOAD_LANES(numbers);
+  LaneMask greater = lanes > *greatest;
+  *greatest =
+      (Lanes)(((LaneMask)lanes & greater) | ((LaneMask)*greatest & ~greater));
+}
+
+// The loops keep two accumulators so consecutive additions do not wait on
+// each other.
+BULK_KERNEL double sumNumbers(const double *numbers, int count) {
+  Lanes a = {0};
+  Lanes b = {0};
+  int i = 0;
+  for (; i + 2 * LANES <= count; i += 2 * LANES) {
+    a += LOAD_LANES(numbers + i);
+    b += LOAD_LANES(numbers + i + LANES);
+  }
+  a += b;
+  double sum = addLanes(&a);
+  for (; i < count; i++) {
+    sum += numbers[i];
+  }
+  return sum;
+}
+
+BULK_KERNEL double minNumber(const double *numbers, int count) {
+  Lanes least = {INFINITY, INFINITY, INFINITY, INFINITY};
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    keepLess(&least, numbers + i);
+  }
+  double result = INFINITY;
+  for (int lane = 0; lane < LANES; lane++) {
+    result = least[lane] < result ? least[lane] : result;
+  }
+  for (; i < count; i++) {
+    result = numbers[i] < result ? numbers[i] : result;
+  }
+  return result;
+}
+
+BULK_KERNEL double maxNumber(const double *numbers, int count) {
+  Lanes greatest = {-INFINITY, -INFINITY, -INFINITY, -INFINITY};
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    keepGreater(&greatest, numbers + i);
+  }
+  double result = -INFINITY;
+  for (int lane = 0; lane < LANES; lane++) {
+    result = greatest[lane] > result ? greatest[lane] : result;
+  }
+  for (; i < count; i++) {
+    result = numbers[i] > result ? numbers[i] : result;
+  }
+  return result;
+}
+
+BULK_KERNEL double dotNumbers(const double *a, const double *b, int count) {
+  Lanes x = {0};
+  Lanes y = {0};
+  int i = 0;
+  for (; i + 2 * LANES <= count; i += 2 * LANES) {
+    x += LOAD_LANES(a + i) * LOAD_LANES(b + i);
+    y += LOAD_LANES(a + i + LANES) * LOAD_LANES(b + i + LANES);
+  }
+  x += y;
+  double dot = addLanes(&x);
+  for (; i < count; i++) {
+    dot += a[i] * b[i];
+  }
+  return dot;
+}
+
+BULK_KERNEL void scaleNumbers(double *numbers, int count, double factor) {
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    STORE_LANES(numbers + i, LOAD_LANES(numbers + i) * factor);
+  }
+  for (; i < count; i++) {
+    numbers[i] *= factor;
+  }
+}
+
+BULK_KERNEL void addNumbers(double *numbers, const double *addends,
+                            int count) {
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    STORE_LANES(numbers + i, LOAD_LANES(numbers + i) + LOAD_LANES(addends + i));
+  }
+  for (; i < count; i++) {
+    numbers[i] += addends[i];
+  }
+}
+
+BULK_KERNEL void addToNumbers(double *numbers, int count, double addend) {
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    STORE_LANES(numbers + i, LOAD_LANES(numbers + i) + addend);
+  }
+  for (; i < count; i++) {
+    numbers[i] += addend;
+  }
+}
+
+// Ranges this short are finished by insertion sort.
+#define SORT_CUTOFF 16
+
+static void insertionSort(double *numbers, int count) {
+  for (int i = 1; i < count; i++) {
+    double number = numbers[i];
+    int j = i;
+    for (; j > 0 && number < numbers[j - 1]; j--) {
+      numbers[j] = numbers[j - 1];
+    }
+    numbers[j] = number;
+  }
+}
+
+static void swapNumbers(double *a, double *b) {
+  double swap = *a;
+  *a = *b;
+  *b = swap;
+}
+
+// Quicksort with a median-of-three pivot. Recursing into the smaller side
+// only keeps the stack logarithmic. Every comparison is false for a NaN, so
+// the numbers given must not include any.
+static void quicksort(double *numbers, int count) {
+  while (count > SORT_CUTOFF) {
+    double *last = numbers + count - 1;
+    double *middle = numbers + count / 2;
+    if (*middle < *numbers) {
+      swapNumbers(middle, numbers);
+    }
+    if (*last < *middle) {
+      swapNumbers(last, middle);
+      if (*middle < *numbers) {
+        swapNumbers(middle, numbers);
+      }
+    }
+    double pivot = *middle;
+    int i = 0;
+    int j = count - 1;
+    while (i <= j) {
+      while (numbers[i] < pivot) {
+        i++;
+      }
+      while (pivot < numbers[j]) {
+        j--;
+      }
+      if (i <= j) {
+        swapNumbers(&numbers[i], &numbers[j]);
+        i++;
+        j--;
+      }
+    }
+    if (j + 1 < count - i) {
+      quicksort(numbers, j + 1);
+      numbers += i;
+      count -= i;
+    } else {
+      quicksort(numbers + i, count - i);
+      count = j + 1;
+    }
+  }
+  insertionSort(numbers, count);
+}
+
+void sortNumbers(double *numbers, int count) {
+  // NaNs go to the end first, since every comparison with one is false.
+  int numberCount = 0;
+  for (int i = 0; i < count; i++) {
+    if (!isnan(numbers[i])) {
+      swapNumbers(&numbers[numberCount++], &numbers[i]);
+    }
+  }
+  quicksort(numbers, numberCount);
+}
@@ -0,0 +1,40 @@
+#include "value.h"
+#include <stdbool.h>
+
+#pragma once
+
+// A growable list. While every element is a number it stores raw doubles,
+// which the bulk operations below work on directly; the first time anything
+// else is stored it switches to Values for good.
+struct Array {
+  bool numeric;
+  int count;
+  int capacity;
+  union {
+    double *numbers;
+    Value *values;
+  } as;
+};
+
+// Returns a numeric array of count zeros.
+Array *newArray(int count);
+void freeArray(Array *array);
+Value arrayGet(Array *array, int index);
+void arraySet(Array *array, int index, Value value);
+void arrayPush(Array *array, Value value);
+// The element index refers to, or -1 unless it is an integral number in
+// bounds.
+int arrayIndex(Array *array, Value index);
+
+// Bulk operations on raw doubles, vectorized where the platform allows.
+// NaNs are skipped by the minimum and maximum, which are infinite for an
+// empty range.
+double sumNumbers(const double *numbers, int count);
+double minNumber(const double *numbers, int count);
+double maxNumber(const double *numbers, int count);
+double dotNumbers(const double *a, const double *b, int count);
+void scaleNumbers(double *numbers, int count, double factor);
+void addNumbers(double *numbers, const double *addends, int count);
+void addToNumbers(double *numbers, int count, double addend);
+// Sorts ascending in place, with any NaNs after every other number.
+void sortNumbers(double *numbers, int count);
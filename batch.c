@@ -0,0 +1,309 @@
+#include "batch.h"
+#include "lox.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+typedef struct {
+  char *path;
+  // Everything the script printed or reported, in the order it was written.
+  char *output;
+  size_t length;
+  int status;
+  bool done;
+} Script;
+
+// The scripts a worker still has to run, as the index range [head, tail).
+// The owner takes from the head, so scripts finish roughly in path order and
+// the printer is not held up; thieves take the upper half from the tail.
+typedef struct {
+  pthread_mutex_t lock;
+  int head;
+  int tail;
+} Deque;
+
+typedef struct {
+  Script *scripts;
+  int scriptCount;
+  Deque *deques;
+  int workerCount;
+  BatchOptions *options;
+  pthread_mutex_t doneLock;
+  pthread_cond_t doneChanged;
+} Batch;
+
+typedef struct {
+  Batch *batch;
+  int id;
+  int steals;
+  pthread_t thread;
+} Worker;
+
+typedef struct {
+  char **items;
+  int count;
+  int capacity;
+} PathList;
+
+static void addPath(PathList *list, char *path) {
+  if (list->capacity <= list->count) {
+    list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+    list->items = realloc(list->items, list->capacity * sizeof(char *));
+    if (list->items == NULL) {
+      exit(1);
+    }
+  }
+  list->items[list->count++] = path;
+}
+
+static char *copyString(const char *chars) {
+  char *copy = strdup(chars);
+  if (copy == NULL) {
+    exit(1);
+  }
+  return copy;
+}
+
+static int comparePaths(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool isLoxFile(const char *name) {
+  size_t length = strlen(name);
+  return length > 4 && strcmp(name + length - 4, ".lox") == 0;
+}
+
+// Anything that is not a directory is kept as is, so a missing file shows up
+// as a failed script rather than vanishing from the batch.
+static void expandPath(PathList *list, const char *path) {
+  struct stat info;
+  DIR *dir;
+  if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode) ||
+      (dir = opendir(path)) == NULL) {
+    addPath(list, copyString(path));
+    return;
+  }
+
+  int first = list->count;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (!isLoxFile(entry->d_name)) {
+      continue;
+    }
+    size_t length = strlen(path) + strlen(entry->d_name) + 2;
+    char *file = malloc(length);
+    if (file == NULL) {
+      exit(1);
+    }
+    snprintf(file, length, "%s/%s", path, entry->d_name);
+    addPath(list, file);
+  }
+  closedir(dir);
+  qsort(list->items + first, list->count - first, sizeof(char *),
+        comparePaths);
+}
+
+static int interpretScript(LoxVM *vm, const char *source,
+                           BatchOptions *options) {
+  if (options->snapshot != NULL && !loxLoadSnapshot(vm, options->snapshot)) {
+    return 74;
+  }
+  switch (loxInterpret(vm, source)) {
+  case LOX_COMPILE_ERROR: {
+    return 65;
+  }
+  case LOX_RUNTIME_ERROR: {
+    return 70;
+  }
+  default: {
+    return 0;
+  }
+  }
+}
+
+static void runScript(LoxVM *vm, Script *script, BatchOptions *options) {
+  FILE *output = open_memstream(&script->output, &script->length);
+  if (output == NULL) {
+    exit(1);
+  }
+  char *source = loxReadFile(script->path, output);
+  if (source == NULL) {
+    script->status = 74;
+  } else {
+    loxSetOutput(vm, output, output);
+    script->status = interpretScript(vm, source, options);
+    loxSetOutput(vm, stdout, stderr);
+    loxResetVM(vm);
+    free(source);
+  }
+  fclose(output);
+}
+
+static bool takeOwn(Deque *deque, int *index) {
+  pthread_mutex_lock(&deque->lock);
+  bool found = deque->head < deque->tail;
+  if (found) {
+    *index = deque->head++;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+// Moves the upper half of some other worker's remaining scripts into the
+// thief's own (empty) deque and returns the first of them. Only one lock is
+// held at a time, so there is no lock order to get wrong.
+static bool steal(Worker *thief, int *index) {
+  Batch *batch = thief->batch;
+  for (int i = 1; i < batch->workerCount; i++) {
+    Deque *victim = &batch->deques[(thief->id + i) % batch->workerCount];
+    pthread_mutex_lock(&victim->lock);
+    int remaining = victim->tail - victim->head;
+    int start = victim->tail - (remaining + 1) / 2;
+    int end = victim->tail;
+    if (remaining > 0) {
+      victim->tail = start;
+    }
+    pthread_mutex_unlock(&victim->lock);
+    if (remaining == 0) {
+      continue;
+    }
+
+    Deque *own = &batch->deques[thief->id];
+    pthread_mutex_lock(&own->lock);
+    own->head = start + 1;
+    own->tail = end;
+    pthread_mutex_unlock(&own->lock);
+    thief->steals++;
+    *index = start;
+    return true;
+  }
+  return false;
+}
+
+static void *runWorker(void *arg) {
+  Worker *worker = arg;
+  Batch *batch = worker->batch;
+  LoxVM *vm = loxNewVM();
+  if (vm == NULL) {
+    exit(70);
+  }
+  loxSetBackend(vm, batch->options->backend);
+  loxEnableJit(vm, batch->options->jit);
+  loxSetDumpChunks(vm, false);
+
+  int index;
+  while (takeOwn(&batch->deques[worker->id], &index) ||
+         steal(worker, &index)) {
+    Script *script = &batch->scripts[index];
+    runScript(vm, script, batch->options);
+    pthread_mutex_lock(&batch->doneLock);
+    script->done = true;
+    pthread_cond_broadcast(&batch->doneChanged);
+    pthread_mutex_unlock(&batch->doneLock);
+  }
+  loxFreeVM(vm);
+  return NULL;
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int runBatch(char **paths, int count, BatchOptions *options) {
+  PathList list = {NULL, 0, 0};
+  for (int i = 0; i < count; i++) {
+    expandPath(&list, paths[i]);
+  }
+
+  Batch batch;
+  batch.scriptCount = list.count;
+  batch.scripts = calloc(list.count > 0 ? list.count : 1, sizeof(Script));
+  batch.workerCount = options->threads;
+  if (batch.workerCount > list.count) {
+    batch.workerCount = list.count;
+  }
+  if (batch.workerCount < 1) {
+    batch.workerCount = 1;
+  }
+  batch.deques = malloc(batch.workerCount * sizeof(Deque));
+  Worker *workers = calloc(batch.workerCount, sizeof(Worker));
+  if (batch.scripts == NULL || batch.deques == NULL || workers == NULL) {
+    exit(1);
+  }
+  batch.options = options;
+  pthread_mutex_init(&batch.doneLock, NULL);
+  pthread_cond_init(&batch.doneChanged, NULL);
+
+  for (int i = 0; i < list.count; i++) {
+    batch.scripts[i].path = list.items[i];
+  }
+  // Each worker starts with a contiguous block of scripts.
+  for (int i = 0; i < batch.workerCount; i++) {
+    Deque *deque = &batch.deques[i];
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->head = (int)((long)list.count * i / batch.workerCount);
+    deque->tail = (int)((long)list.count * (i + 1) / batch.workerCount);
+  }
+
+  double start = now();
+  for (int i = 0; i < batch.workerCount; i++) {
+    workers[i].batch = &batch;
+    workers[i].id = i;
+    if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) !=
+        0) {
+      fprintf(stderr, "Could not start worker thread.\n");
+      exit(71);
+    }
+  }
+
+  int status = 0;
+  int failures = 0;
+  for (int i = 0; i < batch.scriptCount; i++) {
+    Script *script = &batch.scripts[i];
+    pthread_mutex_lock(&batch.doneLock);
+    while (!script->done) {
+      pthread_cond_wait(&batch.doneChanged, &batch.doneLock);
+    }
+    pthread_mutex_unlock(&batch.doneLock);
+
+    fwrite(script->output, 1, script->length, stdout);
+    free(script->output);
+    free(script->path);
+    if (script->status != 0) {
+      failures++;
+    }
+    if (script->status > status) {
+      status = script->status;
+    }
+  }
+  fflush(stdout);
+
+  int steals = 0;
+  for (int i = 0; i < batch.workerCount; i++) {
+    pthread_join(workers[i].thread, NULL);
+    pthread_mutex_destroy(&batch.deques[i].lock);
+    steals += workers[i].steals;
+  }
+  double seconds = now() - start;
+
+  fprintf(stderr,
+          "batch: %d scripts, %d failed, %d threads, %.3fs, %.1f scripts/s, "
+          "%d steals\n",
+          batch.scriptCount, failures, batch.workerCount, seconds,
+          seconds > 0 ? batch.scriptCount / seconds : 0.0, steals);
+
+  pthread_mutex_destroy(&batch.doneLock);
+  pthread_cond_destroy(&batch.doneChanged);
+  free(workers);
+  free(batch.deques);
+  free(batch.scripts);
+  free(list.items);
+  return status;
+}
@@ -0,0 +1,19 @@
+#include "lox.h"
+#include <stdbool.h>
+
+#pragma once
+
+typedef struct {
+  LoxBackend backend;
+  bool jit;
+  int threads;
+  // Loaded before every script when not NULL.
+  const char *snapshot;
+} BatchOptions;
+
+// Runs every script in paths on a pool of worker threads, each with its own
+// VM that is reset between scripts. A directory stands for the .lox files
+// directly inside it, in name order. Each script's output and errors are
+// buffered and written to stdout in path order, then a throughput summary
+// goes to stderr. Returns the exit status of the worst script.
+int runBatch(char **paths, int count, BatchOptions *options);
@@ -1,18 +1,47 @@
 #include "chunk.h"
+#include "jit.h"
 #include "value.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
-  chunk->line = 1;
+  chunk->lines = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
+  chunk->globalCaches = NULL;
+  chunk->propertyCaches = NULL;
+  chunk->jitLoops = NULL;
+  chunk->jitLoopCapacity = 0;
+  chunk->maxStack = 0;
+  chunk->verified = false;
   initValueArray(&chunk->constants);
 }
 
+// Starts a new line run at offset unless the last run is already on line.
+static void addLine(Chunk *chunk, int offset, int line) {
+  if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+  if (chunk->lineCapacity <= chunk->lineCount) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+    chunk->lines =
+        realloc(chunk->lines, chunk->lineCapacity * sizeof(LineStart));
+    if (chunk->lines == NULL) {
+      exit(1);
+    }
+  }
+  LineStart *lineStart = &chunk->lines[chunk->lineCount++];
+  lineStart->offset = offset;
+  lineStart->line = line;
+}
+
 void writeChunk(Chunk *chunk, uint8_t byte, int line) {
   if (chunk->capacity <= chunk->count) {
     int oldCapacity = chunk->capacity;
@@ -25,17 +54,183 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
   }
 
   chunk->code[chunk->count] = byte;
-  chunk->line = line;
   chunk->count++;
+  chunk->verified = false;
+  addLine(chunk, chunk->count - 1, line);
+}
+
+// Appends count bytes that all come from line.
+void writeChunkBytes(Chunk *chunk, const uint8_t *bytes, int count, int line) {
+  if (count == 0) {
+    return;
+  }
+  if (chunk->capacity < chunk->count + count) {
+    while (chunk->capacity < chunk->count + count) {
+      chunk->capacity = chunk->capacity < 8 ? 8 : chunk->capacity * 2;
+    }
+    chunk->code = realloc(chunk->code, chunk->capacity * sizeof(uint8_t));
+    if (chunk->code == NULL) {
+      exit(1);
+    }
+  }
+
+  memcpy(chunk->code + chunk->count, bytes, count);
+  chunk->count += count;
+  chunk->verified = false;
+  addLine(chunk, chunk->count - count, line);
+}
+
+// Drops every byte from count on, so the compiler can rewrite code it has
+// just emitted.
+void truncateChunk(Chunk *chunk, int count) {
+  chunk->count = count;
+  chunk->verified = false;
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= count) {
+    chunk->lineCount--;
+  }
+}
+
+// Gives every instruction offset an empty global and property cache slot, in
+// chunk and in the functions declared in it.
+void resetInlineCaches(Chunk *chunk) {
+  free(chunk->globalCaches);
+  free(chunk->propertyCaches);
+  chunk->globalCaches = calloc(chunk->count, sizeof(GlobalCache));
+  chunk->propertyCaches = calloc(chunk->count, sizeof(PropertyCache));
+  if (chunk->globalCaches == NULL || chunk->propertyCaches == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (constant.type == VAL_FUNCTION) {
+      resetInlineCaches(&constant.as.function->chunk);
+    }
+  }
+}
+
+int getLine(Chunk *chunk, int offset) {
+  int start = 0;
+  int end = chunk->lineCount - 1;
+  int line = 0;
+
+  // Find the last run that starts at or before offset.
+  while (start <= end) {
+    int mid = start + (end - start) / 2;
+    if (chunk->lines[mid].offset <= offset) {
+      line = chunk->lines[mid].line;
+      start = mid + 1;
+    } else {
+      end = mid - 1;
+    }
+  }
+  return line;
 }
 
 void freeChunk(Chunk *chunk) {
   free(chunk->code);
+  free(chunk->lines);
+  free(chunk->globalCaches);
+  free(chunk->propertyCaches);
+  jitFreeChunk(chunk);
   freeValueArray(&chunk->constants);
   free(chunk->constants.values);
   initChunk(chunk);
 }
 
+Function *newFunction(const char *name, int length) {
+  Function *function = malloc(sizeof(Function));
+  if (function == NULL) {
+    exit(1);
+  }
+  function->arity = 0;
+  initChunk(&function->chunk);
+  function->name = makeString(name, length).as.string;
+  return function;
+}
+
+Function *copyFunction(Function *function) {
+  Function *copy =
+      newFunction(function->name->chars, function->name->length);
+  Chunk *from = &function->chunk;
+  Chunk *to = &copy->chunk;
+  copy->arity = function->arity;
+  to->code = malloc(from->count > 0 ? from->count : 1);
+  to->lines = malloc((from->lineCount > 0 ? from->lineCount : 1) *
+                     sizeof(LineStart));
+  if (to->code == NULL || to->lines == NULL) {
+    exit(1);
+  }
+  memcpy(to->code, from->code, from->count);
+  memcpy(to->lines, from->lines, from->lineCount * sizeof(LineStart));
+  to->count = to->capacity = from->count;
+  to->lineCount = to->lineCapacity = from->lineCount;
+  for (int i = 0; i < from->constants.count; i++) {
+    writeValueArray(&to->constants, copyValue(from->constants.values[i]));
+  }
+  to->maxStack = from->maxStack;
+  to->verified = from->verified;
+  return copy;
+}
+
+void freeFunction(Function *function) {
+  freeChunk(&function->chunk);
+  freeString(function->name);
+  free(function);
+}
+
+static uint32_t readLongOperand(Chunk *chunk, int offset) {
+  return (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) |
+         chunk->code[offset + 3];
+}
+
+static int longConstantInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint32_t constant = readLongOperand(chunk, offset);
+  printf("%-16s %4u = ", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+  return offset + 4;
+}
+
+static int constantInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  printf("%-16s %4d = ", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+  return offset + 2;
+}
+
+static int invokeInstruction(const char *name, Chunk *chunk, int offset,
+                             int operandBytes) {
+  uint32_t constant = operandBytes == 1 ? chunk->code[offset + 1]
+                                        : readLongOperand(chunk, offset);
+  printf("%-16s %4u (%d args) = ", name, constant,
+         chunk->code[offset + 1 + operandBytes]);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+  return offset + 2 + operandBytes;
+}
+
+static int16_t readImmediate(Chunk *chunk, int offset) {
+  return (int16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+}
+
+static int immediateInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4d\n", name, readImmediate(chunk, offset));
+  return offset + 3;
+}
+
+static int simpleInstruction(const char *name, int offset) {
+  printf("%s\n", name);
+  return offset + 1;
+}
+
+static int longSlotInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4u\n", name, readLongOperand(chunk, offset));
+  return offset + 4;
+}
+
 void debugChunk(Chunk *chunk) {
   printf("=== CHUNK ===\n");
 
@@ -49,8 +244,16 @@ void debugChunk(Chunk *chunk) {
 
   // Print bytecode
   printf("\nBytecode:\n");
+  int previousLine = -1;
   for (int offset = 0; offset < chunk->count;) {
     printf("%04d ", offset);
+    int line = getLine(chunk, offset);
+    if (line == previousLine) {
+      printf("   | ");
+    } else {
+      printf("%4d ", line);
+    }
+    previousLine = line;
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
@@ -102,11 +305,210 @@ void debugChunk(Chunk *chunk) {
       offset += 2;
       break;
     }
+    case OP_CONSTANT_LONG: {
+      offset = longConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
+      break;
+    }
+    case OP_GET_GLOBAL_LONG: {
+      offset = longConstantInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+      break;
+    }
+    case OP_DEFINE_GLOBAL_LONG: {
+      offset = longConstantInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+      break;
+    }
+    case OP_SET_GLOBAL_LONG: {
+      offset = longConstantInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+      break;
+    }
+    case OP_GET_LOCAL_LONG: {
+      offset = longSlotInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+      break;
+    }
+    case OP_SET_LOCAL_LONG: {
+      offset = longSlotInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+      break;
+    }
+    case OP_ZERO: {
+      printf("OP_ZERO\n");
+      offset += 1;
+      break;
+    }
+    case OP_ONE: {
+      printf("OP_ONE\n");
+      offset += 1;
+      break;
+    }
+    case OP_INT8: {
+      printf("%-16s %4d\n", "OP_INT8", (int8_t)chunk->code[offset + 1]);
+      offset += 2;
+      break;
+    }
+    case OP_INT16: {
+      offset = immediateInstruction("OP_INT16", chunk, offset);
+      break;
+    }
+    case OP_ADD_IMM: {
+      offset = immediateInstruction("OP_ADD_IMM", chunk, offset);
+      break;
+    }
+    case OP_LESS_IMM: {
+      offset = immediateInstruction("OP_LESS_IMM", chunk, offset);
+      break;
+    }
+    case OP_GREATER_IMM: {
+      offset = immediateInstruction("OP_GREATER_IMM", chunk, offset);
+      break;
+    }
+    case OP_SUBTRACT: {
+      offset = simpleInstruction("OP_SUBTRACT", offset);
+      break;
+    }
+    case OP_MULTIPLY: {
+      offset = simpleInstruction("OP_MULTIPLY", offset);
+      break;
+    }
+    case OP_DIVIDE: {
+      offset = simpleInstruction("OP_DIVIDE", offset);
+      break;
+    }
+    case OP_NEGATE: {
+      offset = simpleInstruction("OP_NEGATE", offset);
+      break;
+    }
+    case OP_EQUAL: {
+      offset = simpleInstruction("OP_EQUAL", offset);
+      break;
+    }
+    case OP_ADD_NUM: {
+      offset = simpleInstruction("OP_ADD_NUM", offset);
+      break;
+    }
+    case OP_ADD_STR: {
+      offset = simpleInstruction("OP_ADD_STR", offset);
+      break;
+    }
+    case OP_LESS_NUM: {
+      offset = simpleInstruction("OP_LESS_NUM", offset);
+      break;
+    }
+    case OP_GREATER_NUM: {
+      offset = simpleInstruction("OP_GREATER_NUM", offset);
+      break;
+    }
+    case OP_ADD_UNCHECKED: {
+      offset = simpleInstruction("OP_ADD_UNCHECKED", offset);
+      break;
+    }
+    case OP_SUBTRACT_UNCHECKED: {
+      offset = simpleInstruction("OP_SUBTRACT_UNCHECKED", offset);
+      break;
+    }
+    case OP_MULTIPLY_UNCHECKED: {
+      offset = simpleInstruction("OP_MULTIPLY_UNCHECKED", offset);
+      break;
+    }
+    case OP_DIVIDE_UNCHECKED: {
+      offset = simpleInstruction("OP_DIVIDE_UNCHECKED", offset);
+      break;
+    }
+    case OP_LESS_UNCHECKED: {
+      offset = simpleInstruction("OP_LESS_UNCHECKED", offset);
+      break;
+    }
+    case OP_GREATER_UNCHECKED: {
+      offset = simpleInstruction("OP_GREATER_UNCHECKED", offset);
+      break;
+    }
+    case OP_NEGATE_UNCHECKED: {
+      offset = simpleInstruction("OP_NEGATE_UNCHECKED", offset);
+      break;
+    }
+    case OP_ADD_IMM_UNCHECKED: {
+      offset = immediateInstruction("OP_ADD_IMM_UNCHECKED", chunk, offset);
+      break;
+    }
+    case OP_LESS_IMM_UNCHECKED: {
+      offset = immediateInstruction("OP_LESS_IMM_UNCHECKED", chunk, offset);
+      break;
+    }
+    case OP_GREATER_IMM_UNCHECKED: {
+      offset = immediateInstruction("OP_GREATER_IMM_UNCHECKED", chunk, offset);
+      break;
+    }
     case OP_RETURN: {
       printf("OP_RETURN\n"); // Removed extra formatting for simple instructions
       offset += 1;
       break;
     }
+    case OP_CALL: {
+      printf("%-16s %4d\n", "OP_CALL", chunk->code[offset + 1]);
+      offset += 2;
+      break;
+    }
+    case OP_TAIL_CALL: {
+      printf("%-16s %4d\n", "OP_TAIL_CALL", chunk->code[offset + 1]);
+      offset += 2;
+      break;
+    }
+    case OP_RETURN_VALUE: {
+      offset = simpleInstruction("OP_RETURN_VALUE", offset);
+      break;
+    }
+    case OP_ARRAY: {
+      printf("%-16s %4d\n", "OP_ARRAY", chunk->code[offset + 1]);
+      offset += 2;
+      break;
+    }
+    case OP_MAP: {
+      printf("%-16s %4d\n", "OP_MAP", chunk->code[offset + 1]);
+      offset += 2;
+      break;
+    }
+    case OP_CLASS: {
+      offset = constantInstruction("OP_CLASS", chunk, offset);
+      break;
+    }
+    case OP_CLASS_LONG: {
+      offset = longConstantInstruction("OP_CLASS_LONG", chunk, offset);
+      break;
+    }
+    case OP_METHOD: {
+      offset = simpleInstruction("OP_METHOD", offset);
+      break;
+    }
+    case OP_GET_PROPERTY: {
+      offset = constantInstruction("OP_GET_PROPERTY", chunk, offset);
+      break;
+    }
+    case OP_GET_PROPERTY_LONG: {
+      offset = longConstantInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
+      break;
+    }
+    case OP_SET_PROPERTY: {
+      offset = constantInstruction("OP_SET_PROPERTY", chunk, offset);
+      break;
+    }
+    case OP_SET_PROPERTY_LONG: {
+      offset = longConstantInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
+      break;
+    }
+    case OP_INVOKE: {
+      offset = invokeInstruction("OP_INVOKE", chunk, offset, 1);
+      break;
+    }
+    case OP_INVOKE_LONG: {
+      offset = invokeInstruction("OP_INVOKE_LONG", chunk, offset, 3);
+      break;
+    }
+    case OP_GET_INDEX: {
+      offset = simpleInstruction("OP_GET_INDEX", offset);
+      break;
+    }
+    case OP_SET_INDEX: {
+      offset = simpleInstruction("OP_SET_INDEX", offset);
+      break;
+    }
     case OP_PRINT: {
       printf("OP_PRINT\n");
       offset += 1;
@@ -127,6 +529,11 @@ void debugChunk(Chunk *chunk) {
       offset += 1;
       break;
     }
+    case OP_NIL: {
+      printf("OP_NIL\n");
+      offset += 1;
+      break;
+    }
     case OP_TRUE: {
       printf("OP_TRUE\n");
       offset += 1;
@@ -168,15 +575,40 @@ void debugChunk(Chunk *chunk) {
       offset += 3;
       break;
     }
+    case OP_FOR_LOOP: {
+      static const char *compares[] = {"<", "<=", ">", ">="};
+      uint8_t *code = chunk->code + offset;
+      int16_t step = (int16_t)((code[3] << 8) | code[4]);
+      uint16_t jump = (uint16_t)((code[6] << 8) | code[7]);
+      printf("%-16s %4d += %d while %s %d, %d\n", "OP_FOR_LOOP", code[1],
+             step, code[5] <= FOR_GREATER_EQUAL ? compares[code[5]] : "?",
+             code[2], jump);
+      offset += 8;
+      break;
+    }
+    default: {
+      printf("Unknown opcode %d\n", instruction);
+      offset += 1;
+      break;
+    }
     }
   }
   printf("=== end of CHUNK ===\n\n");
+
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (constant.type == VAL_FUNCTION) {
+      printf("<fn %s>:\n", constant.as.function->name->chars);
+      debugChunk(&constant.as.function->chunk);
+    }
+  }
 }
 
 // Not used at the moment
 void dumpChunkRaw(Chunk *chunk) {
   printf("Chunk contents:\n");
-  printf("Count: %d, Capacity: %d\n", chunk->count, chunk->capacity);
+  printf("Count: %d, Capacity: %d, Line runs: %d\n", chunk->count,
+         chunk->capacity, chunk->lineCount);
 
   printf("\nBytecode (raw):\n");
   for (int i = 0; i < chunk->count; i++) {
@@ -1,9 +1,15 @@
 #include "stdint.h"
+#include "table.h"
 #include "value.h"
+#include <stdbool.h>
 #include <stdint.h>
 
 #pragma once
 
+// The _LONG forms of the constant, global and local opcodes take a 24-bit
+// big-endian operand instead of a single byte.
+#define UINT24_MAX 0xFFFFFF
+
 typedef enum {
   OP_CONSTANT,
   OP_NEGATE,
@@ -18,10 +24,15 @@ typedef enum {
   OP_FALSE,
   OP_POP,
   OP_GET_LOCAL,
+  OP_GET_LOCAL_LONG,
   OP_SET_LOCAL,
+  OP_SET_LOCAL_LONG,
   OP_GET_GLOBAL,
+  OP_GET_GLOBAL_LONG,
   OP_DEFINE_GLOBAL,
+  OP_DEFINE_GLOBAL_LONG,
   OP_SET_GLOBAL,
+  OP_SET_GLOBAL_LONG,
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
@@ -30,18 +41,140 @@ typedef enum {
   OP_MULTIPLY,
   OP_DIVIDE,
   OP_NOT,
+  // Small integral literals are encoded in the instruction stream: OP_INT8
+  // takes a signed byte, OP_INT16 and the fused _IMM arithmetic forms take a
+  // signed 16-bit big-endian operand.
+  OP_ZERO,
+  OP_ONE,
+  OP_INT8,
+  OP_INT16,
+  OP_ADD_IMM,
+  OP_LESS_IMM,
+  OP_GREATER_IMM,
+  // Quickened forms. run() rewrites a generic instruction into one of these
+  // once it sees matching operand types and rewrites it back when a later
+  // execution sees different ones.
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_LESS_NUM,
+  OP_GREATER_NUM,
+  // Emitted by the compiler when it has proven both operands are numbers, so
+  // they skip the type check altogether.
+  OP_ADD_UNCHECKED,
+  OP_SUBTRACT_UNCHECKED,
+  OP_MULTIPLY_UNCHECKED,
+  OP_DIVIDE_UNCHECKED,
+  OP_LESS_UNCHECKED,
+  OP_GREATER_UNCHECKED,
+  OP_NEGATE_UNCHECKED,
+  OP_ADD_IMM_UNCHECKED,
+  OP_LESS_IMM_UNCHECKED,
+  OP_GREATER_IMM_UNCHECKED,
+  // OP_CALL takes the argument count; the callee sits below the arguments.
+  // OP_TAIL_CALL replaces the running function's frame with the callee's.
+  // OP_RETURN_VALUE returns from a function, OP_RETURN ends the script.
+  OP_CALL,
+  OP_TAIL_CALL,
+  OP_RETURN_VALUE,
+  // OP_ARRAY takes the element count and collects that many values into a
+  // new array. The index opcodes expect the array or map below the index.
+  OP_ARRAY,
+  OP_GET_INDEX,
+  OP_SET_INDEX,
+  // Takes the number of key and value pairs, which it collects into a map
+  // sized to hold them.
+  OP_MAP,
+  // OP_CLASS pushes a new class named by its constant. OP_METHOD pops a
+  // function into the class below it under the function's name.
+  OP_CLASS,
+  OP_CLASS_LONG,
+  OP_METHOD,
+  // The property opcodes take the property's name constant. OP_INVOKE calls
+  // a method or field directly and takes the argument count after the name;
+  // the receiver sits below the arguments.
+  OP_GET_PROPERTY,
+  OP_GET_PROPERTY_LONG,
+  OP_SET_PROPERTY,
+  OP_SET_PROPERTY_LONG,
+  OP_INVOKE,
+  OP_INVOKE_LONG,
+  // The back edge of a counted loop over proven numbers. Takes the counter's
+  // slot, the limit's slot, a signed 16-bit step, a ForCompare and a
+  // backward offset: it adds the step to the counter and jumps back while
+  // the comparison with the limit holds.
+  OP_FOR_LOOP,
 } OpCode;
 
+// <= and >= test the negated opposite comparison, so NaN keeps them true
+// like the OP_NOT they stand in for.
+typedef enum {
+  FOR_LESS,
+  FOR_LESS_EQUAL,
+  FOR_GREATER,
+  FOR_GREATER_EQUAL,
+} ForCompare;
+
+// One entry per run of bytes that share a source line. Entries are sorted by
+// offset, so getLine() can binary search them.
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
+// Inline cache for a global access, stored at the offset of its opcode.
+// The entry is only trusted while version matches the globals table.
+typedef struct {
+  Entry *entry;
+  uint32_t version;
+} GlobalCache;
+
+// Inline cache for a property access or invoke, stored at the offset of its
+// opcode. It applies to instances of shape only.
+typedef struct {
+  struct Shape *shape;
+  // For a set that adds the field, the shape the instance moves to.
+  struct Shape *next;
+  int slot;
+  // For an invoke, the method it calls.
+  Function *method;
+} PropertyCache;
+
 typedef struct {
   int count;
   int capacity;
-  int line;
+  LineStart *lines;
+  int lineCount;
+  int lineCapacity;
   ValueArray constants;
   uint8_t *code;
+  GlobalCache *globalCaches;
+  PropertyCache *propertyCaches;
+  // Indexed by the offset of an OP_LOOP, allocated once a loop gets hot.
+  struct JitLoop **jitLoops;
+  int jitLoopCapacity;
+  // Filled in by verifyChunk().
+  int maxStack;
+  bool verified;
 } Chunk;
 
+// A function declared in Lox. Its code runs with the function itself in
+// local slot 0 and its arguments in the slots after it.
+struct Function {
+  int arity;
+  Chunk chunk;
+  String *name;
+};
+
 void initChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
+void writeChunkBytes(Chunk *chunk, const uint8_t *bytes, int count, int line);
 void freeChunk(Chunk *chunk);
+void truncateChunk(Chunk *chunk, int count);
+void resetInlineCaches(Chunk *chunk);
+int getLine(Chunk *chunk, int offset);
 void debugChunk(Chunk *chunk);
 void dumpChunkRaw(Chunk *chunk);
+Function *newFunction(const char *name, int length);
+// Copies function along with its chunk and every function nested in it.
+Function *copyFunction(Function *function);
+void freeFunction(Function *function);
@@ -0,0 +1,115 @@
+#include "class.h"
+#include "table.h"
+#include "value.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static Shape *newShape(Shape *parent, String *name) {
+  Shape *shape = malloc(sizeof(Shape));
+  if (shape == NULL) {
+    exit(1);
+  }
+  shape->parent = parent;
+  shape->name = name;
+  shape->hash = name == NULL ? 0 : hashString(name->chars, name->length);
+  shape->slotCount = parent == NULL ? 0 : parent->slotCount + 1;
+  shape->transitions = NULL;
+  shape->transitionCount = 0;
+  shape->transitionCapacity = 0;
+  return shape;
+}
+
+static void freeShape(Shape *shape) {
+  for (int i = 0; i < shape->transitionCount; i++) {
+    freeShape(shape->transitions[i]);
+  }
+  free(shape->transitions);
+  free(shape);
+}
+
+Class *newClass(String *name) {
+  Class *klass = malloc(sizeof(Class));
+  if (klass == NULL) {
+    exit(1);
+  }
+  klass->name = name;
+  initTable(&klass->methods);
+  klass->root = newShape(NULL, NULL);
+  return klass;
+}
+
+void freeClass(Class *klass) {
+  freeTable(&klass->methods);
+  freeShape(klass->root);
+  free(klass);
+}
+
+Instance *newInstance(Class *klass) {
+  Instance *instance = malloc(sizeof(Instance));
+  if (instance == NULL) {
+    exit(1);
+  }
+  instance->klass = klass;
+  instance->shape = klass->root;
+  instance->fields = NULL;
+  instance->capacity = 0;
+  return instance;
+}
+
+void freeInstance(Instance *instance) {
+  free(instance->fields);
+  free(instance);
+}
+
+static bool sameName(Shape *shape, String *name, uint32_t hash) {
+  return shape->hash == hash && shape->name->length == name->length &&
+         memcmp(shape->name->chars, name->chars, name->length) == 0;
+}
+
+// Shapes are short chains, so walking back from the newest field is cheaper
+// than keeping a table per shape.
+int findField(Shape *shape, String *name) {
+  uint32_t hash = hashString(name->chars, name->length);
+  for (; shape->name != NULL; shape = shape->parent) {
+    if (sameName(shape, name, hash)) {
+      return shape->slotCount - 1;
+    }
+  }
+  return -1;
+}
+
+Shape *addField(Shape *shape, String *name) {
+  uint32_t hash = hashString(name->chars, name->length);
+  for (int i = 0; i < shape->transitionCount; i++) {
+    if (sameName(shape->transitions[i], name, hash)) {
+      return shape->transitions[i];
+    }
+  }
+
+  if (shape->transitionCapacity <= shape->transitionCount) {
+    shape->transitionCapacity =
+        shape->transitionCapacity < 4 ? 4 : shape->transitionCapacity * 2;
+    shape->transitions = realloc(
+        shape->transitions, shape->transitionCapacity * sizeof(Shape *));
+    if (shape->transitions == NULL) {
+      exit(1);
+    }
+  }
+  Shape *next = newShape(shape, name);
+  shape->transitions[shape->transitionCount++] = next;
+  return next;
+}
+
+void appendField(Instance *instance, Shape *shape, Value value) {
+  if (instance->capacity < shape->slotCount) {
+    instance->capacity = instance->capacity < 4 ? 4 : instance->capacity * 2;
+    instance->fields =
+        realloc(instance->fields, instance->capacity * sizeof(Value));
+    if (instance->fields == NULL) {
+      exit(1);
+    }
+  }
+  instance->fields[shape->slotCount - 1] = value;
+  instance->shape = shape;
+}
@@ -0,0 +1,51 @@
+#include "table.h"
+#include "value.h"
+#include <stdint.h>
+
+#pragma once
+
+// A hidden class: the fields an instance has, in the order they were added,
+// which gives each field its slot. Instances whose fields were added in the
+// same order share a shape, so a cache keyed by shape knows where a field is
+// without looking it up.
+typedef struct Shape {
+  struct Shape *parent;
+  // The field this shape adds to its parent, NULL for a class's root.
+  String *name;
+  uint32_t hash;
+  // Fields, and so slots, an instance of this shape has.
+  int slotCount;
+  // The shapes that add one more field to this one.
+  struct Shape **transitions;
+  int transitionCount;
+  int transitionCapacity;
+} Shape;
+
+struct Class {
+  String *name;
+  // Method names to their Functions.
+  Table methods;
+  // Every shape of the class's instances descends from this one, so a shape
+  // also identifies the class.
+  Shape *root;
+};
+
+struct Instance {
+  Class *klass;
+  Shape *shape;
+  Value *fields;
+  int capacity;
+};
+
+// The class borrows name, which has to outlive it.
+Class *newClass(String *name);
+void freeClass(Class *klass);
+Instance *newInstance(Class *klass);
+void freeInstance(Instance *instance);
+// The slot of the field called name in shape, or -1 if it has none.
+int findField(Shape *shape, String *name);
+// The shape of an instance of shape once the field name is added to it.
+Shape *addField(Shape *shape, String *name);
+// Moves instance to shape, which adds a field in its last slot, and stores
+// value there.
+void appendField(Instance *instance, Shape *shape, Value value);
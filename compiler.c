@@ -1,7 +1,10 @@
 #include "compiler.h"
 #include "chunk.h"
+#include "fragment.h"
 #include "scanner.h"
+#include "table.h"
 #include "value.h"
+#include "verifier.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,7 +24,9 @@ typedef enum {
   PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef struct Compiler Compiler;
+
+typedef void (*ParseFn)(Compiler *compiler, bool canAssign);
 
 typedef struct {
   ParseFn prefix;
@@ -35,59 +40,162 @@ typedef struct {
   bool hadError;
   bool panicMode;
 } Parser;
-Parser parser;
 
-Chunk *currentChunk;
+// What the compiler can prove about a value's type at compile time.
+typedef enum { TYPE_UNKNOWN, TYPE_NUMBER } StaticType;
+
+// Methods run with the receiver in local slot 0, named this. Initializers
+// also return it.
+typedef enum { KIND_FUNCTION, KIND_METHOD, KIND_INITIALIZER } FunctionKind;
 
 typedef struct {
   Token name;
   int depth;
+  // True while every value the local can hold is known to be a number.
+  bool isNumber;
 } Local;
 
+// Open-addressed map from a constant's value to its index in the chunk's
+// pool, so every distinct string or number is stored once per chunk.
+typedef struct {
+  int *slots; // pool index + 1, 0 when empty
+  int count;
+  int capacity;
+} ConstantMap;
+
+// Locals, identified by the source position of their declaration, that were
+// typed as numbers but later assigned something else. Code compiled before
+// the assignment already relied on the type, so compile() runs another pass
+// with these locals untyped.
+typedef struct {
+  const char **declarations;
+  int count;
+  int capacity;
+} DemotedLocals;
+
+// A top-level statement of the current pass, copied from the fragment cache
+// or compiled, with its offsets into the source being compiled.
 typedef struct {
-  Local locals[256];
+  // Index into the cache, or -1 when compiled.
+  int fragment;
+  int start;
+  int end;
+  int followEnd;
+  int line;
+  int lineSpan;
+  int codeStart;
+  int codeEnd;
+} StatementRecord;
+
+// The function being compiled when a function declared inside it starts,
+// set aside until the inner one is done.
+typedef struct EnclosingFunction {
+  struct EnclosingFunction *enclosing;
+  Function *function;
+  FunctionKind kind;
+  Chunk *chunk;
+  Local *locals;
   int localCount;
+  int localCapacity;
   int currentScopeDepth;
-} Compiler;
+  ConstantMap constants;
+} EnclosingFunction;
+
+// Everything one compile() call works on, so independent compilations can
+// run side by side.
+struct Compiler {
+  Scanner scanner;
+  Parser parser;
+  // The function being compiled, NULL for the script, and its chunk.
+  Function *function;
+  FunctionKind kind;
+  EnclosingFunction *enclosing;
+  Chunk *chunk;
+  FILE *errors;
+
+  Local *locals;
+  int localCount;
+  int localCapacity;
+  int currentScopeDepth;
+  ConstantMap constants;
+  // Static type of the expression compiled last.
+  StaticType exprType;
+  // Offsets just past the last call and the last patched jump target, so a
+  // return can tell whether its value is exactly a call's result.
+  int callEnd;
+  int jumpTarget;
+
+  DemotedLocals demotedLocals;
+  // Cleared after too many passes, which types every local as unknown.
+  bool inferNumbers;
+
+  // NULL unless compiling incrementally. The cached source and this one
+  // agree on the first unchangedPrefix bytes and on everything from
+  // unchangedSuffix in the cached one, which is shift bytes further on here.
+  FragmentCache *fragments;
+  const char *source;
+  int unchangedPrefix;
+  int unchangedSuffix;
+  int shift;
+  int nextFragment;
+  StatementRecord *records;
+  int recordCount;
+  int recordCapacity;
+};
 
-Compiler compiler;
+#define MAX_INFERENCE_PASSES 4
+
+static void initScope(Compiler *compiler) {
+  compiler->locals = NULL;
+  compiler->localCount = 0;
+  compiler->localCapacity = 0;
+  compiler->currentScopeDepth = 0;
+  compiler->constants.slots = NULL;
+  compiler->constants.count = 0;
+  compiler->constants.capacity = 0;
+  compiler->exprType = TYPE_UNKNOWN;
+  compiler->callEnd = -1;
+  compiler->jumpTarget = -1;
+}
 
-void initCompiler() {
-  compiler.localCount = 0;
-  compiler.currentScopeDepth = 0;
+static void freeScope(Compiler *compiler) {
+  free(compiler->locals);
+  free(compiler->constants.slots);
+  initScope(compiler);
 }
 
-static void advance() {
-  parser.previous = parser.current;
-  parser.current = scanToken();
+static void advance(Compiler *compiler) {
+  compiler->parser.previous = compiler->parser.current;
+  compiler->parser.current = scanToken(&compiler->scanner);
 }
 
-static void errorAt(Token *token, const char *message) {
-  if (parser.panicMode) {
+static void errorAt(Compiler *compiler, Token *token, const char *message) {
+  if (compiler->parser.panicMode) {
     return;
   }
-  parser.panicMode = true;
-  fprintf(stderr, "[Line %d] Error", token->line);
+  compiler->parser.panicMode = true;
+  FILE *errors = compiler->errors;
+  fprintf(errors, "[Line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
-    fprintf(stderr, " at end");
+    fprintf(errors, " at end");
   } else if (token->type == TOKEN_ERROR) {
     // Nothing
   } else {
-    fprintf(stderr, " at '%.*s'", token->length, token->start);
+    fprintf(errors, " at '%.*s'", token->length, token->start);
   }
-  fprintf(stderr, ": '%s'\n", message);
-  parser.hadError = true;
+  fprintf(errors, ": '%s'\n", message);
+  compiler->parser.hadError = true;
 }
 
-static void synchronize() {
-  parser.panicMode = false;
+static void synchronize(Compiler *compiler) {
+  compiler->parser.panicMode = false;
 
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMICOLON)
+  while (compiler->parser.current.type != TOKEN_EOF) {
+    if (compiler->parser.previous.type == TOKEN_SEMICOLON)
       return;
 
-    switch (parser.current.type) {
+    switch (compiler->parser.current.type) {
     case TOKEN_CLASS:
     case TOKEN_FUN:
     case TOKEN_VAR:
@@ -101,202 +209,732 @@ static void synchronize() {
       // Do nothing.
     }
     }
-    advance();
+    advance(compiler);
   }
 }
 
-static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk, byte, parser.previous.line);
+static void emitByte(Compiler *compiler, uint8_t byte) {
+  writeChunk(compiler->chunk, byte, compiler->parser.previous.line);
 }
 
-static void statement();
+static void statement(Compiler *compiler);
 static ParseRule *getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
-static void string(bool canAssign);
-static void number(bool canAssign);
-static void variable(bool canAssign);
-static void binary(bool canAssign);
-static void unary(bool canAssign);
-static void literal(bool canAssign);
-static void and_(bool canAssign);
-static void or_(bool canAssign);
-
-static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
-
-static uint8_t emitConstant(Value value) {
-  uint8_t index = writeValueArray(&currentChunk->constants, value);
+static void parsePrecedence(Compiler *compiler, Precedence precedence);
+static void string(Compiler *compiler, bool canAssign);
+static void number(Compiler *compiler, bool canAssign);
+static void variable(Compiler *compiler, bool canAssign);
+static void binary(Compiler *compiler, bool canAssign);
+static void unary(Compiler *compiler, bool canAssign);
+static void literal(Compiler *compiler, bool canAssign);
+static void and_(Compiler *compiler, bool canAssign);
+static void or_(Compiler *compiler, bool canAssign);
+static void grouping(Compiler *compiler, bool canAssign);
+static void call(Compiler *compiler, bool canAssign);
+static void arrayLiteral(Compiler *compiler, bool canAssign);
+static void subscript(Compiler *compiler, bool canAssign);
+static void mapLiteral(Compiler *compiler, bool canAssign);
+static void dot(Compiler *compiler, bool canAssign);
+static void this_(Compiler *compiler, bool canAssign);
+static void emitNumber(Compiler *compiler, double value);
+static bool identifiersEqual(Token *a, Token *b);
+static int resolveLocal(Compiler *compiler, Token *name);
+
+static void expression(Compiler *compiler) {
+  parsePrecedence(compiler, PREC_ASSIGNMENT);
+}
+
+static uint32_t hashConstant(Value value) {
+  if (value.type == VAL_STRING) {
+    return hashString(value.as.string->chars, value.as.string->length);
+  }
+  uint64_t bits;
+  memcpy(&bits, &value.as.number, sizeof(bits));
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+static bool constantsEqual(Value a, Value b) {
+  if (a.type != b.type) {
+    return false;
+  }
+  if (a.type == VAL_STRING) {
+    return a.as.string->length == b.as.string->length &&
+           memcmp(a.as.string->chars, b.as.string->chars,
+                  a.as.string->length) == 0;
+  }
+  return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+}
+
+// Returns the slot holding value, or the empty slot where it belongs.
+static int *findConstantSlot(Compiler *compiler, int *slots, int capacity,
+                             Value value) {
+  uint32_t index = hashConstant(value) & (capacity - 1);
+  for (;;) {
+    int *slot = &slots[index];
+    if (*slot == 0 ||
+        constantsEqual(compiler->chunk->constants.values[*slot - 1], value)) {
+      return slot;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void growConstantMap(Compiler *compiler) {
+  ConstantMap *map = &compiler->constants;
+  int capacity = map->capacity < 16 ? 16 : map->capacity * 2;
+  int *slots = calloc(capacity, sizeof(int));
+  if (slots == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < map->capacity; i++) {
+    int index = map->slots[i];
+    if (index != 0) {
+      Value value = compiler->chunk->constants.values[index - 1];
+      *findConstantSlot(compiler, slots, capacity, value) = index;
+    }
+  }
+  free(map->slots);
+  map->slots = slots;
+  map->capacity = capacity;
+}
+
+// Sizes the map for count constants up front, so copying cached statements
+// into the pool does not keep rehashing it.
+static void reserveConstants(Compiler *compiler, int count) {
+  while (compiler->constants.capacity * 0.75 < count) {
+    growConstantMap(compiler);
+  }
+}
+
+static int addConstant(Compiler *compiler, Value value) {
+  int index = writeValueArray(&compiler->chunk->constants, value);
+  if (index > UINT24_MAX) {
+    errorAt(compiler, &compiler->parser.previous,
+            "Too many constants in one chunk.");
+    return 0;
+  }
+  return index;
+}
+
+// Adds a string or number to the pool unless an equal constant is already
+// there. Strings are looked up through a borrowed key, so a repeated name
+// costs no allocation. Functions are never shared and are always copied.
+static int emitConstant(Compiler *compiler, Value key) {
+  if (key.type == VAL_FUNCTION) {
+    return addConstant(compiler, copyValue(key));
+  }
+  ConstantMap *map = &compiler->constants;
+  if (map->count + 1 > map->capacity * 0.75) {
+    growConstantMap(compiler);
+  }
+  int *slot = findConstantSlot(compiler, map->slots, map->capacity, key);
+  if (*slot != 0) {
+    return *slot - 1;
+  }
+
+  // After an overflow the slot maps to 0, but the compilation has failed.
+  int index = addConstant(compiler, copyValue(key));
+  *slot = index + 1;
+  map->count++;
   return index;
 }
 
-static void consume(TokenType type, const char *errorMessage) {
-  if (parser.current.type == type) {
-    advance();
+static int stringConstant(Compiler *compiler, const char *chars, int length) {
+  String name = {(char *)chars, length};
+  Value key;
+  key.type = VAL_STRING;
+  key.as.string = &name;
+  return emitConstant(compiler, key);
+}
+
+// Emits the one-byte operand form when the operand fits and the 24-bit
+// _LONG form otherwise.
+static void emitOperand(Compiler *compiler, uint8_t instruction,
+                        uint8_t longInstruction, int operand) {
+  if (operand <= UINT8_MAX) {
+    emitByte(compiler, instruction);
+    emitByte(compiler, (uint8_t)operand);
+  } else {
+    emitByte(compiler, longInstruction);
+    emitByte(compiler, (operand >> 16) & 0xFF);
+    emitByte(compiler, (operand >> 8) & 0xFF);
+    emitByte(compiler, operand & 0xFF);
+  }
+}
+
+static void consume(Compiler *compiler, TokenType type,
+                    const char *errorMessage) {
+  if (compiler->parser.current.type == type) {
+    advance(compiler);
     return;
   }
-  errorAt(&parser.current, errorMessage);
+  errorAt(compiler, &compiler->parser.current, errorMessage);
 }
 
-static void printStatement() {
-  expression();
-  emitByte(OP_PRINT);
-  consume(TOKEN_SEMICOLON, "Expect ';' after value in print statement");
+static bool match(Compiler *compiler, TokenType type) {
+  if (compiler->parser.current.type != type) {
+    return false;
+  }
+  advance(compiler);
+  return true;
 }
 
-void addLocal(Token token) {
-  if (compiler.localCount >= 256) {
-    // TODO: write error function
-    // error("Too many local variables in function.");
+static void printStatement(Compiler *compiler) {
+  expression(compiler);
+  emitByte(compiler, OP_PRINT);
+  consume(compiler, TOKEN_SEMICOLON,
+          "Expect ';' after value in print statement");
+}
+
+static void addLocal(Compiler *compiler, Token token) {
+  if (compiler->localCount > UINT24_MAX) {
+    errorAt(compiler, &token, "Too many local variables.");
     return;
   }
-  Local *local = &compiler.locals[compiler.localCount];
+  if (compiler->localCapacity <= compiler->localCount) {
+    int oldCapacity = compiler->localCapacity;
+    compiler->localCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+    compiler->locals =
+        realloc(compiler->locals, compiler->localCapacity * sizeof(Local));
+    if (compiler->locals == NULL) {
+      exit(1);
+    }
+  }
+  Local *local = &compiler->locals[compiler->localCount];
   local->name = token;
-  local->depth = compiler.currentScopeDepth;
-  compiler.localCount++;
+  local->depth = compiler->currentScopeDepth;
+  local->isNumber = false;
+  compiler->localCount++;
+}
+
+static bool isDemoted(Compiler *compiler, Token *name) {
+  for (int i = 0; i < compiler->demotedLocals.count; i++) {
+    if (compiler->demotedLocals.declarations[i] == name->start) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void demoteLocal(Compiler *compiler, Local *local) {
+  local->isNumber = false;
+  if (compiler->demotedLocals.capacity <= compiler->demotedLocals.count) {
+    int oldCapacity = compiler->demotedLocals.capacity;
+    compiler->demotedLocals.capacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+    compiler->demotedLocals.declarations =
+        realloc(compiler->demotedLocals.declarations,
+                compiler->demotedLocals.capacity * sizeof(const char *));
+    if (compiler->demotedLocals.declarations == NULL) {
+      exit(1);
+    }
+  }
+  DemotedLocals *demoted = &compiler->demotedLocals;
+  demoted->declarations[demoted->count++] = local->name.start;
 }
 
-static void varStatement() {
-  consume(TOKEN_IDENTIFIER, "Expect variable name.");
-  if (compiler.currentScopeDepth == 0) {
-    uint8_t globalIndex =
-        emitConstant(makeString(parser.previous.start, parser.previous.length));
+static void varStatement(Compiler *compiler) {
+  consume(compiler, TOKEN_IDENTIFIER, "Expect variable name.");
+  if (compiler->currentScopeDepth == 0) {
+    Token *name = &compiler->parser.previous;
+    int globalIndex = stringConstant(compiler, name->start, name->length);
 
-    if (parser.current.type == TOKEN_EQUAL) {
-      consume(TOKEN_EQUAL, "Expect '=' after variable name");
-      expression();
+    if (compiler->parser.current.type == TOKEN_EQUAL) {
+      consume(compiler, TOKEN_EQUAL, "Expect '=' after variable name");
+      expression(compiler);
     } else {
-      emitByte(OP_NIL);
+      emitByte(compiler, OP_NIL);
     }
 
-    emitByte(OP_DEFINE_GLOBAL);
-    emitByte(globalIndex);
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    emitOperand(compiler, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, globalIndex);
+    consume(compiler, TOKEN_SEMICOLON,
+            "Expect ';' after variable declaration.");
   } else {
     // declare local variable
-    Local local;
-    local.name = parser.previous;
-    local.depth = compiler.currentScopeDepth;
-    compiler.locals[compiler.localCount++] = local;
-
-    if (parser.current.type == TOKEN_EQUAL) {
-      consume(TOKEN_EQUAL, "Expect '=' after variable name");
-      expression();
+    addLocal(compiler, compiler->parser.previous);
+    Token name = compiler->parser.previous;
+
+    if (compiler->parser.current.type == TOKEN_EQUAL) {
+      consume(compiler, TOKEN_EQUAL, "Expect '=' after variable name");
+      expression(compiler);
     } else {
-      emitByte(OP_NIL);
+      emitByte(compiler, OP_NIL);
+      compiler->exprType = TYPE_UNKNOWN;
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    compiler->locals[compiler->localCount - 1].isNumber =
+        compiler->inferNumbers && compiler->exprType == TYPE_NUMBER &&
+        !isDemoted(compiler, &name);
+    consume(compiler, TOKEN_SEMICOLON,
+            "Expect ';' after variable declaration.");
   }
 }
 
-static void patchJump(int offset) {
-  int jump = currentChunk->count - offset - 2;
+static void patchJump(Compiler *compiler, int offset) {
+  int jump = compiler->chunk->count - offset - 2;
   if (jump > UINT16_MAX) {
-    errorAt(&parser.previous, "Jump too large");
+    errorAt(compiler, &compiler->parser.previous, "Jump too large");
   }
-  currentChunk->code[offset] = (jump >> 8) & 0xFF;
-  currentChunk->code[offset + 1] = jump & 0xFF;
+  compiler->chunk->code[offset] = (jump >> 8) & 0xFF;
+  compiler->chunk->code[offset + 1] = jump & 0xFF;
+  compiler->jumpTarget = compiler->chunk->count;
 }
 
-static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
-  emitByte(0xFF);
-  emitByte(0xFF);
-  return currentChunk->count - 2;
+static int emitJump(Compiler *compiler, uint8_t instruction) {
+  emitByte(compiler, instruction);
+  emitByte(compiler, 0xFF);
+  emitByte(compiler, 0xFF);
+  return compiler->chunk->count - 2;
 }
 
-static void ifStatement() {
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after if.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition");
+static void ifStatement(Compiler *compiler) {
+  consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after if.");
+  expression(compiler);
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after condition");
 
-  int thenJumpIndex = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
+  int thenJumpIndex = emitJump(compiler, OP_JUMP_IF_FALSE);
+  emitByte(compiler, OP_POP);
+  statement(compiler);
 
-  int elseJumpIndex = emitJump(OP_JUMP);
-  patchJump(thenJumpIndex);
-  emitByte(OP_POP);
+  int elseJumpIndex = emitJump(compiler, OP_JUMP);
+  patchJump(compiler, thenJumpIndex);
+  emitByte(compiler, OP_POP);
 
-  if (parser.current.type == TOKEN_ELSE) {
-    advance();
-    statement();
+  if (compiler->parser.current.type == TOKEN_ELSE) {
+    advance(compiler);
+    statement(compiler);
   }
 
-  patchJump(elseJumpIndex);
+  patchJump(compiler, elseJumpIndex);
 }
 
-static void expressionStatement() {
-  expression();
-  advance();
+static void expressionStatement(Compiler *compiler) {
+  expression(compiler);
+  emitByte(compiler, OP_POP);
+  consume(compiler, TOKEN_SEMICOLON, "Expect ';' after expression.");
 }
 
-static void beginScope() { compiler.currentScopeDepth++; }
+static void beginScope(Compiler *compiler) { compiler->currentScopeDepth++; }
 
-static void endScope() {
-  compiler.currentScopeDepth--;
-  while (compiler.localCount > 0 &&
-         compiler.locals[compiler.localCount - 1].depth >
-             compiler.currentScopeDepth) {
-    emitByte(OP_POP);
-    compiler.localCount--;
+static void endScope(Compiler *compiler) {
+  compiler->currentScopeDepth--;
+  while (compiler->localCount > 0 &&
+         compiler->locals[compiler->localCount - 1].depth >
+             compiler->currentScopeDepth) {
+    emitByte(compiler, OP_POP);
+    compiler->localCount--;
   }
 }
 
-static void block() {
-  while (parser.current.type != TOKEN_RIGHT_BRACE) {
-    statement();
+static void block(Compiler *compiler) {
+  while (compiler->parser.current.type != TOKEN_RIGHT_BRACE &&
+         compiler->parser.current.type != TOKEN_EOF) {
+    statement(compiler);
   }
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
-  int offset = currentChunk->count - loopStart + 2;
+static void emitLoop(Compiler *compiler, int loopStart) {
+  emitByte(compiler, OP_LOOP);
+  int offset = compiler->chunk->count - loopStart + 2;
   if (offset > UINT16_MAX) {
-    errorAt(&parser.previous, "Loop body too large.");
+    errorAt(compiler, &compiler->parser.previous, "Loop body too large.");
   }
-  emitByte((offset >> 8) & 0xFF);
-  emitByte(offset & 0xFF);
+  emitByte(compiler, (offset >> 8) & 0xFF);
+  emitByte(compiler, offset & 0xFF);
 };
 
-static void whileStatement() {
-  int loopStart = currentChunk->count;
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
-  emitLoop(loopStart);
-
-  patchJump(exitJump);
-  emitByte(OP_POP);
-}
-
-static void statement() {
-  if (parser.current.type == TOKEN_PRINT) {
-    advance();
-    printStatement();
-  } else if (parser.current.type == TOKEN_VAR) {
-    advance();
-    varStatement();
-  } else if (parser.current.type == TOKEN_LEFT_BRACE) {
-    advance();
-    beginScope();
-    block();
-    endScope();
-  } else if (parser.current.type == TOKEN_IF) {
-    advance();
-    ifStatement();
-  } else if (parser.current.type == TOKEN_WHILE) {
-    advance();
-    whileStatement();
+static void emitReturn(Compiler *compiler) {
+  if (compiler->kind == KIND_INITIALIZER) {
+    emitByte(compiler, OP_GET_LOCAL);
+    emitByte(compiler, 0);
+  } else {
+    emitByte(compiler, OP_NIL);
+  }
+  emitByte(compiler, OP_RETURN_VALUE);
+}
+
+static void whileStatement(Compiler *compiler) {
+  int loopStart = compiler->chunk->count;
+  consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  expression(compiler);
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  int exitJump = emitJump(compiler, OP_JUMP_IF_FALSE);
+  emitByte(compiler, OP_POP);
+  statement(compiler);
+  emitLoop(compiler, loopStart);
+
+  patchJump(compiler, exitJump);
+  emitByte(compiler, OP_POP);
+}
+
+// A for loop of the form `for (var i = ...; i < limit; i = i + step)`, where
+// i and limit are proven numbers and step is a small integer.
+typedef struct {
+  int counter;
+  // The limit's slot, or -1 when it is the number literal in limitToken.
+  int limit;
+  Token limitToken;
+  ForCompare compare;
+  int16_t step;
+} CountedLoop;
+
+// A local OP_FOR_LOOP can address and rely on being a number.
+static int numberSlot(Compiler *compiler, Token *name) {
+  int slot = resolveLocal(compiler, name);
+  if (slot == -1 || slot > UINT8_MAX || !compiler->locals[slot].isNumber) {
+    return -1;
+  }
+  return slot;
+}
+
+// Looks ahead, without consuming anything, for the condition and increment
+// of a counted loop over the local in slot counter.
+static bool matchCountedLoop(Compiler *compiler, int counter,
+                             CountedLoop *loop) {
+  Token *name = &compiler->locals[counter].name;
+  if (counter > UINT8_MAX || !compiler->locals[counter].isNumber) {
+    return false;
+  }
+  Token tokens[11];
+  tokens[0] = compiler->parser.current;
+  Scanner ahead = compiler->scanner;
+  for (int i = 1; i < 11; i++) {
+    tokens[i] = scanToken(&ahead);
+  }
+
+  if (tokens[0].type != TOKEN_IDENTIFIER ||
+      !identifiersEqual(&tokens[0], name)) {
+    return false;
+  }
+  switch (tokens[1].type) {
+  case TOKEN_LESS: {
+    loop->compare = FOR_LESS;
+    break;
+  }
+  case TOKEN_LESS_EQUAL: {
+    loop->compare = FOR_LESS_EQUAL;
+    break;
+  }
+  case TOKEN_GREATER: {
+    loop->compare = FOR_GREATER;
+    break;
+  }
+  case TOKEN_GREATER_EQUAL: {
+    loop->compare = FOR_GREATER_EQUAL;
+    break;
+  }
+  default: {
+    return false;
+  }
+  }
+  loop->counter = counter;
+  loop->limit = -1;
+  loop->limitToken = tokens[2];
+  if (tokens[2].type == TOKEN_IDENTIFIER) {
+    loop->limit = numberSlot(compiler, &tokens[2]);
+    if (loop->limit == -1) {
+      return false;
+    }
+  } else if (tokens[2].type != TOKEN_NUMBER) {
+    return false;
+  }
+
+  if (tokens[3].type != TOKEN_SEMICOLON ||
+      tokens[4].type != TOKEN_IDENTIFIER ||
+      !identifiersEqual(&tokens[4], name) || tokens[5].type != TOKEN_EQUAL ||
+      tokens[6].type != TOKEN_IDENTIFIER ||
+      !identifiersEqual(&tokens[6], name) ||
+      (tokens[7].type != TOKEN_PLUS && tokens[7].type != TOKEN_MINUS) ||
+      tokens[8].type != TOKEN_NUMBER || tokens[9].type != TOKEN_RIGHT_PAREN) {
+    return false;
+  }
+  double step = strtod(tokens[8].start, NULL);
+  if (tokens[7].type == TOKEN_MINUS) {
+    step = -step;
+  }
+  if (!(step >= INT16_MIN && step <= INT16_MAX) || step != (int16_t)step) {
+    return false;
+  }
+  loop->step = (int16_t)step;
+  return true;
+}
+
+// The condition is compiled as usual for the test before the first
+// iteration; every later one is a single OP_FOR_LOOP at the end of the body.
+static void countedLoop(Compiler *compiler, CountedLoop *loop) {
+  if (loop->limit == -1) {
+    // A literal limit lives in a local no name can refer to.
+    addLocal(compiler, (Token){.start = "", .length = 0});
+    emitNumber(compiler, strtod(loop->limitToken.start, NULL));
+    loop->limit = compiler->localCount - 1;
+    if (loop->limit > UINT8_MAX) {
+      errorAt(compiler, &loop->limitToken, "Too many local variables.");
+    }
+  }
+  expression(compiler);
+  consume(compiler, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+  int exitJump = emitJump(compiler, OP_JUMP_IF_FALSE);
+  emitByte(compiler, OP_POP);
+  // The increment was matched token for token, so it needs no compiling.
+  for (int i = 0; i < 6; i++) {
+    advance(compiler);
+  }
+
+  int bodyStart = compiler->chunk->count;
+  statement(compiler);
+  emitByte(compiler, OP_FOR_LOOP);
+  emitByte(compiler, (uint8_t)loop->counter);
+  emitByte(compiler, (uint8_t)loop->limit);
+  emitByte(compiler, ((uint16_t)loop->step >> 8) & 0xFF);
+  emitByte(compiler, (uint16_t)loop->step & 0xFF);
+  emitByte(compiler, (uint8_t)loop->compare);
+  int offset = compiler->chunk->count - bodyStart + 2;
+  if (offset > UINT16_MAX) {
+    errorAt(compiler, &compiler->parser.previous, "Loop body too large.");
+  }
+  emitByte(compiler, (offset >> 8) & 0xFF);
+  emitByte(compiler, offset & 0xFF);
+
+  int endJump = emitJump(compiler, OP_JUMP);
+  patchJump(compiler, exitJump);
+  emitByte(compiler, OP_POP);
+  patchJump(compiler, endJump);
+}
+
+static void forStatement(Compiler *compiler) {
+  beginScope(compiler);
+  consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  int counter = -1;
+  if (match(compiler, TOKEN_VAR)) {
+    int localCount = compiler->localCount;
+    varStatement(compiler);
+    if (compiler->localCount > localCount) {
+      counter = compiler->localCount - 1;
+    }
+  } else if (!match(compiler, TOKEN_SEMICOLON)) {
+    expressionStatement(compiler);
+  }
+
+  CountedLoop loop;
+  if (counter != -1 && !compiler->parser.panicMode &&
+      matchCountedLoop(compiler, counter, &loop)) {
+    countedLoop(compiler, &loop);
+    endScope(compiler);
+    return;
+  }
+
+  int loopStart = compiler->chunk->count;
+  int exitJump = -1;
+  if (!match(compiler, TOKEN_SEMICOLON)) {
+    expression(compiler);
+    consume(compiler, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    exitJump = emitJump(compiler, OP_JUMP_IF_FALSE);
+    emitByte(compiler, OP_POP);
+  }
+  if (!match(compiler, TOKEN_RIGHT_PAREN)) {
+    int bodyJump = emitJump(compiler, OP_JUMP);
+    int incrementStart = compiler->chunk->count;
+    expression(compiler);
+    emitByte(compiler, OP_POP);
+    consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    emitLoop(compiler, loopStart);
+    loopStart = incrementStart;
+    patchJump(compiler, bodyJump);
+  }
+
+  statement(compiler);
+  emitLoop(compiler, loopStart);
+  if (exitJump != -1) {
+    patchJump(compiler, exitJump);
+    emitByte(compiler, OP_POP);
+  }
+  endScope(compiler);
+}
+
+// Compiles into function's chunk from here on, with the function itself in
+// local slot 0.
+static void enterFunction(Compiler *compiler, EnclosingFunction *enclosing,
+                          Function *function) {
+  enclosing->enclosing = compiler->enclosing;
+  enclosing->function = compiler->function;
+  enclosing->kind = compiler->kind;
+  enclosing->chunk = compiler->chunk;
+  enclosing->locals = compiler->locals;
+  enclosing->localCount = compiler->localCount;
+  enclosing->localCapacity = compiler->localCapacity;
+  enclosing->currentScopeDepth = compiler->currentScopeDepth;
+  enclosing->constants = compiler->constants;
+  compiler->enclosing = enclosing;
+  compiler->function = function;
+  compiler->chunk = &function->chunk;
+  initScope(compiler);
+  addLocal(compiler, (Token){.start = "", .length = 0});
+}
+
+static void leaveFunction(Compiler *compiler) {
+  EnclosingFunction *enclosing = compiler->enclosing;
+  freeScope(compiler);
+  compiler->enclosing = enclosing->enclosing;
+  compiler->function = enclosing->function;
+  compiler->kind = enclosing->kind;
+  compiler->chunk = enclosing->chunk;
+  compiler->locals = enclosing->locals;
+  compiler->localCount = enclosing->localCount;
+  compiler->localCapacity = enclosing->localCapacity;
+  compiler->currentScopeDepth = enclosing->currentScopeDepth;
+  compiler->constants = enclosing->constants;
+  // Both pointed into the inner function's chunk.
+  compiler->callEnd = -1;
+  compiler->jumpTarget = -1;
+}
+
+// Compiles the parameters and body of the function called name and leaves
+// the function on the stack.
+static void function(Compiler *compiler, Token name, FunctionKind kind) {
+  Function *function = newFunction(name.start, name.length);
+  EnclosingFunction enclosing;
+  enterFunction(compiler, &enclosing, function);
+  compiler->kind = kind;
+  if (kind != KIND_FUNCTION) {
+    compiler->locals[0].name = (Token){.start = "this", .length = 4};
+  }
+  beginScope(compiler);
+
+  consume(compiler, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (compiler->parser.current.type != TOKEN_RIGHT_PAREN) {
+    do {
+      if (function->arity == UINT8_MAX) {
+        errorAt(compiler, &compiler->parser.current,
+                "Can't have more than 255 parameters.");
+      }
+      function->arity++;
+      consume(compiler, TOKEN_IDENTIFIER, "Expect parameter name.");
+      addLocal(compiler, compiler->parser.previous);
+    } while (match(compiler, TOKEN_COMMA));
+  }
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(compiler, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block(compiler);
+  // Falling off the end returns nil, or the receiver from an initializer.
+  emitReturn(compiler);
+
+  leaveFunction(compiler);
+  emitOperand(compiler, OP_CONSTANT, OP_CONSTANT_LONG,
+              addConstant(compiler, makeFunction(function)));
+  compiler->exprType = TYPE_UNKNOWN;
+}
+
+static void funDeclaration(Compiler *compiler) {
+  consume(compiler, TOKEN_IDENTIFIER, "Expect function name.");
+  Token name = compiler->parser.previous;
+  if (compiler->currentScopeDepth == 0) {
+    function(compiler, name, KIND_FUNCTION);
+    emitOperand(compiler, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG,
+                stringConstant(compiler, name.start, name.length));
+  } else {
+    addLocal(compiler, name);
+    function(compiler, name, KIND_FUNCTION);
+  }
+}
+
+static void method(Compiler *compiler) {
+  consume(compiler, TOKEN_IDENTIFIER, "Expect method name.");
+  Token name = compiler->parser.previous;
+  bool isInitializer =
+      name.length == 4 && memcmp(name.start, "init", 4) == 0;
+  function(compiler, name, isInitializer ? KIND_INITIALIZER : KIND_METHOD);
+  emitByte(compiler, OP_METHOD);
+}
+
+// The class stays on the stack while its methods are added, then becomes a
+// global or local like a function would.
+static void classDeclaration(Compiler *compiler) {
+  consume(compiler, TOKEN_IDENTIFIER, "Expect class name.");
+  Token name = compiler->parser.previous;
+  if (compiler->currentScopeDepth > 0) {
+    addLocal(compiler, name);
+  }
+  int nameConstant = stringConstant(compiler, name.start, name.length);
+  emitOperand(compiler, OP_CLASS, OP_CLASS_LONG, nameConstant);
+
+  consume(compiler, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (compiler->parser.current.type != TOKEN_RIGHT_BRACE &&
+         compiler->parser.current.type != TOKEN_EOF) {
+    method(compiler);
+  }
+  consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  if (compiler->currentScopeDepth == 0) {
+    emitOperand(compiler, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG,
+                nameConstant);
+  }
+  compiler->exprType = TYPE_UNKNOWN;
+}
+
+static void returnStatement(Compiler *compiler) {
+  if (compiler->function == NULL) {
+    errorAt(compiler, &compiler->parser.previous,
+            "Can't return from top-level code.");
+  }
+  if (match(compiler, TOKEN_SEMICOLON)) {
+    emitReturn(compiler);
+    return;
+  }
+  if (compiler->kind == KIND_INITIALIZER) {
+    errorAt(compiler, &compiler->parser.previous,
+            "Can't return a value from an initializer.");
+  }
+
+  expression(compiler);
+  // A call whose result is returned as is, and which no jump skips, can
+  // hand its frame over to the callee.
+  Chunk *chunk = compiler->chunk;
+  if (compiler->callEnd == chunk->count &&
+      compiler->jumpTarget != chunk->count) {
+    chunk->code[chunk->count - 2] = OP_TAIL_CALL;
+  } else {
+    emitByte(compiler, OP_RETURN_VALUE);
+  }
+  consume(compiler, TOKEN_SEMICOLON, "Expect ';' after return value.");
+}
+
+static void statement(Compiler *compiler) {
+  if (compiler->parser.current.type == TOKEN_PRINT) {
+    advance(compiler);
+    printStatement(compiler);
+  } else if (compiler->parser.current.type == TOKEN_VAR) {
+    advance(compiler);
+    varStatement(compiler);
+  } else if (compiler->parser.current.type == TOKEN_LEFT_BRACE) {
+    advance(compiler);
+    beginScope(compiler);
+    block(compiler);
+    endScope(compiler);
+  } else if (compiler->parser.current.type == TOKEN_IF) {
+    advance(compiler);
+    ifStatement(compiler);
+  } else if (compiler->parser.current.type == TOKEN_WHILE) {
+    advance(compiler);
+    whileStatement(compiler);
+  } else if (compiler->parser.current.type == TOKEN_FOR) {
+    advance(compiler);
+    forStatement(compiler);
+  } else if (compiler->parser.current.type == TOKEN_FUN) {
+    advance(compiler);
+    funDeclaration(compiler);
+  } else if (compiler->parser.current.type == TOKEN_CLASS) {
+    advance(compiler);
+    classDeclaration(compiler);
+  } else if (compiler->parser.current.type == TOKEN_RETURN) {
+    advance(compiler);
+    returnStatement(compiler);
   } else {
-    expressionStatement();
+    expressionStatement(compiler);
   }
 
-  if (parser.panicMode) {
-    synchronize();
+  if (compiler->parser.panicMode) {
+    synchronize(compiler);
   }
 }
 
@@ -307,70 +945,91 @@ ParseRule rules[] = {[TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
                      [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
                      [TOKEN_STRING] = {string, NULL, PREC_NONE},
                      [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
+                     [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
+                     [TOKEN_LEFT_BRACKET] = {arrayLiteral, subscript,
+                                             PREC_CALL},
+                     [TOKEN_LEFT_BRACE] = {mapLiteral, NULL, PREC_NONE},
+                     [TOKEN_DOT] = {NULL, dot, PREC_CALL},
+                     [TOKEN_THIS] = {this_, NULL, PREC_NONE},
                      [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
+                     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
+                     [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
+                     [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
                      [TOKEN_BANG] = {unary, NULL, PREC_NONE},
+                     [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
+                     [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
                      [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
                      [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
+                     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
                      [TOKEN_AND] = {NULL, and_, PREC_AND},
                      [TOKEN_OR] = {NULL, or_, PREC_OR},
                      [TOKEN_GREATER] = {NULL, binary, PREC_COMPARISON},
-                     [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON}
+                     [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
+                     [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
+                     [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON}
 
 };
 
 static ParseRule *getRule(TokenType type) { return &rules[type]; }
 
-static void parsePrecedence(Precedence precedence) {
-  advance();
-  ParseFn prefixFn = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Compiler *compiler, Precedence precedence) {
+  advance(compiler);
+  ParseFn prefixFn = getRule(compiler->parser.previous.type)->prefix;
   if (prefixFn == NULL) {
     // TODO: Handle error: expected expression, maybe needs a fix
-    errorAt(&parser.previous, "Expected expression");
+    errorAt(compiler, &compiler->parser.previous, "Expected expression");
     return;
   }
   bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefixFn(canAssign);
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    advance();
-    ParseFn infixFn = getRule(parser.previous.type)->infix;
-    infixFn(canAssign);
-    canAssign = false;
+  prefixFn(compiler, canAssign);
+  while (precedence <= getRule(compiler->parser.current.type)->precedence) {
+    advance(compiler);
+    ParseFn infixFn = getRule(compiler->parser.previous.type)->infix;
+    infixFn(compiler, canAssign);
   }
-  if (!canAssign && parser.current.type == TOKEN_EQUAL) {
-    errorAt(&parser.current, "Invalid assignment target.");
+  // Targets that can be assigned consume the '=' themselves.
+  if (compiler->parser.current.type == TOKEN_EQUAL) {
+    errorAt(compiler, &compiler->parser.current, "Invalid assignment target.");
   }
 }
 
-static void or_(bool canAssign) {
+static void or_(Compiler *compiler, bool canAssign) {
   (void)canAssign;
-  int elseJump = emitJump(OP_JUMP_IF_FALSE);
-  int endJump = emitJump(OP_JUMP);
+  int elseJump = emitJump(compiler, OP_JUMP_IF_FALSE);
+  int endJump = emitJump(compiler, OP_JUMP);
 
-  patchJump(elseJump);
-  emitByte(OP_POP);
+  patchJump(compiler, elseJump);
+  emitByte(compiler, OP_POP);
 
-  parsePrecedence(PREC_OR);
-  patchJump(endJump);
+  parsePrecedence(compiler, PREC_OR);
+  patchJump(compiler, endJump);
+  compiler->exprType = TYPE_UNKNOWN;
 }
 
-static void and_(bool canAssign) {
+static void and_(Compiler *compiler, bool canAssign) {
   (void)canAssign;
-  int endJump = emitJump(OP_JUMP_IF_FALSE);
+  int endJump = emitJump(compiler, OP_JUMP_IF_FALSE);
 
-  emitByte(OP_POP);
-  parsePrecedence(PREC_AND);
-  patchJump(endJump);
+  emitByte(compiler, OP_POP);
+  parsePrecedence(compiler, PREC_AND);
+  patchJump(compiler, endJump);
+  compiler->exprType = TYPE_UNKNOWN;
 }
 
-static void literal(bool canAssign) {
+static void literal(Compiler *compiler, bool canAssign) {
   (void)canAssign;
-  switch (parser.previous.type) {
+  compiler->exprType = TYPE_UNKNOWN;
+  switch (compiler->parser.previous.type) {
   case TOKEN_TRUE: {
-    emitByte(OP_TRUE);
+    emitByte(compiler, OP_TRUE);
     break;
   }
   case TOKEN_FALSE: {
-    emitByte(OP_FALSE);
+    emitByte(compiler, OP_FALSE);
+    break;
+  }
+  case TOKEN_NIL: {
+    emitByte(compiler, OP_NIL);
     break;
   }
   default: {
@@ -379,18 +1038,92 @@ static void literal(bool canAssign) {
   }
 }
 
-static void string(bool canAssign) {
+static void string(Compiler *compiler, bool canAssign) {
   (void)canAssign;
-  emitByte(OP_CONSTANT);
-  emitByte(emitConstant(
-      makeString(parser.previous.start + 1, parser.previous.length - 2)));
+  Token *token = &compiler->parser.previous;
+  int index = stringConstant(compiler, token->start + 1, token->length - 2);
+  emitOperand(compiler, OP_CONSTANT, OP_CONSTANT_LONG, index);
+  compiler->exprType = TYPE_UNKNOWN;
+}
+
+static void emitWithImmediate(Compiler *compiler, uint8_t instruction,
+                              int16_t immediate) {
+  emitByte(compiler, instruction);
+  emitByte(compiler, (immediate >> 8) & 0xFF);
+  emitByte(compiler, immediate & 0xFF);
+}
+
+// Small integral literals go in the instruction stream instead of the pool.
+// INT16_MIN is left out so every immediate can be negated.
+static bool emitImmediate(Compiler *compiler, double value) {
+  if (value <= INT16_MIN || value > INT16_MAX || value != (int16_t)value) {
+    return false;
+  }
+  int16_t immediate = (int16_t)value;
+  if (immediate == 0) {
+    emitByte(compiler, OP_ZERO);
+  } else if (immediate == 1) {
+    emitByte(compiler, OP_ONE);
+  } else if (immediate >= INT8_MIN && immediate <= INT8_MAX) {
+    emitByte(compiler, OP_INT8);
+    emitByte(compiler, (uint8_t)immediate);
+  } else {
+    emitWithImmediate(compiler, OP_INT16, immediate);
+  }
+  return true;
+}
+
+// Reports whether the code from start to the end of the chunk is exactly one
+// immediate load, and if so which value it loads.
+static bool isImmediateOperand(Compiler *compiler, int start,
+                               int16_t *immediate) {
+  uint8_t *code = compiler->chunk->code + start;
+  int length = compiler->chunk->count - start;
+  if (length == 1 && code[0] == OP_ZERO) {
+    *immediate = 0;
+    return true;
+  }
+  if (length == 1 && code[0] == OP_ONE) {
+    *immediate = 1;
+    return true;
+  }
+  if (length == 2 && code[0] == OP_INT8) {
+    *immediate = (int8_t)code[1];
+    return true;
+  }
+  if (length == 3 && code[0] == OP_INT16) {
+    *immediate = (int16_t)((code[1] << 8) | code[2]);
+    return true;
+  }
+  return false;
+}
+
+// Emits instruction, or its fused _IMM form in place of the operand load when
+// the right operand compiled to a single immediate.
+static void emitBinary(Compiler *compiler, uint8_t instruction,
+                       uint8_t immediateInstruction, int operandStart) {
+  int16_t immediate;
+  if (!isImmediateOperand(compiler, operandStart, &immediate)) {
+    emitByte(compiler, instruction);
+    return;
+  }
+  truncateChunk(compiler->chunk, operandStart);
+  emitWithImmediate(compiler, immediateInstruction, immediate);
+}
+
+static void emitNumber(Compiler *compiler, double value) {
+  if (emitImmediate(compiler, value)) {
+    return;
+  }
+  emitOperand(compiler, OP_CONSTANT, OP_CONSTANT_LONG,
+              emitConstant(compiler, makeNumber(value)));
 }
 
-static void number(bool canAssign) {
+static void number(Compiler *compiler, bool canAssign) {
   (void)canAssign;
-  double value = strtod(parser.previous.start, NULL);
-  emitByte(OP_CONSTANT);
-  emitByte(emitConstant(makeNumber(value)));
+  double value = strtod(compiler->parser.previous.start, NULL);
+  compiler->exprType = TYPE_NUMBER;
+  emitNumber(compiler, value);
 }
 
 static bool identifiersEqual(Token *a, Token *b) {
@@ -400,9 +1133,9 @@ static bool identifiersEqual(Token *a, Token *b) {
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Token *name) {
-  for (int i = compiler.localCount - 1; i >= 0; i--) {
-    Local *local = &compiler.locals[i];
+static int resolveLocal(Compiler *compiler, Token *name) {
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    Local *local = &compiler->locals[i];
     if (identifiersEqual(&local->name, name)) {
       return i;
     }
@@ -410,47 +1143,189 @@ static int resolveLocal(Token *name) {
   return -1;
 }
 
-static void variable(bool canAssign) {
-  int localIndex = resolveLocal(&parser.previous);
+// Functions are not closures, so they cannot see the locals of the code
+// around them.
+static bool isEnclosingLocal(Compiler *compiler, Token *name) {
+  for (EnclosingFunction *enclosing = compiler->enclosing; enclosing != NULL;
+       enclosing = enclosing->enclosing) {
+    for (int i = enclosing->localCount - 1; i >= 0; i--) {
+      if (identifiersEqual(&enclosing->locals[i].name, name)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void variable(Compiler *compiler, bool canAssign) {
+  int localIndex = resolveLocal(compiler, &compiler->parser.previous);
+  if (localIndex == -1 &&
+      isEnclosingLocal(compiler, &compiler->parser.previous)) {
+    errorAt(compiler, &compiler->parser.previous,
+            "Can't use a local variable of an enclosing function.");
+  }
 
   if (localIndex != -1) {
-    if (canAssign && parser.current.type == TOKEN_EQUAL) {
-      advance();
-      expression();
-      emitByte(OP_SET_LOCAL);
-      emitByte((uint8_t)localIndex);
+    if (canAssign && compiler->parser.current.type == TOKEN_EQUAL) {
+      advance(compiler);
+      expression(compiler);
+      Local *local = &compiler->locals[localIndex];
+      if (local->isNumber && compiler->exprType != TYPE_NUMBER) {
+        demoteLocal(compiler, local);
+      }
+      emitOperand(compiler, OP_SET_LOCAL, OP_SET_LOCAL_LONG, localIndex);
     } else {
-      emitByte(OP_GET_LOCAL);
-      emitByte((uint8_t)localIndex);
+      emitOperand(compiler, OP_GET_LOCAL, OP_GET_LOCAL_LONG, localIndex);
+      compiler->exprType = compiler->locals[localIndex].isNumber ? TYPE_NUMBER
+                                                               : TYPE_UNKNOWN;
     }
   } else {
-    uint8_t globalIndex =
-        emitConstant(makeString(parser.previous.start, parser.previous.length));
-
-    if (canAssign && parser.current.type == TOKEN_EQUAL) {
-      advance();
-      expression();
-      emitByte(OP_SET_GLOBAL);
-      emitByte(globalIndex);
+    Token *name = &compiler->parser.previous;
+    int globalIndex = stringConstant(compiler, name->start, name->length);
+
+    if (canAssign && compiler->parser.current.type == TOKEN_EQUAL) {
+      advance(compiler);
+      expression(compiler);
+      emitOperand(compiler, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, globalIndex);
     } else {
-      emitByte(OP_GET_GLOBAL);
-      emitByte(globalIndex);
+      emitOperand(compiler, OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, globalIndex);
+      compiler->exprType = TYPE_UNKNOWN;
     }
   }
 }
 
-static void unary(bool canAssign) {
+static void grouping(Compiler *compiler, bool canAssign) {
+  (void)canAssign;
+  expression(compiler);
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+}
+
+static uint8_t argumentList(Compiler *compiler) {
+  int argCount = 0;
+  if (compiler->parser.current.type != TOKEN_RIGHT_PAREN) {
+    do {
+      expression(compiler);
+      if (argCount == UINT8_MAX) {
+        errorAt(compiler, &compiler->parser.previous,
+                "Can't have more than 255 arguments.");
+      }
+      argCount++;
+    } while (match(compiler, TOKEN_COMMA));
+  }
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  return (uint8_t)argCount;
+}
+
+static void call(Compiler *compiler, bool canAssign) {
   (void)canAssign;
-  TokenType operatorType = parser.previous.type;
+  uint8_t argCount = argumentList(compiler);
+  emitByte(compiler, OP_CALL);
+  emitByte(compiler, argCount);
+  compiler->callEnd = compiler->chunk->count;
+  compiler->exprType = TYPE_UNKNOWN;
+}
+
+static void arrayLiteral(Compiler *compiler, bool canAssign) {
+  (void)canAssign;
+  int count = 0;
+  if (compiler->parser.current.type != TOKEN_RIGHT_BRACKET) {
+    do {
+      expression(compiler);
+      if (count == UINT8_MAX) {
+        errorAt(compiler, &compiler->parser.previous,
+                "Can't have more than 255 elements in an array literal.");
+      }
+      count++;
+    } while (match(compiler, TOKEN_COMMA));
+  }
+  consume(compiler, TOKEN_RIGHT_BRACKET, "Expect ']' after elements.");
+  emitByte(compiler, OP_ARRAY);
+  emitByte(compiler, (uint8_t)count);
+  compiler->exprType = TYPE_UNKNOWN;
+}
+
+// A call straight on a property compiles to OP_INVOKE, so calling a method
+// needs no bound method object.
+static void dot(Compiler *compiler, bool canAssign) {
+  consume(compiler, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  Token *name = &compiler->parser.previous;
+  int nameConstant = stringConstant(compiler, name->start, name->length);
+  if (canAssign && match(compiler, TOKEN_EQUAL)) {
+    expression(compiler);
+    emitOperand(compiler, OP_SET_PROPERTY, OP_SET_PROPERTY_LONG,
+                nameConstant);
+  } else if (match(compiler, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(compiler);
+    emitOperand(compiler, OP_INVOKE, OP_INVOKE_LONG, nameConstant);
+    emitByte(compiler, argCount);
+  } else {
+    emitOperand(compiler, OP_GET_PROPERTY, OP_GET_PROPERTY_LONG,
+                nameConstant);
+  }
+  compiler->exprType = TYPE_UNKNOWN;
+}
+
+static void this_(Compiler *compiler, bool canAssign) {
+  (void)canAssign;
+  Token *name = &compiler->parser.previous;
+  if (resolveLocal(compiler, name) == -1 &&
+      !isEnclosingLocal(compiler, name)) {
+    errorAt(compiler, name, "Can't use 'this' outside of a class.");
+    return;
+  }
+  variable(compiler, false);
+}
+
+// A brace only starts a map where an expression is expected, since
+// statements take it as a block first.
+static void mapLiteral(Compiler *compiler, bool canAssign) {
+  (void)canAssign;
+  int count = 0;
+  if (compiler->parser.current.type != TOKEN_RIGHT_BRACE) {
+    do {
+      expression(compiler);
+      consume(compiler, TOKEN_COLON, "Expect ':' after map key.");
+      expression(compiler);
+      if (count == UINT8_MAX) {
+        errorAt(compiler, &compiler->parser.previous,
+                "Can't have more than 255 entries in a map literal.");
+      }
+      count++;
+    } while (match(compiler, TOKEN_COMMA));
+  }
+  consume(compiler, TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  emitByte(compiler, OP_MAP);
+  emitByte(compiler, (uint8_t)count);
+  compiler->exprType = TYPE_UNKNOWN;
+}
+
+static void subscript(Compiler *compiler, bool canAssign) {
+  expression(compiler);
+  consume(compiler, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+  if (canAssign && match(compiler, TOKEN_EQUAL)) {
+    expression(compiler);
+    emitByte(compiler, OP_SET_INDEX);
+  } else {
+    emitByte(compiler, OP_GET_INDEX);
+  }
+  compiler->exprType = TYPE_UNKNOWN;
+}
+
+static void unary(Compiler *compiler, bool canAssign) {
+  (void)canAssign;
+  TokenType operatorType = compiler->parser.previous.type;
 
-  parsePrecedence(PREC_UNARY);
+  parsePrecedence(compiler, PREC_UNARY);
 
   switch (operatorType) {
   case TOKEN_BANG:
-    emitByte(OP_NOT);
+    emitByte(compiler, OP_NOT);
+    compiler->exprType = TYPE_UNKNOWN;
     break;
   case TOKEN_MINUS: {
-    emitByte(OP_NEGATE);
+    emitByte(compiler, compiler->exprType == TYPE_NUMBER ? OP_NEGATE_UNCHECKED
+                                              : OP_NEGATE);
+    compiler->exprType = TYPE_NUMBER;
     break;
   }
   default: {
@@ -459,24 +1334,80 @@ static void unary(bool canAssign) {
   }
 }
 
-static void binary(bool canAssign) {
+static void binary(Compiler *compiler, bool canAssign) {
   (void)canAssign;
 
-  TokenType operatorType = parser.previous.type;
+  TokenType operatorType = compiler->parser.previous.type;
   ParseRule *rule = getRule(operatorType);
-  parsePrecedence((Precedence)(rule->precedence + 1));
+  StaticType leftType = compiler->exprType;
+  int operandStart = compiler->chunk->count;
+  parsePrecedence(compiler, (Precedence)(rule->precedence + 1));
+
+  // Operators on two proven numbers use the unchecked opcodes. -, * and /
+  // yield a number whenever they do not fail at run time.
+  bool numeric =
+      leftType == TYPE_NUMBER && compiler->exprType == TYPE_NUMBER;
+  compiler->exprType = TYPE_UNKNOWN;
 
   switch (operatorType) {
   case TOKEN_LESS: {
-    emitByte(OP_LESS);
+    emitBinary(compiler, numeric ? OP_LESS_UNCHECKED : OP_LESS,
+               numeric ? OP_LESS_IMM_UNCHECKED : OP_LESS_IMM, operandStart);
     break;
   }
   case TOKEN_GREATER: {
-    emitByte(OP_GREATER);
+    emitBinary(compiler, numeric ? OP_GREATER_UNCHECKED : OP_GREATER,
+               numeric ? OP_GREATER_IMM_UNCHECKED : OP_GREATER_IMM,
+               operandStart);
+    break;
+  }
+  case TOKEN_LESS_EQUAL: {
+    emitByte(compiler, numeric ? OP_GREATER_UNCHECKED : OP_GREATER);
+    emitByte(compiler, OP_NOT);
+    break;
+  }
+  case TOKEN_GREATER_EQUAL: {
+    emitByte(compiler, numeric ? OP_LESS_UNCHECKED : OP_LESS);
+    emitByte(compiler, OP_NOT);
+    break;
+  }
+  case TOKEN_EQUAL_EQUAL: {
+    emitByte(compiler, OP_EQUAL);
+    break;
+  }
+  case TOKEN_BANG_EQUAL: {
+    emitByte(compiler, OP_EQUAL);
+    emitByte(compiler, OP_NOT);
     break;
   }
   case TOKEN_PLUS: {
-    emitByte(OP_ADD);
+    emitBinary(compiler, numeric ? OP_ADD_UNCHECKED : OP_ADD,
+               numeric ? OP_ADD_IMM_UNCHECKED : OP_ADD_IMM, operandStart);
+    compiler->exprType = numeric ? TYPE_NUMBER : TYPE_UNKNOWN;
+    break;
+  }
+  case TOKEN_MINUS: {
+    int16_t immediate;
+    // a - k is a + (-k), but not for k = 0: -0 - 0 is -0 where -0 + 0 is 0.
+    if (isImmediateOperand(compiler, operandStart, &immediate) &&
+        immediate != 0 && immediate != INT16_MIN) {
+      truncateChunk(compiler->chunk, operandStart);
+      emitWithImmediate(compiler, numeric ? OP_ADD_IMM_UNCHECKED : OP_ADD_IMM,
+                        -immediate);
+    } else {
+      emitByte(compiler, numeric ? OP_SUBTRACT_UNCHECKED : OP_SUBTRACT);
+    }
+    compiler->exprType = TYPE_NUMBER;
+    break;
+  }
+  case TOKEN_STAR: {
+    emitByte(compiler, numeric ? OP_MULTIPLY_UNCHECKED : OP_MULTIPLY);
+    compiler->exprType = TYPE_NUMBER;
+    break;
+  }
+  case TOKEN_SLASH: {
+    emitByte(compiler, numeric ? OP_DIVIDE_UNCHECKED : OP_DIVIDE);
+    compiler->exprType = TYPE_NUMBER;
     break;
   }
   default: {
@@ -485,17 +1416,352 @@ static void binary(bool canAssign) {
   }
 }
 
-bool compile(const char *source, Chunk *chunk) {
-  currentChunk = chunk;
-  initScanner(source);
-  initCompiler();
-  advance();
-  parser.hadError = false;
-  parser.panicMode = false;
+static bool isConstantInstruction(uint8_t instruction) {
+  switch (instruction) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG:
+  case OP_DEFINE_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG:
+  case OP_CLASS:
+  case OP_CLASS_LONG:
+  case OP_GET_PROPERTY:
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY:
+  case OP_SET_PROPERTY_LONG:
+  case OP_INVOKE:
+  case OP_INVOKE_LONG:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool isLongInstruction(uint8_t instruction) {
+  return instruction == OP_CONSTANT_LONG ||
+         instruction == OP_GET_GLOBAL_LONG ||
+         instruction == OP_DEFINE_GLOBAL_LONG ||
+         instruction == OP_SET_GLOBAL_LONG || instruction == OP_CLASS_LONG ||
+         instruction == OP_GET_PROPERTY_LONG ||
+         instruction == OP_SET_PROPERTY_LONG ||
+         instruction == OP_INVOKE_LONG;
+}
+
+// Where fragment's statement starts in the source being compiled, or -1 when
+// its text or the token after it is in the changed part.
+static int unchangedStart(Compiler *compiler, Fragment *fragment) {
+  if (fragment->followEnd <= compiler->unchangedPrefix) {
+    return fragment->start;
+  }
+  if (fragment->start >= compiler->unchangedSuffix) {
+    return fragment->start + compiler->shift;
+  }
+  return -1;
+}
+
+static void addRecord(Compiler *compiler, StatementRecord record) {
+  if (compiler->recordCapacity <= compiler->recordCount) {
+    int oldCapacity = compiler->recordCapacity;
+    compiler->recordCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+    compiler->records =
+        realloc(compiler->records,
+                compiler->recordCapacity * sizeof(StatementRecord));
+    if (compiler->records == NULL) {
+      exit(1);
+    }
+  }
+  compiler->records[compiler->recordCount++] = record;
+}
+
+// Moves the code of function, and of the functions declared in it, delta
+// lines down. Fragments keep functions with lines counted from the first
+// line of their statement.
+static void shiftLines(Function *function, int delta) {
+  Chunk *chunk = &function->chunk;
+  for (int i = 0; i < chunk->lineCount; i++) {
+    chunk->lines[i].line += delta;
+  }
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (constant.type == VAL_FUNCTION) {
+      shiftLines(constant.as.function, delta);
+    }
+  }
+}
+
+// Copies the cached code of the statement at the current token into the
+// chunk and skips its text without scanning it. Returns false, having
+// emitted nothing, when the statement changed or a renumbered constant no
+// longer fits its one-byte operand.
+static bool reuseFragment(Compiler *compiler) {
+  FragmentCache *cache = compiler->fragments;
+  int position = (int)(compiler->parser.current.start - compiler->source);
+  // Reusable fragments start in increasing order here too, so the ones
+  // before position can never match again.
+  int start = -1;
+  while (compiler->nextFragment < cache->count) {
+    start = unchangedStart(compiler,
+                           &cache->fragments[compiler->nextFragment]);
+    if (start >= position) {
+      break;
+    }
+    compiler->nextFragment++;
+  }
+  if (compiler->nextFragment == cache->count || start != position) {
+    return false;
+  }
+  Fragment *fragment = &cache->fragments[compiler->nextFragment];
+
+  Chunk *chunk = compiler->chunk;
+  int line = compiler->parser.current.line;
+  int codeStart = chunk->count;
+  for (int i = 0; i < fragment->lineCount; i++) {
+    int offset = fragment->lines[i].offset;
+    int end = i + 1 < fragment->lineCount ? fragment->lines[i + 1].offset
+                                          : fragment->codeLength;
+    writeChunkBytes(chunk, fragment->code + offset, end - offset,
+                    line + fragment->lines[i].line);
+  }
+  for (int i = 0; i < fragment->constantCount; i++) {
+    int index = emitConstant(compiler, fragment->constants[i]);
+    Value constant = chunk->constants.values[index];
+    if (constant.type == VAL_FUNCTION) {
+      shiftLines(constant.as.function, line);
+    }
+    uint8_t *operand =
+        &chunk->code[codeStart + fragment->constantOffsets[i] + 1];
+    if (isLongInstruction(operand[-1])) {
+      operand[0] = (index >> 16) & 0xFF;
+      operand[1] = (index >> 8) & 0xFF;
+      operand[2] = index & 0xFF;
+    } else if (index <= UINT8_MAX) {
+      operand[0] = (uint8_t)index;
+    } else {
+      truncateChunk(chunk, codeStart);
+      return false;
+    }
+  }
+
+  int length = fragment->end - fragment->start;
+  addRecord(compiler, (StatementRecord){
+                          compiler->nextFragment, position, position + length,
+                          position + fragment->followEnd - fragment->start,
+                          line, fragment->lineSpan, codeStart, chunk->count});
+  compiler->nextFragment++;
+
+  compiler->scanner.start = compiler->source + position + length;
+  compiler->scanner.current = compiler->scanner.start;
+  compiler->scanner.line = line + fragment->lineSpan;
+  advance(compiler);
+  return true;
+}
+
+// A statement's text decides how it compiles only together with the token
+// after it, which could be an 'else', and scanning that token looks this far
+// past its end. Past the end of the source this reaches beyond any unchanged
+// prefix, since text appended there could continue the statement.
+#define SCANNER_LOOKAHEAD 2
+
+static void topLevelStatement(Compiler *compiler) {
+  if (compiler->fragments == NULL) {
+    statement(compiler);
+    return;
+  }
+  if (reuseFragment(compiler)) {
+    return;
+  }
+
+  Token first = compiler->parser.current;
+  int codeStart = compiler->chunk->count;
+  statement(compiler);
+  Token *last = &compiler->parser.previous;
+  Token *follow = &compiler->parser.current;
+  addRecord(compiler,
+            (StatementRecord){
+                -1, (int)(first.start - compiler->source),
+                (int)(last->start + last->length - compiler->source),
+                (int)(follow->start + follow->length - compiler->source) +
+                    SCANNER_LOOKAHEAD,
+                first.line, last->line - first.line, codeStart,
+                compiler->chunk->count});
+}
+
+static void buildFragment(Fragment *fragment, Chunk *chunk,
+                          StatementRecord *record) {
+  int codeLength = record->codeEnd - record->codeStart;
+  fragment->start = record->start;
+  fragment->end = record->end;
+  fragment->followEnd = record->followEnd;
+  fragment->lineSpan = record->lineSpan;
+  fragment->code = malloc(codeLength + 1);
+  fragment->codeLength = codeLength;
+  fragment->lines = malloc((codeLength + 1) * sizeof(LineStart));
+  fragment->lineCount = 0;
+  fragment->constantOffsets = malloc((codeLength + 1) * sizeof(int));
+  fragment->constants = malloc((codeLength + 1) * sizeof(Value));
+  fragment->constantCount = 0;
+  if (fragment->code == NULL || fragment->lines == NULL ||
+      fragment->constantOffsets == NULL || fragment->constants == NULL) {
+    exit(1);
+  }
+  memcpy(fragment->code, chunk->code + record->codeStart, codeLength);
+
+  for (int offset = 0; offset < codeLength; offset++) {
+    int line = getLine(chunk, record->codeStart + offset) - record->line;
+    if (fragment->lineCount == 0 ||
+        fragment->lines[fragment->lineCount - 1].line != line) {
+      fragment->lines[fragment->lineCount++] = (LineStart){offset, line};
+    }
+  }
+
+  for (int offset = 0; offset < codeLength;) {
+    uint8_t instruction = fragment->code[offset];
+    OpInfo info;
+    opInfo(instruction, &info);
+    if (isConstantInstruction(instruction)) {
+      uint8_t *operand = &fragment->code[offset + 1];
+      int index = isLongInstruction(instruction)
+                      ? (operand[0] << 16) | (operand[1] << 8) | operand[2]
+                      : operand[0];
+      Value constant = copyValue(chunk->constants.values[index]);
+      if (constant.type == VAL_FUNCTION) {
+        shiftLines(constant.as.function, -record->line);
+      }
+      fragment->constantOffsets[fragment->constantCount] = offset;
+      fragment->constants[fragment->constantCount++] = constant;
+    }
+    offset += 1 + info.operandBytes;
+  }
+}
+
+// Keeps the fragments this compilation reused, now at their new offsets,
+// adds the statements it compiled and frees the rest.
+static void updateFragments(Compiler *compiler, int length) {
+  FragmentCache *cache = compiler->fragments;
+  Fragment *fragments =
+      malloc((compiler->recordCount + 1) * sizeof(Fragment));
+  bool *kept = calloc(cache->count + 1, sizeof(bool));
+  if (fragments == NULL || kept == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < compiler->recordCount; i++) {
+    StatementRecord *record = &compiler->records[i];
+    if (record->fragment < 0) {
+      buildFragment(&fragments[i], compiler->chunk, record);
+      continue;
+    }
+    fragments[i] = cache->fragments[record->fragment];
+    fragments[i].start = record->start;
+    fragments[i].end = record->end;
+    fragments[i].followEnd = record->followEnd;
+    kept[record->fragment] = true;
+  }
+  for (int i = 0; i < cache->count; i++) {
+    if (!kept[i]) {
+      freeFragment(&cache->fragments[i]);
+    }
+  }
+  free(kept);
+  replaceFragments(cache, compiler->source, length, fragments,
+                   compiler->recordCount);
+}
+
+#define DIFF_BLOCK 4096
+
+// Measures how much of source is unchanged since the cached one, comparing
+// whole blocks while they match.
+static void diffSource(Compiler *compiler, int length) {
+  FragmentCache *cache = compiler->fragments;
+  const char *old = cache->source;
+  const char *new = compiler->source;
+  int shortest = length < cache->length ? length : cache->length;
+  int prefix = 0;
+  while (prefix + DIFF_BLOCK <= shortest &&
+         memcmp(old + prefix, new + prefix, DIFF_BLOCK) == 0) {
+    prefix += DIFF_BLOCK;
+  }
+  while (prefix < shortest && old[prefix] == new[prefix]) {
+    prefix++;
+  }
+  int suffix = 0;
+  while (suffix + DIFF_BLOCK <= shortest - prefix &&
+         memcmp(old + cache->length - suffix - DIFF_BLOCK,
+                new + length - suffix - DIFF_BLOCK, DIFF_BLOCK) == 0) {
+    suffix += DIFF_BLOCK;
+  }
+  while (suffix < shortest - prefix &&
+         old[cache->length - 1 - suffix] == new[length - 1 - suffix]) {
+    suffix++;
+  }
+  compiler->unchangedPrefix = prefix;
+  compiler->unchangedSuffix = cache->length - suffix;
+  compiler->shift = length - cache->length;
+}
+
+static bool compilePass(Compiler *compiler, const char *source, Chunk *chunk) {
+  compiler->function = NULL;
+  compiler->kind = KIND_FUNCTION;
+  compiler->enclosing = NULL;
+  compiler->chunk = chunk;
+  initScanner(&compiler->scanner, source);
+  initScope(compiler);
+  advance(compiler);
+  compiler->parser.hadError = false;
+  compiler->parser.panicMode = false;
+  compiler->nextFragment = 0;
+  compiler->recordCount = 0;
+  if (compiler->fragments != NULL) {
+    reserveConstants(compiler, compiler->fragments->constantCount);
+  }
+
+  while (compiler->parser.current.type != TOKEN_EOF) {
+    topLevelStatement(compiler);
+  }
+  emitByte(compiler, OP_RETURN);
+  freeScope(compiler);
+  return !compiler->parser.hadError;
+}
+
+bool compile(const char *source, Chunk *chunk, FILE *errors,
+             FragmentCache *fragments) {
+  Compiler compiler;
+  compiler.errors = errors;
+  compiler.fragments = fragments;
+  compiler.source = source;
+  compiler.records = NULL;
+  compiler.recordCount = 0;
+  compiler.recordCapacity = 0;
+  int length = (int)strlen(source);
+  if (fragments != NULL) {
+    diffSource(&compiler, length);
+  }
+  compiler.demotedLocals.declarations = NULL;
+  compiler.demotedLocals.count = 0;
+  compiler.demotedLocals.capacity = 0;
+  compiler.inferNumbers = true;
+
+  bool ok;
+  for (int pass = 1;; pass++) {
+    int demotedBefore = compiler.demotedLocals.count;
+    ok = compilePass(&compiler, source, chunk);
+    if (!ok || compiler.demotedLocals.count == demotedBefore) {
+      break;
+    }
+    freeChunk(chunk);
+    if (pass == MAX_INFERENCE_PASSES) {
+      compiler.inferNumbers = false;
+    }
+  }
 
-  while (parser.current.type != TOKEN_EOF) {
-    statement();
+  // Code compiled without number inference is not what a normal compilation
+  // of the same statement would produce, so it is not cached.
+  if (ok && fragments != NULL && compiler.inferNumbers) {
+    updateFragments(&compiler, length);
   }
-  emitByte(OP_RETURN);
-  return !parser.hadError;
+  free(compiler.records);
+  free(compiler.demotedLocals.declarations);
+  return ok;
 }
@@ -1,6 +1,13 @@
 #include "chunk.h"
+#include "fragment.h"
 #include <stdbool.h>
+#include <stdio.h>
 
 #pragma once
 
-bool compile(const char *source, Chunk *chunk);
+// Compile errors are reported to errors. With a fragment cache, top-level
+// statements in the parts of source that are unchanged since the cached one
+// are copied from the cache instead of being compiled, and a successful
+// compilation leaves source and its statements in the cache.
+bool compile(const char *source, Chunk *chunk, FILE *errors,
+             FragmentCache *fragments);
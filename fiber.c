@@ -0,0 +1,55 @@
+#include "fiber.h"
+#include "chunk.h"
+#include "value.h"
+#include "vm.h"
+#include <stdlib.h>
+
+Fiber *newFiber(Value function, int argCount, Value *args) {
+  Fiber *fiber = newMainFiber();
+  fiber->state = FIBER_NEW;
+  fiber->stackCapacity = FIBER_STACK_INIT;
+  if (fiber->stackCapacity < argCount + 1) {
+    fiber->stackCapacity = argCount + 1;
+  }
+  fiber->stack = malloc(fiber->stackCapacity * sizeof(Value));
+  fiber->frameCapacity = FIBER_FRAMES_INIT;
+  fiber->frames = malloc(fiber->frameCapacity * sizeof(CallFrame));
+  if (fiber->stack == NULL || fiber->frames == NULL) {
+    exit(1);
+  }
+  // The function and its arguments, ready to be entered like a call.
+  fiber->stack[0] = function;
+  for (int i = 0; i < argCount; i++) {
+    fiber->stack[i + 1] = args[i];
+  }
+  fiber->stackTop = fiber->stack + argCount + 1;
+  fiber->slots = fiber->stack;
+  fiber->function = function.as.function;
+  return fiber;
+}
+
+Fiber *newMainFiber() {
+  Fiber *fiber = calloc(1, sizeof(Fiber));
+  if (fiber == NULL) {
+    exit(1);
+  }
+  fiber->state = FIBER_RUNNING;
+  return fiber;
+}
+
+void freeFiberStacks(Fiber *fiber) {
+  free(fiber->stack);
+  free(fiber->frames);
+  fiber->stack = NULL;
+  fiber->stackTop = NULL;
+  fiber->slots = NULL;
+  fiber->stackCapacity = 0;
+  fiber->frames = NULL;
+  fiber->frameCount = 0;
+  fiber->frameCapacity = 0;
+}
+
+void freeFiber(Fiber *fiber) {
+  freeFiberStacks(fiber);
+  free(fiber);
+}
@@ -0,0 +1,57 @@
+#include "value.h"
+#include "vm.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#pragma once
+
+// Values and frames a fiber starts with room for. Both grow as needed.
+#define FIBER_STACK_INIT 32
+#define FIBER_FRAMES_INIT 4
+
+typedef enum {
+  // Created but never run.
+  FIBER_NEW,
+  // Stopped in a yield, waiting to be resumed.
+  FIBER_SUSPENDED,
+  // Running, or waiting on a fiber it resumed.
+  FIBER_RUNNING,
+  // Returned from its function or abandoned by a runtime error.
+  FIBER_DONE,
+} FiberState;
+
+// A coroutine with its own value stack and call frames. The running fiber's
+// registers live in the VM; the copy here is only current while it is not
+// running, so switching fibers swaps these fields and nothing else.
+struct Fiber {
+  Function *function;
+  Chunk *chunk;
+  uint8_t *ip;
+  Value *slots;
+  CallFrame *frames;
+  int frameCount;
+  int frameCapacity;
+  Value *stack;
+  Value *stackTop;
+  int stackCapacity;
+
+  FiberState state;
+  // Run by the scheduler, which picks the next fiber on every yield, rather
+  // than resumed directly.
+  bool scheduled;
+  // Suspended by a native called in tail position, so the call's result is
+  // returned as soon as it arrives.
+  bool returnOnResume;
+  // Where the next yield or return goes back to while running unscheduled.
+  Fiber *resumer;
+};
+
+// Returns a fiber that will call function, which must be a Function, with
+// the argCount values at args.
+Fiber *newFiber(Value function, int argCount, Value *args);
+// Returns the fiber whose registers are the ones the VM starts with. Its
+// stacks are the VM's, which frees them.
+Fiber *newMainFiber();
+// Releases a fiber's stacks, which a finished fiber no longer needs.
+void freeFiberStacks(Fiber *fiber);
+void freeFiber(Fiber *fiber);
@@ -0,0 +1,51 @@
+#include "fragment.h"
+#include "value.h"
+#include <stdlib.h>
+#include <string.h>
+
+void initFragmentCache(FragmentCache *cache) {
+  cache->source = NULL;
+  cache->length = 0;
+  cache->fragments = NULL;
+  cache->count = 0;
+  cache->constantCount = 0;
+}
+
+void freeFragment(Fragment *fragment) {
+  for (int i = 0; i < fragment->constantCount; i++) {
+    freeValue(fragment->constants[i]);
+  }
+  free(fragment->code);
+  free(fragment->lines);
+  free(fragment->constantOffsets);
+  free(fragment->constants);
+}
+
+void freeFragmentCache(FragmentCache *cache) {
+  for (int i = 0; i < cache->count; i++) {
+    freeFragment(&cache->fragments[i]);
+  }
+  free(cache->fragments);
+  free(cache->source);
+  initFragmentCache(cache);
+}
+
+void replaceFragments(FragmentCache *cache, const char *source, int length,
+                      Fragment *fragments, int count) {
+  char *copy = malloc(length + 1);
+  if (copy == NULL) {
+    exit(1);
+  }
+  memcpy(copy, source, length);
+  copy[length] = '\0';
+  free(cache->fragments);
+  free(cache->source);
+  cache->source = copy;
+  cache->length = length;
+  cache->fragments = fragments;
+  cache->count = count;
+  cache->constantCount = 0;
+  for (int i = 0; i < count; i++) {
+    cache->constantCount += fragments[i].constantCount;
+  }
+}
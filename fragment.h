@@ -0,0 +1,49 @@
+#include "chunk.h"
+#include "value.h"
+
+#pragma once
+
+// The bytecode one top-level statement compiled to, kept so the next
+// compilation can copy it when the statement's text has not changed. Jumps
+// are relative and locals are numbered from the statement's own blocks, so
+// the code is position independent except for constant operands, which are
+// listed so they can be renumbered for the new chunk's pool.
+typedef struct {
+  // Offsets into the cached source of the statement's text, and of the end
+  // of the text after it that decided where the statement ended.
+  int start;
+  int end;
+  int followEnd;
+  // Lines from the statement's first token to its last.
+  int lineSpan;
+  uint8_t *code;
+  int codeLength;
+  // Offsets into code and lines counted from the statement's first line.
+  LineStart *lines;
+  int lineCount;
+  // The opcode offset of every instruction with a constant operand, and the
+  // constant it referred to. The fragment owns the strings.
+  int *constantOffsets;
+  Value *constants;
+  int constantCount;
+} Fragment;
+
+// The last source compiled successfully and the fragments of its top-level
+// statements, in source order.
+typedef struct {
+  char *source;
+  int length;
+  Fragment *fragments;
+  int count;
+  // Constants over all the fragments.
+  int constantCount;
+} FragmentCache;
+
+void initFragmentCache(FragmentCache *cache);
+void freeFragmentCache(FragmentCache *cache);
+void freeFragment(Fragment *fragment);
+// Replaces the cached source and fragments. The cache takes ownership of
+// fragments, which must have been allocated with malloc, and copies source.
+// Each old fragment must already have been freed or moved into fragments.
+void replaceFragments(FragmentCache *cache, const char *source, int length,
+                      Fragment *fragments, int count);
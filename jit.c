@@ -0,0 +1,785 @@
+#include "jit.h"
+#include "chunk.h"
+#include "output.h"
+#include "table.h"
+#include "value.h"
+#include "verifier.h"
+#include "vm.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+// What the machine code sees of the interpreter. Local slots are addressed
+// from slots, and stackTop is read on entry and written back on exit.
+typedef struct {
+  Value *slots;
+  Value *stackTop;
+  int bailedOut;
+  VM *vm;
+} JitFrame;
+
+// Returns the bytecode offset the interpreter resumes at.
+typedef int (*JitFn)(JitFrame *frame);
+
+struct JitLoop {
+  int counter;
+  int bailouts;
+  // Set when the loop cannot be compiled or was blacklisted.
+  bool rejected;
+  JitFn fn;
+  void *memory;
+  size_t size;
+};
+
+bool jitAvailable() { return JIT_SUPPORTED; }
+
+void printJitStats(JitStats *stats, FILE *out) {
+  fprintf(out, "=== JIT ===\n");
+  fprintf(out, "Loops compiled:    %d\n", stats->loopsCompiled);
+  fprintf(out, "Loops rejected:    %d\n", stats->loopsRejected);
+  fprintf(out, "Loops blacklisted: %d\n", stats->loopsBlacklisted);
+  fprintf(out, "Native entries:    %ld\n", stats->entries);
+  fprintf(out, "Bailouts:          %ld\n", stats->bailouts);
+}
+
+void jitFreeChunk(Chunk *chunk) {
+  for (int i = 0; i < chunk->jitLoopCapacity; i++) {
+    JitLoop *loop = chunk->jitLoops[i];
+    if (loop == NULL) {
+      continue;
+    }
+#if JIT_SUPPORTED
+    if (loop->memory != NULL) {
+      munmap(loop->memory, loop->size);
+    }
+#endif
+    free(loop);
+  }
+  free(chunk->jitLoops);
+  chunk->jitLoops = NULL;
+  chunk->jitLoopCapacity = 0;
+}
+
+#if JIT_SUPPORTED
+
+_Static_assert(sizeof(Value) == 16, "JIT templates assume 16-byte values");
+_Static_assert(offsetof(Value, as) == 8, "JIT templates assume payload at 8");
+_Static_assert(offsetof(JitFrame, stackTop) == 8, "JitFrame layout");
+_Static_assert(offsetof(JitFrame, bailedOut) == 16, "JitFrame layout");
+
+// Displacements from rbx, which holds the stack top, for the two topmost
+// values: b is the top, a the one below it.
+#define A_TYPE 0xE0
+#define A_NUMBER 0xE8
+#define B_TYPE 0xF0
+#define B_NUMBER 0xF8
+
+typedef struct {
+  // 32-bit relative displacement to fill in.
+  int patchAt;
+  // Bytecode offset the jump goes to.
+  int target;
+  // Exits leave the machine code, everything else jumps to a label.
+  bool exits;
+  bool bailout;
+} Fixup;
+
+typedef struct {
+  uint8_t *code;
+  int count;
+  int capacity;
+
+  Chunk *chunk;
+  int header;
+  int end;
+  // Machine code offset of each bytecode offset in [header, end).
+  int *labels;
+
+  Fixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+} Assembler;
+
+static void emitBytes(Assembler *as, const uint8_t *bytes, int length) {
+  if (as->capacity < as->count + length) {
+    int capacity = as->capacity < 256 ? 256 : as->capacity;
+    while (capacity < as->count + length) {
+      capacity *= 2;
+    }
+    as->code = realloc(as->code, capacity);
+    if (as->code == NULL) {
+      exit(1);
+    }
+    as->capacity = capacity;
+  }
+  memcpy(as->code + as->count, bytes, length);
+  as->count += length;
+}
+
+#define EMIT(as, ...)                                                          \
+  emitBytes(as, (const uint8_t[]){__VA_ARGS__},                                \
+            sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit32(Assembler *as, uint32_t value) {
+  emitBytes(as, (const uint8_t *)&value, 4);
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+  emitBytes(as, (const uint8_t *)&value, 8);
+}
+
+static void patch32(Assembler *as, int at, int destination) {
+  int32_t relative = destination - (at + 4);
+  memcpy(as->code + at, &relative, 4);
+}
+
+// Emits a short conditional or unconditional jump and returns where its
+// displacement goes; patch8() points it at the current position.
+static int emitJump8(Assembler *as, uint8_t opcode) {
+  EMIT(as, opcode, 0x00);
+  return as->count - 1;
+}
+
+static void patch8(Assembler *as, int at) {
+  as->code[at] = (uint8_t)(as->count - (at + 1));
+}
+
+static void addFixup(Assembler *as, int target, bool bailout) {
+  if (as->fixupCapacity <= as->fixupCount) {
+    int oldCapacity = as->fixupCapacity;
+    as->fixupCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+    as->fixups = realloc(as->fixups, as->fixupCapacity * sizeof(Fixup));
+    if (as->fixups == NULL) {
+      exit(1);
+    }
+  }
+  Fixup *fixup = &as->fixups[as->fixupCount++];
+  fixup->patchAt = as->count - 4;
+  fixup->target = target;
+  fixup->bailout = bailout;
+  fixup->exits = bailout || target < as->header || target >= as->end;
+}
+
+// jmp rel32 to a bytecode offset.
+static void emitJumpTo(Assembler *as, int target) {
+  EMIT(as, 0xE9);
+  emit32(as, 0);
+  addFixup(as, target, false);
+}
+
+// jcc rel32 to a bytecode offset; condition is the second opcode byte.
+static void emitBranchTo(Assembler *as, uint8_t condition, int target) {
+  EMIT(as, 0x0F, condition);
+  emit32(as, 0);
+  addFixup(as, target, false);
+}
+
+#define JCC_EQUAL 0x84
+#define JCC_NOT_EQUAL 0x85
+
+// jne rel32 to a stub that hands the instruction at offset back to the
+// interpreter untouched.
+static void emitBailoutIfNotEqual(Assembler *as, int offset) {
+  EMIT(as, 0x0F, JCC_NOT_EQUAL);
+  emit32(as, 0);
+  addFixup(as, offset, true);
+}
+
+// cmp dword [rbx + typeDisplacement], VAL_NUMBER
+static void emitIsNumber(Assembler *as, uint8_t typeDisplacement) {
+  EMIT(as, 0x83, 0x7B, typeDisplacement, VAL_NUMBER);
+}
+
+static void emitGuardNumber(Assembler *as, uint8_t typeDisplacement,
+                            int offset) {
+  emitIsNumber(as, typeDisplacement);
+  emitBailoutIfNotEqual(as, offset);
+}
+
+static void emitPushValue(Assembler *as, Value value) {
+  uint64_t words[2] = {0, 0};
+  memcpy(words, &value, sizeof(Value));
+  EMIT(as, 0x48, 0xB8); // mov rax, imm64
+  emit64(as, words[0]);
+  EMIT(as, 0x48, 0x89, 0x03); // mov [rbx], rax
+  EMIT(as, 0x48, 0xB8);
+  emit64(as, words[1]);
+  EMIT(as, 0x48, 0x89, 0x43, 0x08); // mov [rbx + 8], rax
+  EMIT(as, 0x48, 0x83, 0xC3, 0x10); // add rbx, 16
+}
+
+static void emitPop(Assembler *as) {
+  EMIT(as, 0x48, 0x83, 0xEB, 0x10); // sub rbx, 16
+}
+
+// Calls helper(frame, stackTop, argument).
+static void emitCall(Assembler *as, void *helper, int32_t argument) {
+  EMIT(as, 0x4C, 0x89, 0xEF); // mov rdi, r13
+  EMIT(as, 0x48, 0x89, 0xDE); // mov rsi, rbx
+  EMIT(as, 0xBA);             // mov edx, imm32
+  emit32(as, (uint32_t)argument);
+  EMIT(as, 0x48, 0xB8); // mov rax, imm64
+  emit64(as, (uint64_t)(uintptr_t)helper);
+  EMIT(as, 0xFF, 0xD0); // call rax
+}
+
+// Bails out to the interpreter when the helper just called returned false.
+static void emitBailoutIfFalse(Assembler *as, int offset) {
+  EMIT(as, 0x84, 0xC0); // test al, al
+  EMIT(as, 0x0F, JCC_EQUAL);
+  emit32(as, 0);
+  addFixup(as, offset, true);
+}
+
+// Sets the flags for the falsiness test of the top value and jumps to target
+// when it is falsey.
+static void emitJumpIfFalsey(Assembler *as, int target) {
+  EMIT(as, 0x8B, 0x43, B_TYPE);   // mov eax, [rbx - 16]
+  EMIT(as, 0x83, 0xF8, VAL_NIL);  // cmp eax, VAL_NIL
+  emitBranchTo(as, JCC_EQUAL, target);
+  EMIT(as, 0x83, 0xF8, VAL_BOOL); // cmp eax, VAL_BOOL
+  int truthy = emitJump8(as, 0x75);
+  EMIT(as, 0x80, 0x7B, B_NUMBER, 0x00); // cmp byte [rbx - 8], 0
+  emitBranchTo(as, JCC_EQUAL, target);
+  patch8(as, truthy);
+}
+
+// Stores al as a boolean into the value at typeDisplacement.
+static void emitStoreBool(Assembler *as, uint8_t typeDisplacement) {
+  EMIT(as, 0x88, 0x43, (uint8_t)(typeDisplacement + 8)); // mov [..], al
+  EMIT(as, 0xC7, 0x43, typeDisplacement);                // mov dword [..]
+  emit32(as, VAL_BOOL);
+}
+
+static void emitLoadImmediate(Assembler *as, int16_t immediate) {
+  double value = immediate;
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  EMIT(as, 0x48, 0xB8); // mov rax, imm64
+  emit64(as, bits);
+  EMIT(as, 0x66, 0x48, 0x0F, 0x6E, 0xC8); // movq xmm1, rax
+}
+
+static void emitLocalAddress(Assembler *as, uint8_t opcode, uint32_t slot) {
+  // movdqu with [r12 + slot * 16]
+  EMIT(as, 0xF3, 0x41, 0x0F, opcode, 0x84, 0x24);
+  emit32(as, slot * sizeof(Value));
+}
+
+// movsd between xmm0 or xmm1 and the number in a local slot, where opcode is
+// 0x10 to load and 0x11 to store.
+static void emitLocalNumber(Assembler *as, uint8_t opcode, uint8_t xmm,
+                            uint32_t slot) {
+  EMIT(as, 0xF2, 0x41, 0x0F, opcode, (uint8_t)(0x84 | xmm << 3), 0x24);
+  emit32(as, slot * sizeof(Value) + offsetof(Value, as));
+}
+
+static bool jitAdd(JitFrame *frame, Value *top, int unused) {
+  (void)unused;
+  Value *a = top - 2;
+  Value *b = top - 1;
+  if (a->type != VAL_STRING || b->type != VAL_STRING) {
+    return false;
+  }
+  *a = concatenateStrings(&frame->vm->tempValues, a->as.string, b->as.string);
+  return true;
+}
+
+static bool jitEqual(JitFrame *frame, Value *top, int unused) {
+  (void)frame;
+  (void)unused;
+  top[-2] = makeBool(valuesEqual(top[-2], top[-1]));
+  return true;
+}
+
+static bool jitPrint(JitFrame *frame, Value *top, int unused) {
+  (void)unused;
+  writeValue(&frame->vm->output, top[-1]);
+  return true;
+}
+
+static bool jitGetGlobal(JitFrame *frame, Value *top, int offset) {
+  Entry *entry = resolveGlobalAt(frame->vm, offset);
+  if (entry == NULL) {
+    return false;
+  }
+  *top = entry->value;
+  return true;
+}
+
+static bool jitSetGlobal(JitFrame *frame, Value *top, int offset) {
+  Entry *entry = resolveGlobalAt(frame->vm, offset);
+  if (entry == NULL) {
+    return false;
+  }
+  entry->value = top[-1];
+  return true;
+}
+
+static uint32_t operandAt(Chunk *chunk, int offset, int operandBytes) {
+  uint8_t *code = chunk->code + offset + 1;
+  if (operandBytes == 0) {
+    return 0;
+  }
+  if (operandBytes == 1) {
+    return code[0];
+  }
+  if (operandBytes == 2) {
+    return (code[0] << 8) | code[1];
+  }
+  return (code[0] << 16) | (code[1] << 8) | code[2];
+}
+
+// a op b on two numbers, where op is the SSE2 scalar opcode byte
+// (0x58 add, 0x5C sub, 0x59 mul, 0x5E div).
+static void emitArithmetic(Assembler *as, uint8_t op) {
+  EMIT(as, 0xF2, 0x0F, 0x10, 0x43, A_NUMBER); // movsd xmm0, a
+  EMIT(as, 0xF2, 0x0F, op, 0x43, B_NUMBER);   // op xmm0, b
+  EMIT(as, 0xF2, 0x0F, 0x11, 0x43, A_NUMBER); // movsd a, xmm0
+  emitPop(as);
+}
+
+static void emitCompare(Assembler *as, bool less) {
+  if (less) {
+    // a < b is b > a, which is false for NaN like the interpreter.
+    EMIT(as, 0xF2, 0x0F, 0x10, 0x43, B_NUMBER); // movsd xmm0, b
+    EMIT(as, 0x66, 0x0F, 0x2E, 0x43, A_NUMBER); // ucomisd xmm0, a
+  } else {
+    EMIT(as, 0xF2, 0x0F, 0x10, 0x43, A_NUMBER); // movsd xmm0, a
+    EMIT(as, 0x66, 0x0F, 0x2E, 0x43, B_NUMBER); // ucomisd xmm0, b
+  }
+  EMIT(as, 0x0F, 0x97, 0xC0); // seta al
+  emitStoreBool(as, A_TYPE);
+  emitPop(as);
+}
+
+static void emitCompareImmediate(Assembler *as, bool less, int16_t k) {
+  emitLoadImmediate(as, k);
+  if (less) {
+    EMIT(as, 0x66, 0x0F, 0x2E, 0x4B, B_NUMBER); // ucomisd xmm1, b
+  } else {
+    EMIT(as, 0xF2, 0x0F, 0x10, 0x43, B_NUMBER); // movsd xmm0, b
+    EMIT(as, 0x66, 0x0F, 0x2E, 0xC1);           // ucomisd xmm0, xmm1
+  }
+  EMIT(as, 0x0F, 0x97, 0xC0); // seta al
+  emitStoreBool(as, B_TYPE);
+}
+
+// Emits the template for one instruction. Returns false for opcodes that
+// have none, which keeps the whole loop in the interpreter.
+static bool emitInstruction(Assembler *as, int offset, int operandBytes) {
+  Chunk *chunk = as->chunk;
+  uint8_t instruction = chunk->code[offset];
+  uint32_t operand = operandAt(chunk, offset, operandBytes);
+  int next = offset + 1 + operandBytes;
+
+  switch (instruction) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG: {
+    emitPushValue(as, chunk->constants.values[operand]);
+    return true;
+  }
+  case OP_ZERO: {
+    emitPushValue(as, makeNumber(0));
+    return true;
+  }
+  case OP_ONE: {
+    emitPushValue(as, makeNumber(1));
+    return true;
+  }
+  case OP_INT8: {
+    emitPushValue(as, makeNumber((int8_t)operand));
+    return true;
+  }
+  case OP_INT16: {
+    emitPushValue(as, makeNumber((int16_t)operand));
+    return true;
+  }
+  case OP_NIL: {
+    emitPushValue(as, makeNil());
+    return true;
+  }
+  case OP_TRUE:
+  case OP_FALSE: {
+    emitPushValue(as, makeBool(instruction == OP_TRUE));
+    return true;
+  }
+  case OP_POP: {
+    emitPop(as);
+    return true;
+  }
+  case OP_GET_LOCAL:
+  case OP_GET_LOCAL_LONG: {
+    emitLocalAddress(as, 0x6F, operand); // movdqu xmm0, slot
+    EMIT(as, 0xF3, 0x0F, 0x7F, 0x03);    // movdqu [rbx], xmm0
+    EMIT(as, 0x48, 0x83, 0xC3, 0x10);    // add rbx, 16
+    return true;
+  }
+  case OP_SET_LOCAL:
+  case OP_SET_LOCAL_LONG: {
+    EMIT(as, 0xF3, 0x0F, 0x6F, 0x43, B_TYPE); // movdqu xmm0, [rbx - 16]
+    emitLocalAddress(as, 0x7F, operand);      // movdqu slot, xmm0
+    return true;
+  }
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG: {
+    emitCall(as, (void *)jitGetGlobal, offset);
+    emitBailoutIfFalse(as, offset);
+    EMIT(as, 0x48, 0x83, 0xC3, 0x10); // add rbx, 16
+    return true;
+  }
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG: {
+    emitCall(as, (void *)jitSetGlobal, offset);
+    emitBailoutIfFalse(as, offset);
+    return true;
+  }
+  case OP_PRINT: {
+    emitCall(as, (void *)jitPrint, 0);
+    emitPop(as);
+    return true;
+  }
+  case OP_EQUAL: {
+    emitCall(as, (void *)jitEqual, 0);
+    emitPop(as);
+    return true;
+  }
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR: {
+    // Numbers inline; strings through a helper; anything else goes back to
+    // the interpreter to report the error.
+    emitIsNumber(as, A_TYPE);
+    int slowA = emitJump8(as, 0x75);
+    emitIsNumber(as, B_TYPE);
+    int slowB = emitJump8(as, 0x75);
+    emitArithmetic(as, 0x58);
+    int done = emitJump8(as, 0xEB);
+    patch8(as, slowA);
+    patch8(as, slowB);
+    emitCall(as, (void *)jitAdd, 0);
+    emitBailoutIfFalse(as, offset);
+    emitPop(as);
+    patch8(as, done);
+    return true;
+  }
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_ADD_UNCHECKED:
+  case OP_SUBTRACT_UNCHECKED:
+  case OP_MULTIPLY_UNCHECKED:
+  case OP_DIVIDE_UNCHECKED: {
+    if (instruction == OP_SUBTRACT || instruction == OP_MULTIPLY ||
+        instruction == OP_DIVIDE) {
+      emitGuardNumber(as, A_TYPE, offset);
+      emitGuardNumber(as, B_TYPE, offset);
+    }
+    uint8_t op = 0x58;
+    if (instruction == OP_SUBTRACT || instruction == OP_SUBTRACT_UNCHECKED) {
+      op = 0x5C;
+    } else if (instruction == OP_MULTIPLY ||
+               instruction == OP_MULTIPLY_UNCHECKED) {
+      op = 0x59;
+    } else if (instruction == OP_DIVIDE || instruction == OP_DIVIDE_UNCHECKED) {
+      op = 0x5E;
+    }
+    emitArithmetic(as, op);
+    return true;
+  }
+  case OP_LESS:
+  case OP_LESS_NUM:
+  case OP_GREATER:
+  case OP_GREATER_NUM: {
+    emitGuardNumber(as, A_TYPE, offset);
+    emitGuardNumber(as, B_TYPE, offset);
+    emitCompare(as, instruction == OP_LESS || instruction == OP_LESS_NUM);
+    return true;
+  }
+  case OP_LESS_UNCHECKED:
+  case OP_GREATER_UNCHECKED: {
+    emitCompare(as, instruction == OP_LESS_UNCHECKED);
+    return true;
+  }
+  case OP_ADD_IMM:
+  case OP_ADD_IMM_UNCHECKED: {
+    if (instruction == OP_ADD_IMM) {
+      emitGuardNumber(as, B_TYPE, offset);
+    }
+    emitLoadImmediate(as, (int16_t)operand);
+    EMIT(as, 0xF2, 0x0F, 0x10, 0x43, B_NUMBER); // movsd xmm0, b
+    EMIT(as, 0xF2, 0x0F, 0x58, 0xC1);           // addsd xmm0, xmm1
+    EMIT(as, 0xF2, 0x0F, 0x11, 0x43, B_NUMBER); // movsd b, xmm0
+    return true;
+  }
+  case OP_LESS_IMM:
+  case OP_GREATER_IMM:
+  case OP_LESS_IMM_UNCHECKED:
+  case OP_GREATER_IMM_UNCHECKED: {
+    if (instruction == OP_LESS_IMM || instruction == OP_GREATER_IMM) {
+      emitGuardNumber(as, B_TYPE, offset);
+    }
+    emitCompareImmediate(as,
+                         instruction == OP_LESS_IMM ||
+                             instruction == OP_LESS_IMM_UNCHECKED,
+                         (int16_t)operand);
+    return true;
+  }
+  case OP_NEGATE:
+  case OP_NEGATE_UNCHECKED: {
+    if (instruction == OP_NEGATE) {
+      emitGuardNumber(as, B_TYPE, offset);
+    }
+    EMIT(as, 0x48, 0xB8); // mov rax, sign bit
+    emit64(as, 0x8000000000000000ULL);
+    EMIT(as, 0x48, 0x31, 0x43, B_NUMBER); // xor [rbx - 8], rax
+    return true;
+  }
+  case OP_NOT: {
+    EMIT(as, 0x8B, 0x43, B_TYPE);  // mov eax, [rbx - 16]
+    EMIT(as, 0x83, 0xF8, VAL_NIL); // cmp eax, VAL_NIL
+    int isNil = emitJump8(as, 0x74);
+    EMIT(as, 0x83, 0xF8, VAL_BOOL); // cmp eax, VAL_BOOL
+    int truthy = emitJump8(as, 0x75);
+    EMIT(as, 0x80, 0x7B, B_NUMBER, 0x00); // cmp byte [rbx - 8], 0
+    EMIT(as, 0x0F, 0x94, 0xC0);           // sete al
+    int storeBool = emitJump8(as, 0xEB);
+    patch8(as, isNil);
+    EMIT(as, 0xB0, 0x01); // mov al, 1
+    int storeTrue = emitJump8(as, 0xEB);
+    patch8(as, truthy);
+    EMIT(as, 0x31, 0xC0); // xor eax, eax
+    patch8(as, storeBool);
+    patch8(as, storeTrue);
+    emitStoreBool(as, B_TYPE);
+    return true;
+  }
+  case OP_JUMP: {
+    emitJumpTo(as, next + (int)operand);
+    return true;
+  }
+  case OP_LOOP: {
+    emitJumpTo(as, next - (int)operand);
+    return true;
+  }
+  case OP_JUMP_IF_FALSE: {
+    emitJumpIfFalsey(as, next + (int)operand);
+    return true;
+  }
+  case OP_FOR_LOOP: {
+    uint8_t *code = chunk->code + offset;
+    emitLocalNumber(as, 0x10, 0, code[1]); // movsd xmm0, counter
+    emitLoadImmediate(as, (int16_t)((code[3] << 8) | code[4]));
+    EMIT(as, 0xF2, 0x0F, 0x58, 0xC1);      // addsd xmm0, xmm1
+    emitLocalNumber(as, 0x11, 0, code[1]); // movsd counter, xmm0
+    emitLocalNumber(as, 0x10, 1, code[2]); // movsd xmm1, limit
+    // Unordered compares set CF and ZF, so ja fails on NaN and jbe holds.
+    bool lessFirst = code[5] == FOR_LESS || code[5] == FOR_GREATER_EQUAL;
+    if (lessFirst) {
+      EMIT(as, 0x66, 0x0F, 0x2E, 0xC8); // ucomisd xmm1, xmm0
+    } else {
+      EMIT(as, 0x66, 0x0F, 0x2E, 0xC1); // ucomisd xmm0, xmm1
+    }
+    bool negated = code[5] == FOR_LESS_EQUAL || code[5] == FOR_GREATER_EQUAL;
+    uint16_t jump = (uint16_t)((code[6] << 8) | code[7]);
+    emitBranchTo(as, negated ? 0x86 : 0x87, next - jump); // jbe or ja
+    emitJumpTo(as, next);
+    return true;
+  }
+  default: {
+    return false;
+  }
+  }
+}
+
+static void emitPrologue(Assembler *as) {
+  EMIT(as, 0x53);                   // push rbx
+  EMIT(as, 0x41, 0x54);             // push r12
+  EMIT(as, 0x41, 0x55);             // push r13
+  EMIT(as, 0x49, 0x89, 0xFD);       // mov r13, rdi
+  EMIT(as, 0x4D, 0x8B, 0x65, 0x00); // mov r12, [r13]
+  EMIT(as, 0x49, 0x8B, 0x5D, 0x08); // mov rbx, [r13 + 8]
+}
+
+// Writes back the stack top and the bailout flag in ecx, returns eax.
+static void emitEpilogue(Assembler *as) {
+  EMIT(as, 0x49, 0x89, 0x5D, 0x08); // mov [r13 + 8], rbx
+  EMIT(as, 0x41, 0x89, 0x4D, 0x10); // mov [r13 + 16], ecx
+  EMIT(as, 0x41, 0x5D);             // pop r13
+  EMIT(as, 0x41, 0x5C);             // pop r12
+  EMIT(as, 0x5B);                   // pop rbx
+  EMIT(as, 0xC3);                   // ret
+}
+
+// Emits one stub per distinct exit, then points every jump at its label or
+// stub.
+static void linkFixups(Assembler *as) {
+  int epilogue = as->count;
+  emitEpilogue(as);
+
+  int *stubs = malloc(as->fixupCount * sizeof(int));
+  if (stubs == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < as->fixupCount; i++) {
+    Fixup *fixup = &as->fixups[i];
+    if (!fixup->exits) {
+      patch32(as, fixup->patchAt, as->labels[fixup->target - as->header]);
+      continue;
+    }
+
+    stubs[i] = -1;
+    for (int j = 0; j < i; j++) {
+      Fixup *other = &as->fixups[j];
+      if (other->exits && other->target == fixup->target &&
+          other->bailout == fixup->bailout) {
+        stubs[i] = stubs[j];
+        break;
+      }
+    }
+    if (stubs[i] == -1) {
+      stubs[i] = as->count;
+      EMIT(as, 0xB8); // mov eax, resume offset
+      emit32(as, (uint32_t)fixup->target);
+      EMIT(as, 0xB9); // mov ecx, bailed out
+      emit32(as, fixup->bailout ? 1 : 0);
+      EMIT(as, 0xE9); // jmp epilogue
+      emit32(as, 0);
+      patch32(as, as->count - 4, epilogue);
+    }
+    patch32(as, fixup->patchAt, stubs[i]);
+  }
+  free(stubs);
+}
+
+static bool compileLoop(Chunk *chunk, int loopOffset, JitLoop *loop) {
+  // The backward offset is the last operand of both loop instructions.
+  OpInfo loopInfo;
+  opInfo(chunk->code[loopOffset], &loopInfo);
+  int end = loopOffset + 1 + loopInfo.operandBytes;
+  uint16_t jump =
+      (uint16_t)((chunk->code[end - 2] << 8) | chunk->code[end - 1]);
+
+  Assembler as;
+  memset(&as, 0, sizeof(as));
+  as.chunk = chunk;
+  as.end = end;
+  as.header = as.end - jump;
+  as.labels = malloc((as.end - as.header) * sizeof(int));
+  if (as.labels == NULL) {
+    exit(1);
+  }
+
+  emitPrologue(&as);
+  bool ok = true;
+  for (int offset = as.header; ok && offset < as.end;) {
+    OpInfo info;
+    opInfo(chunk->code[offset], &info);
+    as.labels[offset - as.header] = as.count;
+    ok = emitInstruction(&as, offset, info.operandBytes);
+    offset += 1 + info.operandBytes;
+  }
+
+  if (ok) {
+    linkFixups(&as);
+    size_t size = (size_t)as.count;
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+      memcpy(memory, as.code, size);
+      // Kernels that forbid making written pages executable leave the loop
+      // to the interpreter.
+      if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        memory = MAP_FAILED;
+      }
+    }
+    if (memory == MAP_FAILED) {
+      ok = false;
+    } else {
+      loop->memory = memory;
+      loop->size = size;
+      loop->fn = (JitFn)memory;
+    }
+  }
+
+  free(as.code);
+  free(as.labels);
+  free(as.fixups);
+  return ok;
+}
+
+static JitLoop *loopAt(Chunk *chunk, int loopOffset) {
+  if (loopOffset >= chunk->jitLoopCapacity) {
+    int capacity = chunk->count;
+    chunk->jitLoops = realloc(chunk->jitLoops, capacity * sizeof(JitLoop *));
+    if (chunk->jitLoops == NULL) {
+      exit(1);
+    }
+    for (int i = chunk->jitLoopCapacity; i < capacity; i++) {
+      chunk->jitLoops[i] = NULL;
+    }
+    chunk->jitLoopCapacity = capacity;
+  }
+  if (chunk->jitLoops[loopOffset] == NULL) {
+    chunk->jitLoops[loopOffset] = calloc(1, sizeof(JitLoop));
+    if (chunk->jitLoops[loopOffset] == NULL) {
+      exit(1);
+    }
+  }
+  return chunk->jitLoops[loopOffset];
+}
+
+void jitOnBackEdge(VM *vm, int loopOffset) {
+  Chunk *chunk = vm->chunk;
+  JitStats *stats = &vm->jitStats;
+  JitLoop *loop = loopAt(chunk, loopOffset);
+  if (loop->fn == NULL) {
+    if (loop->rejected || ++loop->counter < JIT_HOT_LOOP_THRESHOLD) {
+      return;
+    }
+    if (!compileLoop(chunk, loopOffset, loop)) {
+      loop->rejected = true;
+      stats->loopsRejected++;
+      return;
+    }
+    stats->loopsCompiled++;
+  }
+
+  JitFrame frame;
+  frame.slots = vm->slots;
+  frame.stackTop = vm->stackTop;
+  frame.bailedOut = 0;
+  frame.vm = vm;
+  int resume = loop->fn(&frame);
+  stats->entries++;
+
+  vm->stackTop = frame.stackTop;
+  vm->ip = chunk->code + resume;
+  if (frame.bailedOut) {
+    stats->bailouts++;
+    if (++loop->bailouts >= JIT_MAX_BAILOUTS) {
+      loop->fn = NULL;
+      loop->rejected = true;
+      stats->loopsBlacklisted++;
+    }
+  }
+}
+
+#else
+
+void jitOnBackEdge(VM *vm, int loopOffset) {
+  (void)vm;
+  (void)loopOffset;
+}
+
+#endif
@@ -0,0 +1,38 @@
+#include "chunk.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+#pragma once
+
+// Back-edges a loop has to take before it is compiled to machine code.
+#define JIT_HOT_LOOP_THRESHOLD 1000
+// Guard failures after which a compiled loop is no longer entered.
+#define JIT_MAX_BAILOUTS 100
+
+typedef struct {
+  int loopsCompiled;
+  // Hot loops holding an opcode the JIT has no template for.
+  int loopsRejected;
+  // Compiled loops abandoned after too many bailouts.
+  int loopsBlacklisted;
+  long entries;
+  long bailouts;
+} JitStats;
+
+// Per-loop JIT state, owned by the chunk holding the loop.
+typedef struct JitLoop JitLoop;
+
+struct VM;
+
+// True when this build can generate code (Linux on x86-64).
+bool jitAvailable();
+void printJitStats(JitStats *stats, FILE *out);
+
+// Called by OP_LOOP and OP_FOR_LOOP with the offset of the loop instruction,
+// after vm->ip has been moved back to the loop header. Counts the back-edge
+// and, once the loop is compiled, runs it natively and leaves vm->ip and
+// vm->stackTop where the machine code exited.
+void jitOnBackEdge(struct VM *vm, int loopOffset);
+
+// Releases the machine code of every loop compiled from chunk.
+void jitFreeChunk(Chunk *chunk);
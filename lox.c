@@ -0,0 +1,168 @@
+#include "lox.h"
+#include "jit.h"
+#include "scanner.h"
+#include "snapshot.h"
+#include "vm.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+LoxVM *loxNewVM() {
+  VM *vm = malloc(sizeof(VM));
+  if (vm == NULL) {
+    return NULL;
+  }
+  initVM(vm);
+  return vm;
+}
+
+void loxFreeVM(LoxVM *vm) {
+  freeVM(vm);
+  free(vm);
+}
+
+void loxResetVM(LoxVM *vm) { resetVM(vm); }
+
+char *loxReadFile(const char *path, FILE *errors) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(errors, "Could not open file '%s'\n", path);
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+
+  char *buffer = size < 0 ? NULL : malloc(size + 1);
+  if (buffer == NULL) {
+    fprintf(errors, "Could not read file '%s'\n", path);
+    fclose(file);
+    return NULL;
+  }
+  size_t read = fread(buffer, sizeof(char), size, file);
+  fclose(file);
+  if (read < (size_t)size) {
+    fprintf(errors, "Could not read file '%s'\n", path);
+    free(buffer);
+    return NULL;
+  }
+  buffer[read] = '\0';
+  return buffer;
+}
+
+LoxResult loxInterpret(LoxVM *vm, const char *source) {
+  switch (interpret(vm, source)) {
+  case INTERPRET_COMPILE_ERROR: {
+    return LOX_COMPILE_ERROR;
+  }
+  case INTERPRET_RUNTIME_ERROR: {
+    return LOX_RUNTIME_ERROR;
+  }
+  default: {
+    return LOX_OK;
+  }
+  }
+}
+
+bool loxSaveSnapshot(LoxVM *vm, const char *path) {
+  return saveSnapshot(vm, path);
+}
+
+bool loxLoadSnapshot(LoxVM *vm, const char *path) {
+  return loadSnapshot(vm, path);
+}
+
+void loxDefineNative(LoxVM *vm, const char *name, LoxNativeFn function,
+                     int arity) {
+  defineNative(vm, name, function, arity);
+}
+
+void loxNativeError(LoxVM *vm, const char *format, ...) {
+  char message[1024];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  nativeError(vm, "%s", message);
+}
+
+Value loxString(LoxVM *vm, const char *chars, int length) {
+  return tempString(vm, chars, length);
+}
+
+bool loxNeedsMoreInput(const char *source) {
+  Scanner scanner;
+  initScanner(&scanner, source);
+  int depth = 0;
+  for (;;) {
+    Token token = scanToken(&scanner);
+    switch (token.type) {
+    case TOKEN_LEFT_PAREN:
+    case TOKEN_LEFT_BRACE:
+    case TOKEN_LEFT_BRACKET: {
+      depth++;
+      break;
+    }
+    case TOKEN_RIGHT_PAREN:
+    case TOKEN_RIGHT_BRACE:
+    case TOKEN_RIGHT_BRACKET: {
+      depth--;
+      break;
+    }
+    case TOKEN_ERROR: {
+      if (strcmp(token.start, "Unterminated string") == 0) {
+        return true;
+      }
+      break;
+    }
+    case TOKEN_EOF: {
+      return depth > 0;
+    }
+    default: {
+      break;
+    }
+    }
+  }
+}
+
+void loxSetBackend(LoxVM *vm, LoxBackend backend) {
+  vm->backend =
+      backend == LOX_BACKEND_REGISTER ? BACKEND_REGISTER : BACKEND_STACK;
+}
+
+bool loxEnableJit(LoxVM *vm, bool enable) {
+  vm->jit = enable && jitAvailable();
+  return vm->jit == enable;
+}
+
+void loxPrintJitStats(LoxVM *vm, FILE *out) {
+  printJitStats(&vm->jitStats, out);
+}
+
+void loxSetOutput(LoxVM *vm, FILE *out, FILE *err) {
+  setOutputFile(&vm->output, out);
+  vm->err = err;
+}
+
+void loxSetOutputFd(LoxVM *vm, int fd) { setOutputFd(&vm->output, fd); }
+
+void loxSetOutputBufferSize(LoxVM *vm, int size) {
+  setOutputSize(&vm->output, size);
+}
+
+void loxSetLineFlush(LoxVM *vm, bool enable) {
+  vm->output.lineFlush = enable;
+}
+
+void loxSetDumpChunks(LoxVM *vm, bool dump) { vm->dumpChunks = dump; }
+
+void loxSetChunkCache(LoxVM *vm, bool enable) { vm->cacheChunks = enable; }
+
+void loxSetIncremental(LoxVM *vm, bool enable) {
+  vm->incremental = enable;
+  if (!enable) {
+    freeFragmentCache(&vm->fragments);
+  }
+}
@@ -0,0 +1,86 @@
+#include "value.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+#pragma once
+
+// Interface for programs embedding the interpreter. A LoxVM owns all of its
+// state, so a host can run any number of them in parallel, one thread per VM
+// at a time.
+typedef struct VM LoxVM;
+
+typedef enum {
+  LOX_OK,
+  LOX_COMPILE_ERROR,
+  LOX_RUNTIME_ERROR,
+} LoxResult;
+
+typedef enum {
+  LOX_BACKEND_STACK,
+  LOX_BACKEND_REGISTER,
+} LoxBackend;
+
+LoxVM *loxNewVM();
+void loxFreeVM(LoxVM *vm);
+// Starts over with no globals, keeping the VM's allocations and options.
+void loxResetVM(LoxVM *vm);
+
+// Reads the file at path into a string the caller frees. Returns NULL after
+// reporting the failure to errors.
+char *loxReadFile(const char *path, FILE *errors);
+
+// Saves the VM's globals to a snapshot file, or defines the globals saved in
+// one, so a prelude can run once and later VMs start from its results.
+// Loaded snapshots are dropped by loxResetVM. Both report failures to the
+// VM's error stream.
+bool loxSaveSnapshot(LoxVM *vm, const char *path);
+bool loxLoadSnapshot(LoxVM *vm, const char *path);
+
+// Compiles and runs source. Globals persist between calls on the same VM.
+LoxResult loxInterpret(LoxVM *vm, const char *source);
+
+// A C function scripts can call. args points at the argCount arguments,
+// straight on the VM's stack, and the function stores its return value in
+// *result. It returns false after reporting an error with loxNativeError.
+// Natives must not call back into the VM.
+typedef NativeFn LoxNativeFn;
+
+// Defines the global name as function, replacing any native of that name.
+// arity is the argument count calls must pass, or -1 to accept any. Natives
+// outlive loxResetVM. The built-in math, string, array, map and fiber
+// functions registered by defineBuiltinNatives() in natives.c are always
+// defined.
+void loxDefineNative(LoxVM *vm, const char *name, LoxNativeFn function,
+                     int arity);
+// Fails the running script with a runtime error at the native's call.
+void loxNativeError(LoxVM *vm, const char *format, ...);
+// Returns a string a native can return, owned by the VM until it is reset.
+Value loxString(LoxVM *vm, const char *chars, int length);
+
+// Whether source stops inside a block, parentheses, brackets or a string, so an
+// interactive host should read more lines before interpreting it.
+bool loxNeedsMoreInput(const char *source);
+
+void loxSetBackend(LoxVM *vm, LoxBackend backend);
+// Returns false, and leaves the JIT off, on platforms without one.
+bool loxEnableJit(LoxVM *vm, bool enable);
+void loxPrintJitStats(LoxVM *vm, FILE *out);
+// Sends print output to out and compile and runtime errors to err.
+void loxSetOutput(LoxVM *vm, FILE *out, FILE *err);
+// Sends print output straight to fd, bypassing stdio.
+void loxSetOutputFd(LoxVM *vm, int fd);
+// Print output is buffered, 64 KB by default, and flushed when the buffer
+// fills, before a runtime error is reported and when loxInterpret returns.
+void loxSetOutputBufferSize(LoxVM *vm, int size);
+// Whether output is also flushed at every newline. On by default when the
+// output is a terminal.
+void loxSetLineFlush(LoxVM *vm, bool enable);
+// Whether each compiled chunk is disassembled to stdout before it runs.
+void loxSetDumpChunks(LoxVM *vm, bool dump);
+// Whether compiled chunks are kept, across resets too, and reused when the
+// same source is interpreted again.
+void loxSetChunkCache(LoxVM *vm, bool enable);
+// Whether the code of each top-level statement is kept, across resets too,
+// so the next source compiled only compiles the statements that differ from
+// the last one.
+void loxSetIncremental(LoxVM *vm, bool enable);
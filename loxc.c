@@ -0,0 +1,151 @@
+// Client for clox --serve: sends one script to the server and relays what it
+// prints, exiting with the script's status.
+#include "server.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool writeAll(int fd, const void *data, size_t length) {
+  const char *bytes = data;
+  while (length > 0) {
+    ssize_t written = write(fd, bytes, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += written;
+    length -= written;
+  }
+  return true;
+}
+
+static bool readAll(int fd, void *data, size_t length) {
+  char *bytes = data;
+  while (length > 0) {
+    ssize_t got = read(fd, bytes, length);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    bytes += got;
+    length -= got;
+  }
+  return true;
+}
+
+static char *readStdin(size_t *length) {
+  size_t capacity = 4096;
+  char *buffer = malloc(capacity);
+  *length = 0;
+  size_t got;
+  while (buffer != NULL &&
+         (got = fread(buffer + *length, 1, capacity - *length, stdin)) > 0) {
+    *length += got;
+    if (*length == capacity) {
+      capacity *= 2;
+      buffer = realloc(buffer, capacity);
+    }
+  }
+  if (buffer == NULL) {
+    fprintf(stderr, "Not enough memory to read the script\n");
+    exit(70);
+  }
+  return buffer;
+}
+
+static int connectTo(const char *path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 ||
+      connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    fprintf(stderr, "Could not connect to '%s': %s\n", path,
+            strerror(errno));
+    exit(69);
+  }
+  return fd;
+}
+
+// Sends the request; a file is named rather than sent, since the server can
+// read it itself.
+static void sendRequest(int fd, const char *file) {
+  char header[PATH_MAX + 32];
+  bool sent;
+  if (file != NULL) {
+    char path[PATH_MAX];
+    if (realpath(file, path) == NULL) {
+      fprintf(stderr, "Could not open file '%s'\n", file);
+      exit(74);
+    }
+    snprintf(header, sizeof(header), "FILE %s\n", path);
+    sent = writeAll(fd, header, strlen(header));
+  } else {
+    size_t length;
+    char *source = readStdin(&length);
+    snprintf(header, sizeof(header), "SOURCE %zu\n", length);
+    sent = writeAll(fd, header, strlen(header)) &&
+           writeAll(fd, source, length);
+    free(source);
+  }
+  if (!sent) {
+    fprintf(stderr, "Could not send the script: %s\n", strerror(errno));
+    exit(69);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const char *socketPath = getenv("LOX_SOCKET");
+  if (socketPath == NULL) {
+    socketPath = LOX_SOCKET_PATH;
+  }
+  int arg = 1;
+  if (arg < argc && strncmp(argv[arg], "--socket=", 9) == 0) {
+    socketPath = argv[arg++] + 9;
+  }
+  if (argc - arg > 1 || (arg < argc && argv[arg][0] == '-')) {
+    fprintf(stderr, "Usage: loxc [--socket=path] [file]\n");
+    return 64;
+  }
+
+  int fd = connectTo(socketPath);
+  sendRequest(fd, arg < argc ? argv[arg] : NULL);
+
+  unsigned char header[5];
+  char *payload = NULL;
+  while (readAll(fd, header, sizeof(header))) {
+    size_t length = (size_t)header[1] << 24 | header[2] << 16 |
+                    header[3] << 8 | header[4];
+    payload = realloc(payload, length > 0 ? length : 1);
+    if (payload == NULL || !readAll(fd, payload, length)) {
+      break;
+    }
+    if (header[0] == LOX_FRAME_STATUS && length == 1) {
+      int status = (unsigned char)payload[0];
+      free(payload);
+      close(fd);
+      return status;
+    }
+    if (header[0] == LOX_FRAME_ERROR) {
+      fflush(stdout);
+      fwrite(payload, 1, length, stderr);
+    } else {
+      fwrite(payload, 1, length, stdout);
+    }
+  }
+  fprintf(stderr, "Lost the connection to the server\n");
+  free(payload);
+  close(fd);
+  return 70;
+}
@@ -1,6 +1,13 @@
-#include "vm.h"
+#include "batch.h"
+#include "lox.h"
+#include "server.h"
+#include "watch.h"
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 char *runFile(const char *filename) {
   FILE *file = fopen(filename, "r");
@@ -32,22 +39,152 @@ char *runFile(const char *filename) {
   return buffer;
 };
 
+// Runs each complete statement as soon as it is entered, all on one VM so
+// globals carry over. Input is gathered over several lines while a block,
+// parenthesis or string is still open. Prompts are only shown to a terminal.
+static void runRepl(LoxVM *vm) {
+  loxSetDumpChunks(vm, false);
+  bool interactive = isatty(STDIN_FILENO);
+  char *line = NULL;
+  size_t lineCapacity = 0;
+  char *source = NULL;
+  size_t length = 0;
+  size_t capacity = 0;
+  for (;;) {
+    if (interactive) {
+      fputs(length == 0 ? "> " : "... ", stdout);
+      fflush(stdout);
+    }
+    ssize_t read = getline(&line, &lineCapacity, stdin);
+    if (read < 0) {
+      if (interactive) {
+        putchar('\n');
+      }
+      break;
+    }
+    if (length + read + 1 > capacity) {
+      capacity = (length + read + 1) * 2;
+      source = realloc(source, capacity);
+      if (source == NULL) {
+        exit(70);
+      }
+    }
+    memcpy(source + length, line, read + 1);
+    length += read;
+    if (!loxNeedsMoreInput(source)) {
+      loxInterpret(vm, source);
+      length = 0;
+    }
+  }
+  free(line);
+  free(source);
+}
+
+static bool isDirectory(const char *path) {
+  struct stat info;
+  return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc == 1) {
-    // runRepl();
-  } else if (argc == 2) {
-    char *source = runFile(argv[1]);
-    InterpretResult result = interpret(source);
-    free(source);
-    if (result == INTERPRET_COMPILE_ERROR) {
-      exit(65);
+  LoxVM *vm = loxNewVM();
+  if (vm == NULL) {
+    exit(70);
+  }
+
+  bool printStats = false;
+  bool watch = false;
+  const char *servePath = NULL;
+  const char *snapshotOut = NULL;
+  BatchOptions batch = {LOX_BACKEND_STACK, false, 0, NULL};
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (strcmp(argv[arg], "--jit") == 0) {
+      batch.jit = true;
+      if (!loxEnableJit(vm, true)) {
+        fprintf(stderr,
+                "JIT is not supported on this platform, interpreting.\n");
+      }
+    } else if (strcmp(argv[arg], "--jit-stats") == 0) {
+      printStats = true;
+    } else if (strcmp(argv[arg], "--backend=stack") == 0) {
+      batch.backend = LOX_BACKEND_STACK;
+      loxSetBackend(vm, LOX_BACKEND_STACK);
+    } else if (strcmp(argv[arg], "--backend=register") == 0) {
+      batch.backend = LOX_BACKEND_REGISTER;
+      loxSetBackend(vm, LOX_BACKEND_REGISTER);
+    } else if (strcmp(argv[arg], "--serve") == 0) {
+      servePath = LOX_SOCKET_PATH;
+    } else if (strncmp(argv[arg], "--serve=", 8) == 0) {
+      servePath = argv[arg] + 8;
+    } else if (strcmp(argv[arg], "--watch") == 0) {
+      watch = true;
+    } else if (strncmp(argv[arg], "--snapshot=", 11) == 0) {
+      batch.snapshot = argv[arg] + 11;
+    } else if (strncmp(argv[arg], "--save-snapshot=", 16) == 0) {
+      snapshotOut = argv[arg] + 16;
+    } else if (strncmp(argv[arg], "-j", 2) == 0) {
+      const char *threads = argv[arg][2] != '\0' ? argv[arg] + 2
+                            : arg + 1 < argc     ? argv[++arg]
+                                                 : "";
+      batch.threads = atoi(threads);
+      if (batch.threads < 1) {
+        fprintf(stderr, "-j needs a positive thread count\n");
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Unknown option '%s'\n", argv[arg]);
+      return 1;
     }
-    if (result == INTERPRET_RUNTIME_ERROR) {
-      exit(70);
+  }
+
+  bool batchMode = arg < argc && (batch.threads > 0 || arg < argc - 1 ||
+                                  isDirectory(argv[arg]));
+  if (snapshotOut != NULL && (servePath != NULL || batchMode || watch)) {
+    fprintf(stderr, "--save-snapshot needs a single script or the REPL\n");
+    return 1;
+  }
+  if (watch && (servePath != NULL || batchMode || arg == argc)) {
+    fprintf(stderr, "--watch needs a single script\n");
+    return 1;
+  }
+  // Batch workers load the snapshot into their own VMs, and watch mode loads
+  // it before every run.
+  if (batch.snapshot != NULL && servePath == NULL && !batchMode && !watch &&
+      !loxLoadSnapshot(vm, batch.snapshot)) {
+    loxFreeVM(vm);
+    return 74;
+  }
+
+  int status = 0;
+  if (servePath != NULL) {
+    status = runServer(vm, servePath);
+  } else if (watch) {
+    status = runWatch(vm, argv[arg], batch.snapshot);
+  } else if (batchMode) {
+    if (batch.threads == 0) {
+      batch.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
     }
+    status = runBatch(argv + arg, argc - arg, &batch);
+  } else if (arg == argc) {
+    runRepl(vm);
   } else {
-    fprintf(stderr, "Start the program with command: clox [file]\n");
-    return 1;
+    char *source = runFile(argv[arg]);
+    LoxResult result = loxInterpret(vm, source);
+    free(source);
+    if (printStats) {
+      loxPrintJitStats(vm, stderr);
+    }
+    if (result == LOX_COMPILE_ERROR) {
+      status = 65;
+    }
+    if (result == LOX_RUNTIME_ERROR) {
+      status = 70;
+    }
+  }
+  if (snapshotOut != NULL && status == 0 &&
+      !loxSaveSnapshot(vm, snapshotOut)) {
+    status = 74;
   }
-  return 0;
+  loxFreeVM(vm);
+  return status;
 }
@@ -0,0 +1,463 @@
+#include "natives.h"
+#include "array.h"
+#include "chunk.h"
+#include "class.h"
+#include "fiber.h"
+#include "output.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static bool checkNumber(VM *vm, Value value, const char *name) {
+  if (value.type != VAL_NUMBER) {
+    nativeError(vm, "%s() expects a number.", name);
+    return false;
+  }
+  return true;
+}
+
+// The array value holds, provided every element is a number.
+static Array *checkNumbers(VM *vm, Value value, const char *name) {
+  if (value.type != VAL_ARRAY || !value.as.array->numeric) {
+    nativeError(vm, "%s() expects an array of numbers.", name);
+    return NULL;
+  }
+  return value.as.array;
+}
+
+static bool checkArgCount(VM *vm, int argCount, int min, int max) {
+  if (argCount < min || argCount > max) {
+    nativeError(vm, "Expected %d arguments but got %d.",
+                argCount < min ? min : max, argCount);
+    return false;
+  }
+  return true;
+}
+
+// Seconds on a monotonic clock, to nanosecond resolution. Only differences
+// between two readings mean anything.
+static bool clockNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)vm;
+  (void)argCount;
+  (void)args;
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  *result = makeNumber((double)time.tv_sec + time.tv_nsec / 1e9);
+  return true;
+}
+
+static bool sqrtNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (!checkNumber(vm, args[0], "sqrt")) {
+    return false;
+  }
+  *result = makeNumber(sqrt(args[0].as.number));
+  return true;
+}
+
+static bool floorNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (!checkNumber(vm, args[0], "floor")) {
+    return false;
+  }
+  *result = makeNumber(floor(args[0].as.number));
+  return true;
+}
+
+static bool absNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (!checkNumber(vm, args[0], "abs")) {
+    return false;
+  }
+  *result = makeNumber(fabs(args[0].as.number));
+  return true;
+}
+
+// min(a, b) is the lesser number, and min(array) the least element of a
+// non-empty array.
+static bool minNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!checkArgCount(vm, argCount, 1, 2)) {
+    return false;
+  }
+  if (argCount == 1) {
+    Array *array = checkNumbers(vm, args[0], "min");
+    if (array == NULL) {
+      return false;
+    }
+    if (array->count == 0) {
+      nativeError(vm, "min() of an empty array.");
+      return false;
+    }
+    *result = makeNumber(minNumber(array->as.numbers, array->count));
+    return true;
+  }
+  if (!checkNumber(vm, args[0], "min") || !checkNumber(vm, args[1], "min")) {
+    return false;
+  }
+  double a = args[0].as.number;
+  double b = args[1].as.number;
+  *result = makeNumber(b < a ? b : a);
+  return true;
+}
+
+static bool maxNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!checkArgCount(vm, argCount, 1, 2)) {
+    return false;
+  }
+  if (argCount == 1) {
+    Array *array = checkNumbers(vm, args[0], "max");
+    if (array == NULL) {
+      return false;
+    }
+    if (array->count == 0) {
+      nativeError(vm, "max() of an empty array.");
+      return false;
+    }
+    *result = makeNumber(maxNumber(array->as.numbers, array->count));
+    return true;
+  }
+  if (!checkNumber(vm, args[0], "max") || !checkNumber(vm, args[1], "max")) {
+    return false;
+  }
+  double a = args[0].as.number;
+  double b = args[1].as.number;
+  *result = makeNumber(b > a ? b : a);
+  return true;
+}
+
+static bool lenNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (args[0].type == VAL_ARRAY) {
+    *result = makeNumber(args[0].as.array->count);
+    return true;
+  }
+  if (args[0].type == VAL_MAP) {
+    *result = makeNumber(args[0].as.map->count);
+    return true;
+  }
+  if (args[0].type != VAL_STRING) {
+    nativeError(vm, "len() expects a string, an array or a map.");
+    return false;
+  }
+  *result = makeNumber(args[0].as.string->length);
+  return true;
+}
+
+// array(n) is n zeros, and array(n, value) n copies of value.
+static bool arrayNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!checkArgCount(vm, argCount, 1, 2)) {
+    return false;
+  }
+  double count = args[0].type == VAL_NUMBER ? args[0].as.number : -1;
+  if (!(count >= 0 && count <= INT32_MAX) || count != floor(count)) {
+    nativeError(vm, "array() expects a length that is a whole number.");
+    return false;
+  }
+  *result = tempArray(vm, (int)count);
+  Array *array = result->as.array;
+  if (argCount == 2 && args[1].type == VAL_NUMBER) {
+    for (int i = 0; i < array->count; i++) {
+      array->as.numbers[i] = args[1].as.number;
+    }
+  } else if (argCount == 2) {
+    for (int i = 0; i < array->count; i++) {
+      arraySet(array, i, args[1]);
+    }
+  }
+  return true;
+}
+
+// push(array, value) appends value and returns the array.
+static bool pushNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (args[0].type != VAL_ARRAY) {
+    nativeError(vm, "push() expects an array.");
+    return false;
+  }
+  arrayPush(args[0].as.array, args[1]);
+  *result = args[0];
+  return true;
+}
+
+static bool sumNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  Array *array = checkNumbers(vm, args[0], "sum");
+  if (array == NULL) {
+    return false;
+  }
+  *result = makeNumber(sumNumbers(array->as.numbers, array->count));
+  return true;
+}
+
+static bool dotNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  Array *a = checkNumbers(vm, args[0], "dot");
+  Array *b = a == NULL ? NULL : checkNumbers(vm, args[1], "dot");
+  if (b == NULL) {
+    return false;
+  }
+  if (a->count != b->count) {
+    nativeError(vm, "dot() expects arrays of the same length.");
+    return false;
+  }
+  *result = makeNumber(dotNumbers(a->as.numbers, b->as.numbers, a->count));
+  return true;
+}
+
+// scale(array, factor) multiplies every element in place and returns the
+// array.
+static bool scaleNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  Array *array = checkNumbers(vm, args[0], "scale");
+  if (array == NULL || !checkNumber(vm, args[1], "scale")) {
+    return false;
+  }
+  scaleNumbers(array->as.numbers, array->count, args[1].as.number);
+  *result = args[0];
+  return true;
+}
+
+// mapAdd(array, addend) adds a number, or the elements of an array of the
+// same length, to every element in place and returns the array.
+static bool mapAddNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  Array *array = checkNumbers(vm, args[0], "mapAdd");
+  if (array == NULL) {
+    return false;
+  }
+  if (args[1].type == VAL_NUMBER) {
+    addToNumbers(array->as.numbers, array->count, args[1].as.number);
+  } else {
+    Array *addends = checkNumbers(vm, args[1], "mapAdd");
+    if (addends == NULL) {
+      return false;
+    }
+    if (addends->count != array->count) {
+      nativeError(vm, "mapAdd() expects arrays of the same length.");
+      return false;
+    }
+    addNumbers(array->as.numbers, addends->as.numbers, array->count);
+  }
+  *result = args[0];
+  return true;
+}
+
+// sort(array) sorts in place and returns the array.
+static bool sortNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  Array *array = checkNumbers(vm, args[0], "sort");
+  if (array == NULL) {
+    return false;
+  }
+  sortNumbers(array->as.numbers, array->count);
+  *result = args[0];
+  return true;
+}
+
+// substr(s, start, end) is the text from index start up to but not
+// including end.
+static bool substrNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (args[0].type != VAL_STRING || args[1].type != VAL_NUMBER ||
+      args[2].type != VAL_NUMBER) {
+    nativeError(vm, "substr() expects a string and two numbers.");
+    return false;
+  }
+  String *string = args[0].as.string;
+  double start = args[1].as.number;
+  double end = args[2].as.number;
+  if (start < 0 || end < start || end > string->length ||
+      start != floor(start) || end != floor(end)) {
+    nativeError(vm, "substr() range %g to %g is outside the string.", start,
+                end);
+    return false;
+  }
+  *result = tempString(vm, string->chars + (int)start, (int)(end - start));
+  return true;
+}
+
+// The text print would show, without the newline.
+static bool strNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (args[0].type == VAL_STRING) {
+    *result = args[0];
+    return true;
+  }
+  OutputBuffer text;
+  initStringOutput(&text);
+  writeText(&text, args[0]);
+  *result = tempString(vm, text.data, text.length);
+  freeOutput(&text);
+  return true;
+}
+
+// map(capacity) is an empty map with room for capacity entries, so filling
+// it does not rehash along the way.
+static bool mapNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!checkArgCount(vm, argCount, 0, 1)) {
+    return false;
+  }
+  double capacity = 0;
+  if (argCount == 1) {
+    capacity = args[0].type == VAL_NUMBER ? args[0].as.number : -1;
+  }
+  if (!(capacity >= 0 && capacity <= INT32_MAX / 4) ||
+      capacity != floor(capacity)) {
+    nativeError(vm, "map() expects a capacity that is a whole number.");
+    return false;
+  }
+  *result = tempMap(vm, (int)capacity);
+  return true;
+}
+
+static bool checkMap(VM *vm, Value value, const char *name) {
+  if (value.type != VAL_MAP) {
+    nativeError(vm, "%s() expects a map.", name);
+    return false;
+  }
+  return true;
+}
+
+// delete(map, key) removes key and returns whether it was there.
+static bool deleteNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (!checkMap(vm, args[0], "delete") || !checkMapKey(vm, args[1])) {
+    return false;
+  }
+  *result = makeBool(tableDeleteKey(args[0].as.map, args[1]));
+  return true;
+}
+
+// The keys, or values, of a map as an array in the order they were added.
+static bool mapEntries(VM *vm, Value *args, Value *result, bool keys) {
+  if (!checkMap(vm, args[0], keys ? "keys" : "values")) {
+    return false;
+  }
+  Table *map = args[0].as.map;
+  *result = tempArray(vm, map->count);
+  Array *array = result->as.array;
+  int count = 0;
+  for (int i = 0; i < map->entryCount; i++) {
+    Entry *entry = &map->entries[i];
+    if (entry->key.type != VAL_NIL) {
+      arraySet(array, count++, keys ? entry->key : entry->value);
+    }
+  }
+  return true;
+}
+
+static bool keysNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  return mapEntries(vm, args, result, true);
+}
+
+static bool valuesNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  return mapEntries(vm, args, result, false);
+}
+
+// fiber(fn, args...) is a fiber that calls fn with args when first resumed.
+// spawn() makes the same fiber but hands it to the scheduler instead.
+static bool newFiberNative(VM *vm, int argCount, Value *args, Value *result,
+                           bool scheduled) {
+  const char *name = scheduled ? "spawn" : "fiber";
+  if (argCount == 0 || args[0].type != VAL_FUNCTION) {
+    nativeError(vm, "%s() expects a function.", name);
+    return false;
+  }
+  Function *function = args[0].as.function;
+  if (function->arity != argCount - 1) {
+    nativeError(vm, "Expected %d arguments but got %d.", function->arity,
+                argCount - 1);
+    return false;
+  }
+  *result = tempFiber(vm, args[0], argCount - 1, args + 1, scheduled);
+  return true;
+}
+
+static bool fiberNative(VM *vm, int argCount, Value *args, Value *result) {
+  return newFiberNative(vm, argCount, args, result, false);
+}
+
+static bool spawnNative(VM *vm, int argCount, Value *args, Value *result) {
+  return newFiberNative(vm, argCount, args, result, true);
+}
+
+// resume(fiber, value) runs fiber until it yields or returns, and returns
+// what it yielded or returned. Inside fiber, the yield() it was suspended in
+// returns value.
+static bool resumeNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!checkArgCount(vm, argCount, 1, 2)) {
+    return false;
+  }
+  if (args[0].type != VAL_FIBER) {
+    nativeError(vm, "resume() expects a fiber.");
+    return false;
+  }
+  *result = makeNil();
+  return resumeFiber(vm, args[0].as.fiber, argCount == 2 ? args[1] : *result);
+}
+
+// yield(value) suspends the running fiber, handing value to whoever resumed
+// it. A scheduled fiber goes to the back of the queue and gets nil back.
+static bool yieldNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (!checkArgCount(vm, argCount, 0, 1)) {
+    return false;
+  }
+  *result = makeNil();
+  return yieldFiber(vm, argCount == 1 ? args[0] : *result);
+}
+
+static bool doneNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  if (args[0].type != VAL_FIBER) {
+    nativeError(vm, "done() expects a fiber.");
+    return false;
+  }
+  *result = makeBool(args[0].as.fiber->state == FIBER_DONE);
+  return true;
+}
+
+// run() takes turns running the spawned fibers until every one has
+// returned.
+static bool runNative(VM *vm, int argCount, Value *args, Value *result) {
+  (void)argCount;
+  (void)args;
+  *result = makeNil();
+  return runFibers(vm);
+}
+
+void defineBuiltinNatives(VM *vm) {
+  defineNative(vm, "clock", clockNative, 0);
+  defineNative(vm, "sqrt", sqrtNative, 1);
+  defineNative(vm, "floor", floorNative, 1);
+  defineNative(vm, "abs", absNative, 1);
+  defineNative(vm, "min", minNative, -1);
+  defineNative(vm, "max", maxNative, -1);
+  defineNative(vm, "len", lenNative, 1);
+  defineNative(vm, "substr", substrNative, 3);
+  defineNative(vm, "str", strNative, 1);
+  defineNative(vm, "array", arrayNative, -1);
+  defineNative(vm, "push", pushNative, 2);
+  defineNative(vm, "sum", sumNative, 1);
+  defineNative(vm, "dot", dotNative, 2);
+  defineNative(vm, "scale", scaleNative, 2);
+  defineNative(vm, "mapAdd", mapAddNative, 2);
+  defineNative(vm, "sort", sortNative, 1);
+  defineNative(vm, "map", mapNative, -1);
+  defineNative(vm, "delete", deleteNative, 2);
+  defineNative(vm, "keys", keysNative, 1);
+  defineNative(vm, "values", valuesNative, 1);
+  defineNative(vm, "fiber", fiberNative, -1);
+  defineNative(vm, "spawn", spawnNative, -1);
+  defineNative(vm, "resume", resumeNative, -1);
+  defineNative(vm, "yield", yieldNative, -1);
+  defineNative(vm, "done", doneNative, 1);
+  defineNative(vm, "run", runNative, 0);
+}
@@ -0,0 +1,7 @@
+#include "vm.h"
+
+#pragma once
+
+// Registers clock() and the math, string, array, map and fiber functions
+// every VM starts with.
+void defineBuiltinNatives(VM *vm);
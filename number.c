@@ -0,0 +1,309 @@
+#include "number.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+// Grisu2 (Loitsch, "Printing Floating-Point Numbers Quickly and Accurately
+// with Integers"): scale the value and its rounding boundaries by a cached
+// power of ten so they are 64-bit fixed point numbers, then emit digits until
+// what is left fits between the boundaries. The result always reads back as
+// the same double and is the shortest such string for all but a tiny
+// fraction of inputs, where it has one digit more.
+
+// A number f * 2^e.
+typedef struct {
+  uint64_t f;
+  int e;
+} DiyFp;
+
+#define HIDDEN_BIT 0x0010000000000000ull
+#define SIGNIFICAND_MASK 0x000fffffffffffffull
+#define EXPONENT_BIAS 1075
+
+// 10^k for k = -348, -340, ..., 340, normalized and rounded to 64 bits.
+static const uint64_t cachedPowersF[] = {
+    0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull,
+    0xcf42894a5dce35eaull, 0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull,
+    0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full, 0xbe5691ef416bd60cull,
+    0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+    0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull,
+    0xc21094364dfb5637ull, 0x9096ea6f3848984full, 0xd77485cb25823ac7ull,
+    0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull, 0xb23867fb2a35b28eull,
+    0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+    0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull,
+    0xb5b5ada8aaff80b8ull, 0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull,
+    0x964e858c91ba2655ull, 0xdff9772470297ebdull, 0xa6dfbd9fb8e5b88full,
+    0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+    0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull,
+    0xaa242499697392d3ull, 0xfd87b5f28300ca0eull, 0xbce5086492111aebull,
+    0x8cbccc096f5088ccull, 0xd1b71758e219652cull, 0x9c40000000000000ull,
+    0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+    0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull,
+    0x9f4f2726179a2245ull, 0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull,
+    0x83c7088e1aab65dbull, 0xc45d1df942711d9aull, 0x924d692ca61be758ull,
+    0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+    0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull,
+    0x952ab45cfa97a0b3ull, 0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull,
+    0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull, 0x88fcf317f22241e2ull,
+    0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+    0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull,
+    0x8bab8eefb6409c1aull, 0xd01fef10a657842cull, 0x9b10a4e5e9913129ull,
+    0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull, 0x80444b5e7aa7cf85ull,
+    0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+    0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull,
+};
+
+static const int16_t cachedPowersE[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t powersOf10[] = {
+    1ull,
+    10ull,
+    100ull,
+    1000ull,
+    10000ull,
+    100000ull,
+    1000000ull,
+    10000000ull,
+    100000000ull,
+    1000000000ull,
+    10000000000ull,
+    100000000000ull,
+    1000000000000ull,
+    10000000000000ull,
+    100000000000000ull,
+    1000000000000000ull,
+    10000000000000000ull,
+    100000000000000000ull,
+    1000000000000000000ull,
+    10000000000000000000ull,
+};
+
+static DiyFp multiply(DiyFp a, DiyFp b) {
+  unsigned __int128 product = (unsigned __int128)a.f * b.f;
+  uint64_t high = (uint64_t)(product >> 64);
+  // Round to nearest on the dropped half.
+  if ((uint64_t)product & (1ull << 63)) {
+    high++;
+  }
+  return (DiyFp){high, a.e + b.e + 64};
+}
+
+static DiyFp normalize(DiyFp x) {
+  int shift = __builtin_clzll(x.f);
+  return (DiyFp){x.f << shift, x.e - shift};
+}
+
+// The midpoints between value and its neighbours, with the same exponent.
+static void boundaries(DiyFp value, DiyFp *minus, DiyFp *plus) {
+  *plus = normalize((DiyFp){(value.f << 1) + 1, value.e - 1});
+  // The gap below a power of two is half the gap above it.
+  if (value.f == HIDDEN_BIT) {
+    *minus = (DiyFp){(value.f << 2) - 1, value.e - 2};
+  } else {
+    *minus = (DiyFp){(value.f << 1) - 1, value.e - 1};
+  }
+  minus->f <<= minus->e - plus->e;
+  minus->e = plus->e;
+}
+
+// Picks a cached 10^-k that brings a number with binary exponent e into
+// [2^-60, 2^-32) once multiplied. Sets *k to the decimal exponent.
+static DiyFp cachedPower(int e, int *k) {
+  double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int rounded = (int)dk;
+  if (dk - rounded > 0.0) {
+    rounded++;
+  }
+  unsigned index = (unsigned)(rounded >> 3) + 1;
+  *k = -(-348 + (int)(index << 3));
+  return (DiyFp){cachedPowersF[index], cachedPowersE[index]};
+}
+
+// Nudges the last digit down while that moves the result closer to the exact
+// value and keeps it inside the boundaries.
+static void roundWeed(char *digits, int length, uint64_t delta, uint64_t rest,
+                      uint64_t tenKappa, uint64_t distance) {
+  while (rest < distance && delta - rest >= tenKappa &&
+         (rest + tenKappa < distance ||
+          distance - rest > rest + tenKappa - distance)) {
+    digits[length - 1]--;
+    rest += tenKappa;
+  }
+}
+
+static int countDigits(uint32_t n) {
+  int count = 1;
+  while (count < 10 && n >= powersOf10[count]) {
+    count++;
+  }
+  return count;
+}
+
+// Emits the digits of plus, the scaled upper boundary, stopping as soon as
+// the rest is within delta of it. Adds the position of the last digit to *k.
+static int generateDigits(DiyFp scaled, DiyFp plus, uint64_t delta,
+                          char *digits, int *k) {
+  DiyFp one = {1ull << -plus.e, plus.e};
+  uint64_t distance = plus.f - scaled.f;
+  uint32_t integral = (uint32_t)(plus.f >> -one.e);
+  uint64_t fraction = plus.f & (one.f - 1);
+  int length = 0;
+
+  for (int kappa = countDigits(integral); kappa > 0;) {
+    uint32_t divisor = (uint32_t)powersOf10[kappa - 1];
+    uint32_t digit = integral / divisor;
+    integral %= divisor;
+    if (digit != 0 || length != 0) {
+      digits[length++] = (char)('0' + digit);
+    }
+    kappa--;
+    uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+    if (rest <= delta) {
+      *k += kappa;
+      roundWeed(digits, length, delta, rest, powersOf10[kappa] << -one.e,
+                distance);
+      return length;
+    }
+  }
+
+  for (int kappa = 0;;) {
+    fraction *= 10;
+    delta *= 10;
+    char digit = (char)(fraction >> -one.e);
+    if (digit != 0 || length != 0) {
+      digits[length++] = (char)('0' + digit);
+    }
+    fraction &= one.f - 1;
+    kappa--;
+    if (fraction < delta) {
+      *k += kappa;
+      int index = -kappa;
+      roundWeed(digits, length, delta, fraction, one.f,
+                index < 20 ? distance * powersOf10[index] : 0);
+      return length;
+    }
+  }
+}
+
+// Writes the shortest digits of a positive finite value; the value is
+// digits * 10^k.
+static int grisu2(double value, char *digits, int *k) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  int biasedExponent = (int)(bits >> 52) & 0x7ff;
+  uint64_t significand = bits & SIGNIFICAND_MASK;
+  DiyFp v;
+  if (biasedExponent != 0) {
+    v = (DiyFp){significand + HIDDEN_BIT, biasedExponent - EXPONENT_BIAS};
+  } else {
+    v = (DiyFp){significand, 1 - EXPONENT_BIAS};
+  }
+
+  DiyFp minus, plus;
+  boundaries(v, &minus, &plus);
+  DiyFp power = cachedPower(plus.e, k);
+  DiyFp scaled = multiply(normalize(v), power);
+  DiyFp scaledPlus = multiply(plus, power);
+  DiyFp scaledMinus = multiply(minus, power);
+  // Shrink the interval by one ulp each side to absorb the rounding of the
+  // multiplications.
+  scaledMinus.f++;
+  scaledPlus.f--;
+  return generateDigits(scaled, scaledPlus, scaledPlus.f - scaledMinus.f,
+                        digits, k);
+}
+
+static int writeExponent(int exponent, char *buffer) {
+  int length = 0;
+  buffer[length++] = 'e';
+  if (exponent < 0) {
+    buffer[length++] = '-';
+    exponent = -exponent;
+  } else {
+    buffer[length++] = '+';
+  }
+  if (exponent >= 100) {
+    buffer[length++] = (char)('0' + exponent / 100);
+    exponent %= 100;
+    buffer[length++] = (char)('0' + exponent / 10);
+  } else if (exponent >= 10) {
+    buffer[length++] = (char)('0' + exponent / 10);
+  }
+  buffer[length++] = (char)('0' + exponent % 10);
+  return length;
+}
+
+// Lays out digits * 10^k the way JavaScript does: plain notation while the
+// decimal point is within 21 places of the digits, an exponent otherwise.
+static int layOut(char *buffer, int length, int k) {
+  int point = length + k; // digits[0] is in the 10^(point-1) place
+  if (k >= 0 && point <= 21) {
+    memset(buffer + length, '0', k);
+    return point;
+  }
+  if (point > 0 && point <= 21) {
+    memmove(buffer + point + 1, buffer + point, length - point);
+    buffer[point] = '.';
+    return length + 1;
+  }
+  if (point > -6 && point <= 0) {
+    int offset = 2 - point;
+    memmove(buffer + offset, buffer, length);
+    buffer[0] = '0';
+    buffer[1] = '.';
+    memset(buffer + 2, '0', offset - 2);
+    return length + offset;
+  }
+  if (length == 1) {
+    return 1 + writeExponent(point - 1, buffer + 1);
+  }
+  memmove(buffer + 2, buffer + 1, length - 1);
+  buffer[1] = '.';
+  return length + 1 + writeExponent(point - 1, buffer + length + 1);
+}
+
+static int formatInteger(uint64_t integer, char *buffer) {
+  char reversed[20];
+  int length = 0;
+  do {
+    reversed[length++] = (char)('0' + integer % 10);
+    integer /= 10;
+  } while (integer != 0);
+  for (int i = 0; i < length; i++) {
+    buffer[i] = reversed[length - 1 - i];
+  }
+  return length;
+}
+
+int formatNumber(double value, char *buffer) {
+  if (isnan(value)) {
+    memcpy(buffer, "nan", 3);
+    return 3;
+  }
+  int sign = 0;
+  if (signbit(value)) {
+    buffer[sign++] = '-';
+    value = -value;
+  }
+  if (isinf(value)) {
+    memcpy(buffer + sign, "inf", 3);
+    return sign + 3;
+  }
+  // Most numbers scripts print are integers, which need no digit search.
+  if (value < 9007199254740992.0 && value == (double)(uint64_t)value) {
+    return sign + formatInteger((uint64_t)value, buffer + sign);
+  }
+  int k;
+  int length = grisu2(value, buffer + sign, &k);
+  return sign + layOut(buffer + sign, length, k);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// Longest text formatNumber can produce, such as "-1.2345678901234567e-308".
+#define NUMBER_BUFFER_SIZE 32
+
+// Writes the shortest decimal form of value that reads back as the same
+// double, without a terminator, and returns its length. Integers print
+// without a fraction and very large or small magnitudes use an exponent,
+// as in "100", "0.1", "1.5e+21" and "1e-7".
+int formatNumber(double value, char *buffer);
@@ -0,0 +1,260 @@
+#include "output.h"
+#include "array.h"
+#include "chunk.h"
+#include "class.h"
+#include "number.h"
+#include "table.h"
+#include "value.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void initOutput(OutputBuffer *output) {
+  output->length = 0;
+  output->capacity = OUTPUT_BUFFER_SIZE;
+  output->data = malloc(output->capacity);
+  if (output->data == NULL) {
+    exit(1);
+  }
+  output->file = stdout;
+  output->fd = -1;
+  output->lineFlush = isatty(STDOUT_FILENO);
+}
+
+void initStringOutput(OutputBuffer *output) {
+  output->length = 0;
+  output->capacity = NUMBER_BUFFER_SIZE;
+  output->data = malloc(output->capacity);
+  if (output->data == NULL) {
+    exit(1);
+  }
+  output->file = NULL;
+  output->fd = -1;
+  output->lineFlush = false;
+}
+
+void freeOutput(OutputBuffer *output) {
+  flushOutput(output);
+  free(output->data);
+  output->data = NULL;
+  output->capacity = 0;
+}
+
+static void writeSink(OutputBuffer *output, const char *chars, int length) {
+  if (output->file != NULL) {
+    fwrite(chars, 1, length, output->file);
+    fflush(output->file);
+    return;
+  }
+  // Write errors are dropped, as they would be for a FILE.
+  while (length > 0) {
+    ssize_t written = write(output->fd, chars, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    chars += written;
+    length -= written;
+  }
+}
+
+// Makes room for at least length more bytes in a buffer with no sink.
+static void growOutput(OutputBuffer *output, int length) {
+  while (output->capacity - output->length < length) {
+    output->capacity *= 2;
+  }
+  output->data = realloc(output->data, output->capacity);
+  if (output->data == NULL) {
+    exit(1);
+  }
+}
+
+void flushOutput(OutputBuffer *output) {
+  if (output->file == NULL && output->fd < 0) {
+    return;
+  }
+  if (output->length > 0) {
+    writeSink(output, output->data, output->length);
+    output->length = 0;
+  }
+}
+
+void setOutputFile(OutputBuffer *output, FILE *file) {
+  flushOutput(output);
+  output->file = file;
+  output->fd = -1;
+  output->lineFlush = isatty(fileno(file));
+}
+
+void setOutputFd(OutputBuffer *output, int fd) {
+  flushOutput(output);
+  output->file = NULL;
+  output->fd = fd;
+  output->lineFlush = isatty(fd);
+}
+
+void setOutputSize(OutputBuffer *output, int size) {
+  flushOutput(output);
+  output->capacity = size < 1 ? 1 : size;
+  output->data = realloc(output->data, output->capacity);
+  if (output->data == NULL) {
+    exit(1);
+  }
+}
+
+void writeOutput(OutputBuffer *output, const char *chars, int length) {
+  if (output->file == NULL && output->fd < 0) {
+    growOutput(output, length);
+  } else if (output->length + length > output->capacity) {
+    flushOutput(output);
+    // Too big to be worth copying.
+    if (length > output->capacity) {
+      writeSink(output, chars, length);
+      return;
+    }
+  }
+  memcpy(output->data + output->length, chars, length);
+  output->length += length;
+  if (output->lineFlush && memchr(chars, '\n', length) != NULL) {
+    flushOutput(output);
+  }
+}
+
+static void writeNumber(OutputBuffer *output, double number) {
+  // Format in place unless the buffer is too full, or too small, for it.
+  if (output->file == NULL && output->fd < 0) {
+    growOutput(output, NUMBER_BUFFER_SIZE);
+  } else if (output->capacity - output->length < NUMBER_BUFFER_SIZE) {
+    flushOutput(output);
+  }
+  if (output->capacity < NUMBER_BUFFER_SIZE) {
+    char buffer[NUMBER_BUFFER_SIZE];
+    writeOutput(output, buffer, formatNumber(number, buffer));
+  } else {
+    output->length += formatNumber(number, output->data + output->length);
+  }
+}
+
+// Arrays and maps nested deeper than this, which includes any that contain
+// themselves, are shown as [...] and {...}.
+#define MAX_PRINT_DEPTH 8
+
+// Writes value without the newline print ends most values with.
+static void writeElement(OutputBuffer *output, Value value, int depth) {
+  switch (value.type) {
+  case VAL_NUMBER: {
+    writeNumber(output, value.as.number);
+    break;
+  }
+  case VAL_STRING: {
+    String *string = value.as.string;
+    writeOutput(output, string->chars, string->length);
+    break;
+  }
+  case VAL_BOOL: {
+    if (value.as.boolean) {
+      writeOutput(output, "true", 4);
+    } else {
+      writeOutput(output, "false", 5);
+    }
+    break;
+  }
+  case VAL_NIL: {
+    writeOutput(output, "nil", 3);
+    break;
+  }
+  case VAL_FUNCTION: {
+    String *name = value.as.function->name;
+    writeOutput(output, "<fn ", 4);
+    writeOutput(output, name->chars, name->length);
+    writeOutput(output, ">", 1);
+    break;
+  }
+  case VAL_NATIVE: {
+    String *name = value.as.native->name;
+    writeOutput(output, "<native fn ", 11);
+    writeOutput(output, name->chars, name->length);
+    writeOutput(output, ">", 1);
+    break;
+  }
+  case VAL_CLASS: {
+    String *name = value.as.klass->name;
+    writeOutput(output, "<class ", 7);
+    writeOutput(output, name->chars, name->length);
+    writeOutput(output, ">", 1);
+    break;
+  }
+  case VAL_INSTANCE: {
+    String *name = value.as.instance->klass->name;
+    writeOutput(output, "<", 1);
+    writeOutput(output, name->chars, name->length);
+    writeOutput(output, " instance>", 10);
+    break;
+  }
+  case VAL_FIBER: {
+    writeOutput(output, "<fiber>", 7);
+    break;
+  }
+  case VAL_ARRAY: {
+    if (depth == MAX_PRINT_DEPTH) {
+      writeOutput(output, "[...]", 5);
+      break;
+    }
+    Array *array = value.as.array;
+    writeOutput(output, "[", 1);
+    for (int i = 0; i < array->count; i++) {
+      if (i > 0) {
+        writeOutput(output, ", ", 2);
+      }
+      if (array->numeric) {
+        writeNumber(output, array->as.numbers[i]);
+      } else {
+        writeElement(output, array->as.values[i], depth + 1);
+      }
+    }
+    writeOutput(output, "]", 1);
+    break;
+  }
+  case VAL_MAP: {
+    if (depth == MAX_PRINT_DEPTH) {
+      writeOutput(output, "{...}", 5);
+      break;
+    }
+    Table *map = value.as.map;
+    writeOutput(output, "{", 1);
+    bool first = true;
+    for (int i = 0; i < map->entryCount; i++) {
+      Entry *entry = &map->entries[i];
+      if (entry->key.type == VAL_NIL) {
+        continue;
+      }
+      if (!first) {
+        writeOutput(output, ", ", 2);
+      }
+      first = false;
+      writeElement(output, entry->key, depth + 1);
+      writeOutput(output, ": ", 2);
+      writeElement(output, entry->value, depth + 1);
+    }
+    writeOutput(output, "}", 1);
+    break;
+  }
+  }
+}
+
+void writeText(OutputBuffer *output, Value value) {
+  writeElement(output, value, 0);
+}
+
+void writeValue(OutputBuffer *output, Value value) {
+  writeElement(output, value, 0);
+  // print has never ended booleans and nil with a newline.
+  if (value.type != VAL_BOOL && value.type != VAL_NIL) {
+    writeOutput(output, "\n", 1);
+  }
+}
@@ -0,0 +1,37 @@
+#include "value.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+#pragma once
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Collects what scripts print and hands it to the sink in large writes. The
+// sink is a FILE, or a file descriptor when file is NULL. With neither, the
+// buffer just grows and keeps everything written to it.
+typedef struct {
+  char *data;
+  int length;
+  int capacity;
+  FILE *file;
+  int fd;
+  // Flush after every write containing a newline, for interactive use.
+  bool lineFlush;
+} OutputBuffer;
+
+// Starts out writing to stdout, flushing per line if it is a terminal.
+void initOutput(OutputBuffer *output);
+// Starts out with no sink, for building a string in data.
+void initStringOutput(OutputBuffer *output);
+void freeOutput(OutputBuffer *output);
+void flushOutput(OutputBuffer *output);
+// Each of these flushes whatever went to the previous sink first.
+void setOutputFile(OutputBuffer *output, FILE *file);
+void setOutputFd(OutputBuffer *output, int fd);
+void setOutputSize(OutputBuffer *output, int size);
+
+void writeOutput(OutputBuffer *output, const char *chars, int length);
+// Appends the text print shows for value, without any newline.
+void writeText(OutputBuffer *output, Value value);
+// Appends value the way print shows it.
+void writeValue(OutputBuffer *output, Value value);
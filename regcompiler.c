@@ -0,0 +1,523 @@
+#include "regcompiler.h"
+#include "chunk.h"
+#include "regvm.h"
+#include "value.h"
+#include "verifier.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Stack slot d of the stack VM becomes register d. Rather than copying every
+// push into its slot, the translator tracks which register or constant each
+// slot currently stands for and hands that to the instruction consuming it,
+// so `GET_LOCAL; GET_LOCAL; ADD; SET_LOCAL` becomes one REG_ADD. Slots are
+// only copied home when their source is about to change, and at every jump
+// and jump target, where all slots must be in their own registers.
+
+// A slot whose value is never read: the boolean of a comparison fused into
+// its conditional jump, which both successors pop straight away.
+#define DEAD_SLOT UINT32_MAX
+
+typedef struct {
+  int at;
+  int target;
+} RegFixup;
+
+typedef struct {
+  Chunk *chunk;
+  RegChunk *out;
+  int *depths;
+  bool *isLabel;
+  int *labels;
+
+  // Operand each stack slot currently stands for.
+  uint32_t *slots;
+  int depth;
+  int line;
+  // Instruction whose destination may still be redirected by a following
+  // SET_LOCAL, or -1.
+  int retargetable;
+
+  RegFixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+} RegCompiler;
+
+static int emit(RegCompiler *rc, uint8_t op, uint32_t a, uint32_t b,
+                uint32_t c) {
+  rc->retargetable = -1;
+  return writeRegChunk(rc->out, (RegInstruction){op, rc->line, a, b, c});
+}
+
+static uint32_t constantOperand(RegCompiler *rc, int index) {
+  return (uint32_t)(rc->out->registerCount + index);
+}
+
+static bool sameLiteral(Value a, Value b) {
+  if (a.type != b.type) {
+    return false;
+  }
+  switch (a.type) {
+  case VAL_NUMBER: {
+    return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+  }
+  case VAL_BOOL: {
+    return a.as.boolean == b.as.boolean;
+  }
+  case VAL_NIL: {
+    return true;
+  }
+  default: {
+    return false;
+  }
+  }
+}
+
+// Literals the stack code encoded in the instruction stream become
+// constants, shared with earlier uses of the same literal.
+static uint32_t literalOperand(RegCompiler *rc, Value value) {
+  ValueArray *constants = &rc->out->constants;
+  for (int i = rc->chunk->constants.count; i < constants->count; i++) {
+    if (sameLiteral(constants->values[i], value)) {
+      return constantOperand(rc, i);
+    }
+  }
+  return constantOperand(rc, writeValueArray(constants, value));
+}
+
+static void push(RegCompiler *rc, uint32_t operand) {
+  rc->slots[rc->depth++] = operand;
+}
+
+static uint32_t pop(RegCompiler *rc) { return rc->slots[--rc->depth]; }
+
+static void materialize(RegCompiler *rc, int slot) {
+  uint32_t operand = rc->slots[slot];
+  if (operand != (uint32_t)slot && operand != DEAD_SLOT) {
+    emit(rc, REG_MOVE, slot, operand, 0);
+    rc->slots[slot] = slot;
+  }
+}
+
+// A slot only ever stands for a register below it, and that register was
+// materialized first, so going bottom up never overwrites a pending source.
+static void flush(RegCompiler *rc) {
+  for (int slot = 0; slot < rc->depth; slot++) {
+    materialize(rc, slot);
+  }
+}
+
+static void emitJumpTo(RegCompiler *rc, uint8_t op, uint32_t b, uint32_t c,
+                       int target) {
+  int at = emit(rc, op, 0, b, c);
+  if (rc->fixupCapacity <= rc->fixupCount) {
+    rc->fixupCapacity = rc->fixupCapacity < 8 ? 8 : rc->fixupCapacity * 2;
+    rc->fixups = realloc(rc->fixups, rc->fixupCapacity * sizeof(RegFixup));
+    if (rc->fixups == NULL) {
+      exit(1);
+    }
+  }
+  rc->fixups[rc->fixupCount++] = (RegFixup){at, target};
+}
+
+static uint16_t jumpOperand(Chunk *chunk, int offset) {
+  return (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+}
+
+static uint16_t forLoopOperand(Chunk *chunk, int offset) {
+  return (uint16_t)((chunk->code[offset + 6] << 8) | chunk->code[offset + 7]);
+}
+
+static uint32_t operandAt(Chunk *chunk, int offset, int operandBytes) {
+  uint8_t *code = chunk->code + offset + 1;
+  if (operandBytes == 0) {
+    return 0;
+  }
+  if (operandBytes == 1) {
+    return code[0];
+  }
+  if (operandBytes == 2) {
+    return (code[0] << 8) | code[1];
+  }
+  return (code[0] << 16) | (code[1] << 8) | code[2];
+}
+
+static void binary(RegCompiler *rc, uint8_t op) {
+  uint32_t c = pop(rc);
+  uint32_t b = pop(rc);
+  int destination = rc->depth;
+  int at = emit(rc, op, destination, b, c);
+  push(rc, destination);
+  rc->retargetable = at;
+}
+
+static void unary(RegCompiler *rc, uint8_t op) {
+  uint32_t b = pop(rc);
+  int destination = rc->depth;
+  int at = emit(rc, op, destination, b, 0);
+  push(rc, destination);
+  rc->retargetable = at;
+}
+
+// A comparison directly tested by OP_JUMP_IF_FALSE, when the boolean is
+// popped on both paths, becomes a single compare-and-branch. Returns the
+// offset to continue at, or -1 when the pattern does not apply.
+static int fuseComparison(RegCompiler *rc, int next, bool less) {
+  Chunk *chunk = rc->chunk;
+  if (next + 3 >= chunk->count || chunk->code[next] != OP_JUMP_IF_FALSE ||
+      rc->isLabel[next] || chunk->code[next + 3] != OP_POP) {
+    return -1;
+  }
+  int target = next + 3 + jumpOperand(chunk, next);
+  if (chunk->code[target] != OP_POP) {
+    return -1;
+  }
+
+  uint32_t c = pop(rc);
+  uint32_t b = pop(rc);
+  flush(rc);
+  emitJumpTo(rc, less ? REG_JUMP_IF_NOT_LESS : REG_JUMP_IF_NOT_GREATER, b, c,
+             target);
+  push(rc, DEAD_SLOT);
+  return next + 3;
+}
+
+static void setLocal(RegCompiler *rc, uint32_t slot) {
+  uint32_t value = rc->slots[rc->depth - 1];
+  if (value == slot) {
+    return;
+  }
+  // Slots still reading the old value keep it.
+  for (int i = 0; i < rc->depth; i++) {
+    if (i != (int)slot && rc->slots[i] == slot) {
+      materialize(rc, i);
+    }
+  }
+  if (rc->retargetable != -1 && value == (uint32_t)(rc->depth - 1) &&
+      rc->out->code[rc->retargetable].a == value) {
+    rc->out->code[rc->retargetable].a = slot;
+    rc->retargetable = -1;
+  } else {
+    emit(rc, REG_MOVE, slot, value, 0);
+  }
+  rc->slots[slot] = slot;
+  rc->slots[rc->depth - 1] = slot;
+}
+
+// Translates the instruction at offset and returns the offset of the next
+// one to translate.
+static int translate(RegCompiler *rc, int offset, bool *fallsThrough) {
+  Chunk *chunk = rc->chunk;
+  uint8_t instruction = chunk->code[offset];
+  OpInfo info;
+  opInfo(instruction, &info);
+  uint32_t operand = operandAt(chunk, offset, info.operandBytes);
+  int next = offset + 1 + info.operandBytes;
+  *fallsThrough = true;
+
+  switch (instruction) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG: {
+    push(rc, constantOperand(rc, operand));
+    break;
+  }
+  case OP_ZERO:
+  case OP_ONE: {
+    push(rc, literalOperand(rc, makeNumber(instruction == OP_ONE)));
+    break;
+  }
+  case OP_INT8: {
+    push(rc, literalOperand(rc, makeNumber((int8_t)operand)));
+    break;
+  }
+  case OP_INT16: {
+    push(rc, literalOperand(rc, makeNumber((int16_t)operand)));
+    break;
+  }
+  case OP_NIL: {
+    push(rc, literalOperand(rc, makeNil()));
+    break;
+  }
+  case OP_TRUE:
+  case OP_FALSE: {
+    push(rc, literalOperand(rc, makeBool(instruction == OP_TRUE)));
+    break;
+  }
+  case OP_POP: {
+    pop(rc);
+    break;
+  }
+  case OP_GET_LOCAL:
+  case OP_GET_LOCAL_LONG: {
+    materialize(rc, operand);
+    push(rc, operand);
+    break;
+  }
+  case OP_SET_LOCAL:
+  case OP_SET_LOCAL_LONG: {
+    setLocal(rc, operand);
+    break;
+  }
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG: {
+    int destination = rc->depth;
+    int at = emit(rc, REG_GET_GLOBAL, destination,
+                  constantOperand(rc, operand), 0);
+    push(rc, destination);
+    rc->retargetable = at;
+    break;
+  }
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG: {
+    emit(rc, REG_SET_GLOBAL, constantOperand(rc, operand),
+         rc->slots[rc->depth - 1], 0);
+    break;
+  }
+  case OP_DEFINE_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG: {
+    emit(rc, REG_DEFINE_GLOBAL, constantOperand(rc, operand), pop(rc), 0);
+    break;
+  }
+  case OP_PRINT: {
+    emit(rc, REG_PRINT, 0, pop(rc), 0);
+    break;
+  }
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+  case OP_ADD_UNCHECKED: {
+    binary(rc, REG_ADD);
+    break;
+  }
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_UNCHECKED: {
+    binary(rc, REG_SUBTRACT);
+    break;
+  }
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_UNCHECKED: {
+    binary(rc, REG_MULTIPLY);
+    break;
+  }
+  case OP_DIVIDE:
+  case OP_DIVIDE_UNCHECKED: {
+    binary(rc, REG_DIVIDE);
+    break;
+  }
+  case OP_EQUAL: {
+    binary(rc, REG_EQUAL);
+    break;
+  }
+  case OP_ADD_IMM:
+  case OP_ADD_IMM_UNCHECKED: {
+    push(rc, literalOperand(rc, makeNumber((int16_t)operand)));
+    binary(rc, REG_ADD);
+    break;
+  }
+  case OP_LESS:
+  case OP_LESS_NUM:
+  case OP_LESS_UNCHECKED:
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+  case OP_GREATER_UNCHECKED:
+  case OP_LESS_IMM:
+  case OP_LESS_IMM_UNCHECKED:
+  case OP_GREATER_IMM:
+  case OP_GREATER_IMM_UNCHECKED: {
+    if (instruction == OP_LESS_IMM || instruction == OP_LESS_IMM_UNCHECKED ||
+        instruction == OP_GREATER_IMM ||
+        instruction == OP_GREATER_IMM_UNCHECKED) {
+      push(rc, literalOperand(rc, makeNumber((int16_t)operand)));
+    }
+    bool less = instruction == OP_LESS || instruction == OP_LESS_NUM ||
+                instruction == OP_LESS_UNCHECKED ||
+                instruction == OP_LESS_IMM ||
+                instruction == OP_LESS_IMM_UNCHECKED;
+    int fused = fuseComparison(rc, next, less);
+    if (fused != -1) {
+      return fused;
+    }
+    binary(rc, less ? REG_LESS : REG_GREATER);
+    break;
+  }
+  case OP_NEGATE:
+  case OP_NEGATE_UNCHECKED: {
+    unary(rc, REG_NEGATE);
+    break;
+  }
+  case OP_NOT: {
+    unary(rc, REG_NOT);
+    break;
+  }
+  case OP_JUMP: {
+    flush(rc);
+    emitJumpTo(rc, REG_JUMP, 0, 0, next + jumpOperand(chunk, offset));
+    *fallsThrough = false;
+    break;
+  }
+  case OP_LOOP: {
+    flush(rc);
+    emitJumpTo(rc, REG_JUMP, 0, 0, next - jumpOperand(chunk, offset));
+    *fallsThrough = false;
+    break;
+  }
+  case OP_JUMP_IF_FALSE: {
+    flush(rc);
+    emitJumpTo(rc, REG_JUMP_IF_FALSE, rc->slots[rc->depth - 1], 0,
+               next + jumpOperand(chunk, offset));
+    break;
+  }
+  case OP_FOR_LOOP: {
+    static const uint8_t jumps[] = {
+        [FOR_LESS] = REG_JUMP_IF_LESS,
+        [FOR_LESS_EQUAL] = REG_JUMP_IF_NOT_GREATER,
+        [FOR_GREATER] = REG_JUMP_IF_GREATER,
+        [FOR_GREATER_EQUAL] = REG_JUMP_IF_NOT_LESS,
+    };
+    uint8_t *code = chunk->code + offset;
+    int16_t step = (int16_t)((code[3] << 8) | code[4]);
+    flush(rc);
+    emit(rc, REG_ADD, code[1], code[1], literalOperand(rc, makeNumber(step)));
+    emitJumpTo(rc, jumps[code[5]], code[1], code[2],
+               next - forLoopOperand(chunk, offset));
+    break;
+  }
+  case OP_RETURN: {
+    emit(rc, REG_RETURN, 0, 0, 0);
+    *fallsThrough = false;
+    break;
+  }
+  default: {
+    break;
+  }
+  }
+  return next;
+}
+
+static void markLabels(RegCompiler *rc) {
+  Chunk *chunk = rc->chunk;
+  for (int offset = 0; offset < chunk->count;) {
+    OpInfo info;
+    opInfo(chunk->code[offset], &info);
+    int next = offset + 1 + info.operandBytes;
+    switch (chunk->code[offset]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE: {
+      rc->isLabel[next + jumpOperand(chunk, offset)] = true;
+      break;
+    }
+    case OP_LOOP: {
+      rc->isLabel[next - jumpOperand(chunk, offset)] = true;
+      break;
+    }
+    case OP_FOR_LOOP: {
+      rc->isLabel[next - forLoopOperand(chunk, offset)] = true;
+      break;
+    }
+    default: {
+      break;
+    }
+    }
+    offset = next;
+  }
+}
+
+bool canCompileRegisters(Chunk *chunk) {
+  for (int offset = 0; offset < chunk->count;) {
+    OpInfo info;
+    if (!opInfo(chunk->code[offset], &info)) {
+      return false;
+    }
+    switch (chunk->code[offset]) {
+    case OP_CALL:
+    case OP_ARRAY:
+    case OP_MAP:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+    case OP_METHOD:
+    case OP_GET_PROPERTY:
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY:
+    case OP_SET_PROPERTY_LONG:
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+    case OP_GET_INDEX:
+    case OP_SET_INDEX: {
+      return false;
+    }
+    default: {
+      break;
+    }
+    }
+    offset += 1 + info.operandBytes;
+  }
+  return true;
+}
+
+bool compileRegisters(Chunk *chunk, RegChunk *out) {
+  int *depths = verifyChunkDepths(chunk);
+  if (depths == NULL) {
+    return false;
+  }
+
+  initRegChunk(out);
+  out->registerCount = chunk->maxStack;
+  for (int i = 0; i < chunk->constants.count; i++) {
+    writeValueArray(&out->constants, chunk->constants.values[i]);
+  }
+
+  RegCompiler rc;
+  memset(&rc, 0, sizeof(rc));
+  rc.chunk = chunk;
+  rc.out = out;
+  rc.depths = depths;
+  rc.isLabel = calloc(chunk->count, sizeof(bool));
+  rc.labels = malloc(chunk->count * sizeof(int));
+  rc.slots = malloc((chunk->maxStack + 1) * sizeof(uint32_t));
+  rc.retargetable = -1;
+  if (rc.isLabel == NULL || rc.labels == NULL || rc.slots == NULL) {
+    exit(1);
+  }
+  markLabels(&rc);
+
+  bool fallsThrough = true;
+  for (int offset = 0; offset < chunk->count;) {
+    if (depths[offset] == -1) {
+      // Unreachable: skip to the next instruction.
+      OpInfo info;
+      opInfo(chunk->code[offset], &info);
+      offset += 1 + info.operandBytes;
+      continue;
+    }
+    if (rc.isLabel[offset]) {
+      if (fallsThrough) {
+        flush(&rc);
+      }
+      rc.depth = depths[offset];
+      for (int slot = 0; slot < rc.depth; slot++) {
+        rc.slots[slot] = slot;
+      }
+      rc.labels[offset] = out->count;
+      rc.retargetable = -1;
+    }
+    rc.line = getLine(chunk, offset);
+    offset = translate(&rc, offset, &fallsThrough);
+  }
+
+  for (int i = 0; i < rc.fixupCount; i++) {
+    out->code[rc.fixups[i].at].a = rc.labels[rc.fixups[i].target];
+  }
+
+  out->globalCaches = calloc(out->count, sizeof(GlobalCache));
+  if (out->globalCaches == NULL) {
+    exit(1);
+  }
+
+  free(depths);
+  free(rc.isLabel);
+  free(rc.labels);
+  free(rc.slots);
+  free(rc.fixups);
+  return true;
+}
@@ -0,0 +1,13 @@
+#include "chunk.h"
+#include "regvm.h"
+#include <stdbool.h>
+
+#pragma once
+
+// Translates a chunk of stack bytecode into register code. Returns false if
+// the chunk does not verify.
+bool compileRegisters(Chunk *chunk, RegChunk *out);
+
+// Register code has no call frames or heap objects, so chunks that call
+// functions or use arrays, maps or classes have to run on the stack VM.
+bool canCompileRegisters(Chunk *chunk);
@@ -0,0 +1,206 @@
+#include "regvm.h"
+#include "output.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+void initRegChunk(RegChunk *chunk) {
+  chunk->code = NULL;
+  chunk->count = 0;
+  chunk->capacity = 0;
+  chunk->registerCount = 0;
+  chunk->globalCaches = NULL;
+  initValueArray(&chunk->constants);
+}
+
+int writeRegChunk(RegChunk *chunk, RegInstruction instruction) {
+  if (chunk->capacity <= chunk->count) {
+    chunk->capacity = chunk->capacity < 8 ? 8 : chunk->capacity * 2;
+    chunk->code =
+        realloc(chunk->code, chunk->capacity * sizeof(RegInstruction));
+    if (chunk->code == NULL) {
+      exit(1);
+    }
+  }
+  chunk->code[chunk->count] = instruction;
+  return chunk->count++;
+}
+
+void freeRegChunk(RegChunk *chunk) {
+  free(chunk->code);
+  free(chunk->globalCaches);
+  // The values are borrowed, so only the array goes.
+  free(chunk->constants.values);
+  initRegChunk(chunk);
+}
+
+static void runtimeError(VM *vm, RegInstruction *instruction,
+                         const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  reportRuntimeError(vm, instruction->line, format, args);
+  va_end(args);
+}
+
+static Entry *lookupGlobal(VM *vm, RegChunk *chunk,
+                           RegInstruction *instruction, String *name) {
+  GlobalCache *cache = &chunk->globalCaches[instruction - chunk->code];
+  if (cache->version == vm->globals.version) {
+    return cache->entry;
+  }
+  Entry *entry = tableFindEntry(&vm->globals, name);
+  if (entry == NULL) {
+    runtimeError(vm, instruction, "Undefined variable '%s'.", name->chars);
+    return NULL;
+  }
+  cache->entry = entry;
+  cache->version = vm->globals.version;
+  return entry;
+}
+
+InterpretResult runRegisters(VM *vm, RegChunk *chunk) {
+  Value *registers = vm->stack;
+  memcpy(registers + chunk->registerCount, chunk->constants.values,
+         chunk->constants.count * sizeof(Value));
+
+  RegInstruction *ip = chunk->code;
+  for (;;) {
+    RegInstruction *instruction = ip++;
+    Value *b = &registers[instruction->b];
+    Value *c = &registers[instruction->c];
+    switch (instruction->op) {
+    case REG_MOVE: {
+      registers[instruction->a] = *b;
+      break;
+    }
+    case REG_ADD: {
+      if (b->type == VAL_NUMBER && c->type == VAL_NUMBER) {
+        registers[instruction->a] = makeNumber(b->as.number + c->as.number);
+      } else if (b->type == VAL_STRING && c->type == VAL_STRING) {
+        registers[instruction->a] =
+            concatenateStrings(&vm->tempValues, b->as.string, c->as.string);
+      } else {
+        runtimeError(vm, instruction,
+                     "Operands must be two numbers or two strings.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+    case REG_SUBTRACT:
+    case REG_MULTIPLY:
+    case REG_DIVIDE:
+    case REG_LESS:
+    case REG_GREATER: {
+      if (b->type != VAL_NUMBER || c->type != VAL_NUMBER) {
+        runtimeError(vm, instruction, "Operands must be numbers.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      double x = b->as.number;
+      double y = c->as.number;
+      Value *a = &registers[instruction->a];
+      switch (instruction->op) {
+      case REG_SUBTRACT: {
+        *a = makeNumber(x - y);
+        break;
+      }
+      case REG_MULTIPLY: {
+        *a = makeNumber(x * y);
+        break;
+      }
+      case REG_DIVIDE: {
+        *a = makeNumber(x / y);
+        break;
+      }
+      case REG_LESS: {
+        *a = makeBool(x < y);
+        break;
+      }
+      default: {
+        *a = makeBool(x > y);
+        break;
+      }
+      }
+      break;
+    }
+    case REG_EQUAL: {
+      registers[instruction->a] = makeBool(valuesEqual(*b, *c));
+      break;
+    }
+    case REG_NEGATE: {
+      if (b->type != VAL_NUMBER) {
+        runtimeError(vm, instruction, "Operand must be a number.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      registers[instruction->a] = makeNumber(-b->as.number);
+      break;
+    }
+    case REG_NOT: {
+      registers[instruction->a] = makeBool(isFalsey(*b));
+      break;
+    }
+    case REG_GET_GLOBAL: {
+      Entry *entry = lookupGlobal(vm, chunk, instruction, b->as.string);
+      if (entry == NULL) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      registers[instruction->a] = entry->value;
+      break;
+    }
+    case REG_SET_GLOBAL: {
+      String *name = registers[instruction->a].as.string;
+      Entry *entry = lookupGlobal(vm, chunk, instruction, name);
+      if (entry == NULL) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      entry->value = *b;
+      break;
+    }
+    case REG_DEFINE_GLOBAL: {
+      bindGlobal(vm, registers[instruction->a].as.string, *b);
+      break;
+    }
+    case REG_PRINT: {
+      writeValue(&vm->output, *b);
+      break;
+    }
+    case REG_JUMP: {
+      ip = chunk->code + instruction->a;
+      break;
+    }
+    case REG_JUMP_IF_FALSE: {
+      if (isFalsey(*b)) {
+        ip = chunk->code + instruction->a;
+      }
+      break;
+    }
+    case REG_JUMP_IF_NOT_LESS:
+    case REG_JUMP_IF_NOT_GREATER:
+    case REG_JUMP_IF_LESS:
+    case REG_JUMP_IF_GREATER: {
+      if (b->type != VAL_NUMBER || c->type != VAL_NUMBER) {
+        runtimeError(vm, instruction, "Operands must be numbers.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      bool less = instruction->op == REG_JUMP_IF_NOT_LESS ||
+                  instruction->op == REG_JUMP_IF_LESS;
+      bool taken = less ? b->as.number < c->as.number
+                        : b->as.number > c->as.number;
+      if (instruction->op == REG_JUMP_IF_NOT_LESS ||
+          instruction->op == REG_JUMP_IF_NOT_GREATER) {
+        taken = !taken;
+      }
+      if (taken) {
+        ip = chunk->code + instruction->a;
+      }
+      break;
+    }
+    case REG_RETURN: {
+      return INTERPRET_OK;
+    }
+    }
+  }
+}
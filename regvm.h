@@ -0,0 +1,62 @@
+#include "chunk.h"
+#include "value.h"
+#include "vm.h"
+#include <stdint.h>
+
+#pragma once
+
+// Three-address instructions over a register file. Registers 0..
+// registerCount-1 are the stack slots the stack VM would use, locals
+// included; above them sit the chunk's constants, so an operand naming a
+// register or a constant is read the same way. Comments use R[x] for either.
+typedef enum {
+  REG_MOVE,            // R[a] = R[b]
+  REG_ADD,             // R[a] = R[b] + R[c]
+  REG_SUBTRACT,        // R[a] = R[b] - R[c]
+  REG_MULTIPLY,        // R[a] = R[b] * R[c]
+  REG_DIVIDE,          // R[a] = R[b] / R[c]
+  REG_EQUAL,           // R[a] = R[b] == R[c]
+  REG_LESS,            // R[a] = R[b] < R[c]
+  REG_GREATER,         // R[a] = R[b] > R[c]
+  REG_NEGATE,          // R[a] = -R[b]
+  REG_NOT,             // R[a] = !R[b]
+  REG_GET_GLOBAL,      // R[a] = globals[R[b]]
+  REG_DEFINE_GLOBAL,   // define globals[R[a]] = R[b]
+  REG_SET_GLOBAL,      // globals[R[a]] = R[b]
+  REG_PRINT,           // print R[b]
+  REG_JUMP,            // goto a
+  REG_JUMP_IF_FALSE,   // if R[b] is falsey goto a
+  REG_JUMP_IF_NOT_LESS,    // if !(R[b] < R[c]) goto a
+  REG_JUMP_IF_NOT_GREATER, // if !(R[b] > R[c]) goto a
+  REG_JUMP_IF_LESS,        // if R[b] < R[c] goto a
+  REG_JUMP_IF_GREATER,     // if R[b] > R[c] goto a
+  REG_RETURN,
+} RegOpCode;
+
+typedef struct {
+  uint8_t op;
+  int line;
+  uint32_t a;
+  uint32_t b;
+  uint32_t c;
+} RegInstruction;
+
+typedef struct {
+  RegInstruction *code;
+  int count;
+  int capacity;
+  int registerCount;
+  // Borrowed copies of the stack chunk's constants followed by the literals
+  // the stack code encoded inline. The stack chunk owns the strings.
+  ValueArray constants;
+  // Inline cache for each global access, indexed like code.
+  GlobalCache *globalCaches;
+} RegChunk;
+
+void initRegChunk(RegChunk *chunk);
+int writeRegChunk(RegChunk *chunk, RegInstruction instruction);
+void freeRegChunk(RegChunk *chunk);
+
+// Runs chunk with vm->stack as the register file. The stack must hold
+// registerCount plus the number of constants.
+InterpretResult runRegisters(VM *vm, RegChunk *chunk);
@@ -3,114 +3,133 @@
 #include <stdio.h>
 #include <string.h>
 
-typedef struct {
-  const char *start;
-  const char *current;
-  int line;
-} Scanner;
-Scanner scanner;
-
-void initScanner(const char *source) {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+void initScanner(Scanner *scanner, const char *source) {
+  scanner->start = source;
+  scanner->current = source;
+  scanner->line = 1;
 }
 
-static char advance() {
-  scanner.current++;
-  return scanner.current[-1];
+static char advance(Scanner *scanner) {
+  scanner->current++;
+  return scanner->current[-1];
 }
 
-static bool isAtEnd() { return *scanner.current == '\0'; }
-static char peek() { return *scanner.current; }
-static char peekNext() { return *(scanner.current + 1); }
+static bool isAtEnd(Scanner *scanner) { return *scanner->current == '\0'; }
+static char peek(Scanner *scanner) { return *scanner->current; }
+static char peekNext(Scanner *scanner) { return *(scanner->current + 1); }
 
 static bool isAlpha(char c) {
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
-// static char peekNext() { return scanner.current[1]; }
+static bool isDigit(char c) { return c >= '0' && c <= '9'; }
 
 bool matchKeyword(const char *keyword, const char *lexeme, int length) {
   if (strlen(keyword) != (size_t)length) {
     return false;
   }
-  scanner.current = scanner.current + length - 1;
-  // Then do character by character comparison
   return strncmp(keyword, lexeme, length) == 0;
 }
 
-TokenType keyword(const char *lexeme) {
+TokenType keyword(Scanner *scanner, const char *lexeme) {
+  while (isAlpha(peek(scanner)) || isDigit(peek(scanner))) {
+    advance(scanner);
+  }
+  int length = (int)(scanner->current - lexeme);
+
   switch (lexeme[0]) {
+  case 'c': {
+    if (matchKeyword("class", lexeme, length))
+      return TOKEN_CLASS;
+    break;
+  }
   case 'w': {
-    if (matchKeyword("while", lexeme, 5))
+    if (matchKeyword("while", lexeme, length))
       return TOKEN_WHILE;
     break;
   }
   case 'e': {
-    if (matchKeyword("else", lexeme, 4))
+    if (matchKeyword("else", lexeme, length))
       return TOKEN_ELSE;
     break;
   }
   case 'i': {
-    if (matchKeyword("if", lexeme, 2))
+    if (matchKeyword("if", lexeme, length))
       return TOKEN_IF;
     break;
   }
+  case 'n': {
+    if (matchKeyword("nil", lexeme, length))
+      return TOKEN_NIL;
+    break;
+  }
+  case 'r': {
+    if (matchKeyword("return", lexeme, length))
+      return TOKEN_RETURN;
+    break;
+  }
+  case 's': {
+    if (matchKeyword("super", lexeme, length))
+      return TOKEN_SUPER;
+    break;
+  }
   case 'v':
-    if (matchKeyword("var", lexeme, 3))
+    if (matchKeyword("var", lexeme, length))
       return TOKEN_VAR;
     break;
   case 'p':
-    if (matchKeyword("print", lexeme, 5))
+    if (matchKeyword("print", lexeme, length))
       return TOKEN_PRINT;
     break;
   case 't':
-    if (matchKeyword("true", lexeme, 4))
+    if (matchKeyword("true", lexeme, length))
       return TOKEN_TRUE;
+    if (matchKeyword("this", lexeme, length))
+      return TOKEN_THIS;
     break;
   case 'f':
-    if (matchKeyword("false", lexeme, 5))
+    if (matchKeyword("false", lexeme, length))
       return TOKEN_FALSE;
+    if (matchKeyword("for", lexeme, length))
+      return TOKEN_FOR;
+    if (matchKeyword("fun", lexeme, length))
+      return TOKEN_FUN;
     break;
   }
 
   // it has to be identifier
-  while (isAlpha(peek())) {
-    advance();
-  }
   return TOKEN_IDENTIFIER;
 }
 
-static Token makeToken(TokenType tokenType) {
+static Token makeToken(Scanner *scanner, TokenType tokenType) {
   Token token;
   token.type = tokenType;
-  token.start = scanner.start;
-  token.line = scanner.line;
-  token.length = (int)(scanner.current - scanner.start);
+  token.start = scanner->start;
+  token.line = scanner->line;
+  token.length = (int)(scanner->current - scanner->start);
   return token;
 }
 
-static void skipWhitespace() {
+static void skipWhitespace(Scanner *scanner) {
   for (;;) {
-    char c = peek();
+    char c = peek(scanner);
     switch (c) {
     case ' ':
     case '\r':
     case '\t': {
-      advance();
+      advance(scanner);
       break;
     }
     case '\n': {
-      scanner.line++;
-      advance();
+      scanner->line++;
+      advance(scanner);
       break;
     }
     case '/': {
-      if (peekNext() == '/') {
-        while (peek() != '\n') {
-          advance();
-        }
-        advance();
+      if (peekNext(scanner) != '/') {
+        return;
+      }
+      while (peek(scanner) != '\n' && !isAtEnd(scanner)) {
+        advance(scanner);
       }
       break;
     }
@@ -121,102 +140,150 @@ static void skipWhitespace() {
   }
 }
 
-static bool isDigit(char c) { return c >= '0' && c <= '9'; }
-
-static Token errorToken(const char *message) {
+static Token errorToken(Scanner *scanner, const char *message) {
   Token token;
   token.type = TOKEN_ERROR;
   token.start = message;
-  token.line = scanner.line;
+  token.line = scanner->line;
   token.length = strlen(message);
   return token;
 }
 
-Token string() {
-  while (peek() != '"' && !isAtEnd()) {
-    if (peek() == '\n') {
-      scanner.line++;
+Token string(Scanner *scanner) {
+  while (peek(scanner) != '"' && !isAtEnd(scanner)) {
+    if (peek(scanner) == '\n') {
+      scanner->line++;
     }
-    advance();
+    advance(scanner);
   }
-  if (isAtEnd()) {
-    return errorToken("Unterminated string");
+  if (isAtEnd(scanner)) {
+    return errorToken(scanner, "Unterminated string");
   }
-  advance();
-  return makeToken(TOKEN_STRING);
+  advance(scanner);
+  return makeToken(scanner, TOKEN_STRING);
 }
 
-Token scanToken() {
-  skipWhitespace();
-  scanner.start = scanner.current;
-  char c = advance();
+Token number(Scanner *scanner) {
+  while (isDigit(peek(scanner))) {
+    advance(scanner);
+  }
+  if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
+    advance(scanner);
+    while (isDigit(peek(scanner))) {
+      advance(scanner);
+    }
+  }
+  return makeToken(scanner, TOKEN_NUMBER);
+}
+
+Token scanToken(Scanner *scanner) {
+  skipWhitespace(scanner);
+  scanner->start = scanner->current;
+  // Stays on the terminator, so scanning on past the end keeps giving EOF.
+  if (isAtEnd(scanner)) {
+    return makeToken(scanner, TOKEN_EOF);
+  }
+  char c = advance(scanner);
 
   if (isAlpha(c)) {
-    TokenType tokenType = keyword(scanner.start);
-    Token token = makeToken(tokenType);
+    TokenType tokenType = keyword(scanner, scanner->start);
+    Token token = makeToken(scanner, tokenType);
 
     return token;
-    // return makeToken(tokenType);
+    // return makeToken(scanner, tokenType);
   }
   if (isDigit(c)) {
-    return makeToken(TOKEN_NUMBER);
+    return number(scanner);
   }
 
   switch (c) {
   case '(': {
-    return makeToken(TOKEN_LEFT_PAREN);
+    return makeToken(scanner, TOKEN_LEFT_PAREN);
   }
   case ')': {
-    return makeToken(TOKEN_RIGHT_PAREN);
+    return makeToken(scanner, TOKEN_RIGHT_PAREN);
   }
   case '{': {
-    return makeToken(TOKEN_LEFT_BRACE);
+    return makeToken(scanner, TOKEN_LEFT_BRACE);
   }
   case '}': {
-    return makeToken(TOKEN_RIGHT_BRACE);
+    return makeToken(scanner, TOKEN_RIGHT_BRACE);
+  }
+  case '[': {
+    return makeToken(scanner, TOKEN_LEFT_BRACKET);
+  }
+  case ']': {
+    return makeToken(scanner, TOKEN_RIGHT_BRACKET);
+  }
+  case ':': {
+    return makeToken(scanner, TOKEN_COLON);
   }
   case ';': {
-    return makeToken(TOKEN_SEMICOLON);
+    return makeToken(scanner, TOKEN_SEMICOLON);
   }
-  case '\0': {
-    return makeToken(TOKEN_EOF);
+  case ',': {
+    return makeToken(scanner, TOKEN_COMMA);
+  }
+  case '.': {
+    return makeToken(scanner, TOKEN_DOT);
   }
   case '=': {
-    return makeToken(TOKEN_EQUAL);
+    if (peek(scanner) == '=') {
+      advance(scanner);
+      return makeToken(scanner, TOKEN_EQUAL_EQUAL);
+    }
+    return makeToken(scanner, TOKEN_EQUAL);
   }
   case '"': {
-    return string();
+    return string(scanner);
   }
   case '<': {
-    return makeToken(TOKEN_LESS);
+    if (peek(scanner) == '=') {
+      advance(scanner);
+      return makeToken(scanner, TOKEN_LESS_EQUAL);
+    }
+    return makeToken(scanner, TOKEN_LESS);
   }
   case '>': {
-    return makeToken(TOKEN_GREATER);
+    if (peek(scanner) == '=') {
+      advance(scanner);
+      return makeToken(scanner, TOKEN_GREATER_EQUAL);
+    }
+    return makeToken(scanner, TOKEN_GREATER);
   }
   case '+': {
-    return makeToken(TOKEN_PLUS);
+    return makeToken(scanner, TOKEN_PLUS);
+  }
+  case '-': {
+    return makeToken(scanner, TOKEN_MINUS);
+  }
+  case '*': {
+    return makeToken(scanner, TOKEN_STAR);
+  }
+  case '/': {
+    return makeToken(scanner, TOKEN_SLASH);
   }
   case '|': {
-    if (peek() == '|') {
-      advance();
-      return makeToken(TOKEN_OR);
+    if (peek(scanner) == '|') {
+      advance(scanner);
+      return makeToken(scanner, TOKEN_OR);
     }
     break;
   }
   case '&': {
-    if (peek() == '&') {
-      advance();
-      return makeToken(TOKEN_AND);
+    if (peek(scanner) == '&') {
+      advance(scanner);
+      return makeToken(scanner, TOKEN_AND);
     }
     break;
   }
   case '!': {
-    if (peek() == '=') {
-      advance();
-      return makeToken(TOKEN_BANG_EQUAL);
+    if (peek(scanner) == '=') {
+      advance(scanner);
+      return makeToken(scanner, TOKEN_BANG_EQUAL);
     }
-    return makeToken(TOKEN_BANG);
+    return makeToken(scanner, TOKEN_BANG);
   }
   }
-  return errorToken("Unexpected character.");
+  return errorToken(scanner, "Unexpected character.");
 }
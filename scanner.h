@@ -6,7 +6,10 @@ typedef enum {
   TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE,
   TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET,
+  TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA,
+  TOKEN_COLON,
   TOKEN_DOT,
   TOKEN_MINUS,
   TOKEN_PLUS,
@@ -55,5 +58,11 @@ typedef struct {
     int line;
 } Token;
 
-Token scanToken();
-void initScanner(const char *source);
\ No newline at end of file
+typedef struct {
+  const char *start;
+  const char *current;
+  int line;
+} Scanner;
+
+Token scanToken(Scanner *scanner);
+void initScanner(Scanner *scanner, const char *source);
\ No newline at end of file
@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "lox.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define HEADER_MAX 4096
+#define FRAME_BUFFER 4096
+// Larger sources are refused rather than allocated on a client's say-so.
+#define SOURCE_MAX (64 << 20)
+// Seconds a client may leave a request half sent before it is dropped, since
+// one connection is served at a time.
+#define READ_TIMEOUT 5
+
+typedef struct {
+  int fd;
+  char tag;
+  // Set once the client has gone away; the rest of the output is dropped.
+  bool failed;
+} FrameStream;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signal) {
+  (void)signal;
+  stopping = 1;
+}
+
+static bool writeAll(int fd, const void *data, size_t length) {
+  const char *bytes = data;
+  while (length > 0) {
+    ssize_t written = write(fd, bytes, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += written;
+    length -= written;
+  }
+  return true;
+}
+
+static bool readAll(int fd, void *data, size_t length) {
+  char *bytes = data;
+  while (length > 0) {
+    ssize_t got = read(fd, bytes, length);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    bytes += got;
+    length -= got;
+  }
+  return true;
+}
+
+static bool writeFrame(int fd, char tag, const void *data, size_t length) {
+  unsigned char header[5] = {tag, length >> 24, length >> 16, length >> 8,
+                             length};
+  return writeAll(fd, header, sizeof(header)) && writeAll(fd, data, length);
+}
+
+static ssize_t writeFrameStream(void *cookie, const char *data,
+                                size_t length) {
+  FrameStream *stream = cookie;
+  if (!stream->failed && !writeFrame(stream->fd, stream->tag, data, length)) {
+    stream->failed = true;
+  }
+  return length;
+}
+
+// Wraps stream in a FILE whose buffer goes out as one frame each time it is
+// flushed, so long-running scripts stream their output.
+static FILE *openFrameStream(FrameStream *stream) {
+  cookie_io_functions_t functions = {NULL, writeFrameStream, NULL, NULL};
+  FILE *file = fopencookie(stream, "w", functions);
+  if (file == NULL) {
+    exit(1);
+  }
+  setvbuf(file, NULL, _IOFBF, FRAME_BUFFER);
+  return file;
+}
+
+// Reads the request on fd and returns the source it names, or NULL after
+// reporting why to errors and setting status.
+static char *readRequest(int fd, FILE *errors, int *status) {
+  char header[HEADER_MAX];
+  int length = 0;
+  for (;;) {
+    if (length == HEADER_MAX - 1 || !readAll(fd, &header[length], 1)) {
+      fprintf(errors, "Malformed request.\n");
+      *status = 64;
+      return NULL;
+    }
+    if (header[length] == '\n') {
+      break;
+    }
+    length++;
+  }
+  header[length] = '\0';
+
+  if (strncmp(header, "FILE ", 5) == 0) {
+    char *source = loxReadFile(header + 5, errors);
+    if (source == NULL) {
+      *status = 74;
+    }
+    return source;
+  }
+
+  char *end = header;
+  long size = -1;
+  if (strncmp(header, "SOURCE ", 7) == 0) {
+    size = strtol(header + 7, &end, 10);
+  }
+  if (*end != '\0' || size < 0 || size > SOURCE_MAX) {
+    fprintf(errors, "Malformed request.\n");
+    *status = 64;
+    return NULL;
+  }
+  char *source = malloc(size + 1);
+  if (source == NULL || !readAll(fd, source, size)) {
+    fprintf(errors, "Malformed request.\n");
+    free(source);
+    *status = 64;
+    return NULL;
+  }
+  source[size] = '\0';
+  return source;
+}
+
+static void serveConnection(LoxVM *vm, int fd) {
+  FrameStream outStream = {fd, LOX_FRAME_OUTPUT, false};
+  FrameStream errStream = {fd, LOX_FRAME_ERROR, false};
+  FILE *out = openFrameStream(&outStream);
+  FILE *err = openFrameStream(&errStream);
+
+  int status = 0;
+  char *source = readRequest(fd, err, &status);
+  if (source != NULL) {
+    loxSetOutput(vm, out, err);
+    switch (loxInterpret(vm, source)) {
+    case LOX_COMPILE_ERROR: {
+      status = 65;
+      break;
+    }
+    case LOX_RUNTIME_ERROR: {
+      status = 70;
+      break;
+    }
+    default: {
+      break;
+    }
+    }
+    loxSetOutput(vm, stdout, stderr);
+    loxResetVM(vm);
+    free(source);
+  }
+
+  // A runtime error always comes after the output, so closing out first keeps
+  // the two in order.
+  fclose(out);
+  fclose(err);
+  if (!errStream.failed) {
+    unsigned char code = status;
+    writeFrame(fd, LOX_FRAME_STATUS, &code, 1);
+  }
+}
+
+int runServer(LoxVM *vm, const char *path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path '%s' is too long.\n", path);
+    return 64;
+  }
+  strcpy(address.sun_path, path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    perror("socket");
+    return 71;
+  }
+  // Only a socket left by an earlier server is replaced.
+  struct stat existing;
+  if (lstat(path, &existing) == 0) {
+    if (!S_ISSOCK(existing.st_mode)) {
+      fprintf(stderr, "'%s' exists and is not a socket.\n", path);
+      close(listener);
+      return 73;
+    }
+    unlink(path);
+  }
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listener, 64) != 0) {
+    fprintf(stderr, "Could not listen on '%s': %s\n", path, strerror(errno));
+    close(listener);
+    return 71;
+  }
+
+  // No SA_RESTART, so a signal breaks out of accept().
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  loxSetDumpChunks(vm, false);
+  loxSetChunkCache(vm, true);
+  fprintf(stderr, "Serving on %s\n", path);
+
+  int status = 0;
+  while (!stopping) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("accept");
+      status = 71;
+      break;
+    }
+    struct timeval timeout = {READ_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    serveConnection(vm, fd);
+    close(fd);
+  }
+  close(listener);
+  unlink(path);
+  return status;
+}
@@ -0,0 +1,22 @@
+#include "lox.h"
+
+#pragma once
+
+#define LOX_SOCKET_PATH "/tmp/lox.sock"
+
+// Protocol between runServer and loxc, one script per connection.
+//
+// The client sends a header line, either "FILE <absolute path>\n" for a
+// script the server should read itself, or "SOURCE <length>\n" followed by
+// length bytes of source. The server answers with frames of a tag byte, a
+// 32-bit big-endian payload length and the payload: output frames as the
+// script prints, error frames for compile and runtime errors, and a final
+// status frame whose one-byte payload is the exit status clox would use.
+#define LOX_FRAME_OUTPUT 'o'
+#define LOX_FRAME_ERROR 'e'
+#define LOX_FRAME_STATUS 's'
+
+// Serves scripts on a Unix socket at path until SIGINT or SIGTERM, running
+// each on vm after resetting it. Compiled chunks are cached, so a script sent
+// again skips compilation. Returns the process exit status.
+int runServer(LoxVM *vm, const char *path);
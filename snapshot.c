@@ -0,0 +1,311 @@
+#include "snapshot.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File layout: a header, globalCount SnapshotGlobals, stringCount
+// SnapshotStrings, then stringBytes of characters with each string
+// NUL-terminated. Strings are referred to by index.
+#define SNAPSHOT_MAGIC "LOXSNAP"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t globalCount;
+  uint32_t stringCount;
+  uint32_t valueSize;
+  uint64_t stringBytes;
+} SnapshotHeader;
+
+typedef struct {
+  uint32_t key;
+  uint32_t type;
+  union {
+    double number;
+    uint64_t string;
+    uint64_t boolean;
+  } as;
+} SnapshotGlobal;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t length;
+} SnapshotString;
+
+struct Snapshot {
+  void *mapping;
+  size_t size;
+  String *strings;
+  Snapshot *next;
+};
+
+typedef struct {
+  SnapshotString *strings;
+  int count;
+  int capacity;
+  uint64_t bytes;
+} StringList;
+
+static uint32_t addString(StringList *list, String *string) {
+  if (list->capacity <= list->count) {
+    list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+    list->strings =
+        realloc(list->strings, list->capacity * sizeof(SnapshotString));
+    if (list->strings == NULL) {
+      exit(1);
+    }
+  }
+  list->strings[list->count] =
+      (SnapshotString){list->bytes, (uint64_t)string->length};
+  list->bytes += string->length + 1;
+  return (uint32_t)list->count++;
+}
+
+bool saveSnapshot(VM *vm, const char *path) {
+  Table *globals = &vm->globals;
+  // A function's code belongs to the chunk that declared it, which a
+  // snapshot does not keep, and arrays, maps, classes, instances and fibers
+  // can refer to such code or to each other. Natives are left out, since
+  // every VM defines its own.
+  for (int i = 0; i < globals->entryCount; i++) {
+    Entry *entry = &globals->entries[i];
+    if (entry->key.type == VAL_NIL) {
+      continue;
+    }
+    const char *name = entry->key.as.string->chars;
+    if (entry->value.type == VAL_FUNCTION) {
+      fprintf(vm->err, "Can't snapshot function '%s'\n", name);
+      return false;
+    }
+    if (entry->value.type == VAL_ARRAY) {
+      fprintf(vm->err, "Can't snapshot array '%s'\n", name);
+      return false;
+    }
+    if (entry->value.type == VAL_MAP) {
+      fprintf(vm->err, "Can't snapshot map '%s'\n", name);
+      return false;
+    }
+    if (entry->value.type == VAL_CLASS ||
+        entry->value.type == VAL_INSTANCE) {
+      fprintf(vm->err, "Can't snapshot class or instance '%s'\n", name);
+      return false;
+    }
+    if (entry->value.type == VAL_FIBER) {
+      fprintf(vm->err, "Can't snapshot fiber '%s'\n", name);
+      return false;
+    }
+  }
+  SnapshotGlobal *records =
+      malloc((globals->count > 0 ? globals->count : 1) *
+             sizeof(SnapshotGlobal));
+  // Strings in the order their characters are written.
+  String **sources =
+      malloc((globals->count > 0 ? globals->count : 1) * 2 * sizeof(String *));
+  if (records == NULL || sources == NULL) {
+    exit(1);
+  }
+  StringList list = {NULL, 0, 0, 0};
+  int count = 0;
+  for (int i = 0; i < globals->entryCount; i++) {
+    Entry *entry = &globals->entries[i];
+    if (entry->key.type == VAL_NIL || entry->value.type == VAL_NATIVE) {
+      continue;
+    }
+    SnapshotGlobal *record = &records[count++];
+    sources[list.count] = entry->key.as.string;
+    record->key = addString(&list, entry->key.as.string);
+    record->type = entry->value.type;
+    switch (entry->value.type) {
+    case VAL_NUMBER: {
+      record->as.number = entry->value.as.number;
+      break;
+    }
+    case VAL_STRING: {
+      sources[list.count] = entry->value.as.string;
+      record->as.string = addString(&list, entry->value.as.string);
+      break;
+    }
+    case VAL_BOOL: {
+      record->as.boolean = entry->value.as.boolean;
+      break;
+    }
+    case VAL_NIL:
+    case VAL_FUNCTION:
+    case VAL_NATIVE:
+    case VAL_ARRAY:
+    case VAL_MAP:
+    case VAL_CLASS:
+    case VAL_INSTANCE:
+    case VAL_FIBER: {
+      record->as.boolean = 0;
+      break;
+    }
+    }
+  }
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  header.version = SNAPSHOT_VERSION;
+  header.globalCount = count;
+  header.stringCount = list.count;
+  header.valueSize = sizeof(Value);
+  header.stringBytes = list.bytes;
+
+  bool ok = false;
+  FILE *file = fopen(path, "wb");
+  if (file != NULL) {
+    ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+         fwrite(records, sizeof(SnapshotGlobal), count, file) ==
+             (size_t)count &&
+         fwrite(list.strings, sizeof(SnapshotString), list.count, file) ==
+             (size_t)list.count;
+    for (int i = 0; ok && i < list.count; i++) {
+      ok = fwrite(sources[i]->chars, 1, sources[i]->length, file) ==
+               (size_t)sources[i]->length &&
+           fputc('\0', file) != EOF;
+    }
+    ok = fclose(file) == 0 && ok;
+  }
+  if (!ok) {
+    fprintf(vm->err, "Could not write snapshot '%s'\n", path);
+  }
+  free(records);
+  free(sources);
+  free(list.strings);
+  return ok;
+}
+
+static bool invalid(VM *vm, const char *path, void *mapping, size_t size) {
+  fprintf(vm->err, "'%s' is not a snapshot from this build\n", path);
+  munmap(mapping, size);
+  return false;
+}
+
+bool loadSnapshot(VM *vm, const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) != 0) {
+    fprintf(vm->err, "Could not open snapshot '%s'\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  size_t size = info.st_size;
+  void *mapping = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                           : MAP_FAILED;
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(vm->err, "Could not map snapshot '%s'\n", path);
+    return false;
+  }
+
+  // Check everything the loop below relies on before trusting any offset.
+  SnapshotHeader *header = mapping;
+  if (size < sizeof(SnapshotHeader) ||
+      memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+      header->version != SNAPSHOT_VERSION ||
+      header->valueSize != sizeof(Value)) {
+    return invalid(vm, path, mapping, size);
+  }
+  uint64_t tables = sizeof(SnapshotHeader) +
+                    (uint64_t)header->globalCount * sizeof(SnapshotGlobal) +
+                    (uint64_t)header->stringCount * sizeof(SnapshotString);
+  if (tables > size || header->stringBytes != size - tables) {
+    return invalid(vm, path, mapping, size);
+  }
+  SnapshotGlobal *records = (SnapshotGlobal *)(header + 1);
+  SnapshotString *strings =
+      (SnapshotString *)(records + header->globalCount);
+  char *chars = (char *)mapping + tables;
+  for (uint32_t i = 0; i < header->stringCount; i++) {
+    SnapshotString *string = &strings[i];
+    if (string->offset >= header->stringBytes ||
+        string->length >= header->stringBytes - string->offset ||
+        string->length > INT32_MAX ||
+        chars[string->offset + string->length] != '\0') {
+      return invalid(vm, path, mapping, size);
+    }
+  }
+  for (uint32_t i = 0; i < header->globalCount; i++) {
+    SnapshotGlobal *record = &records[i];
+    if (record->key >= header->stringCount || record->type > VAL_NIL ||
+        (record->type == VAL_STRING &&
+         record->as.string >= header->stringCount)) {
+      return invalid(vm, path, mapping, size);
+    }
+  }
+
+  Snapshot *snapshot = malloc(sizeof(Snapshot));
+  String *loaded = malloc((header->stringCount > 0 ? header->stringCount : 1) *
+                          sizeof(String));
+  if (snapshot == NULL || loaded == NULL) {
+    exit(1);
+  }
+  for (uint32_t i = 0; i < header->stringCount; i++) {
+    loaded[i].chars = chars + strings[i].offset;
+    loaded[i].length = (int)strings[i].length;
+  }
+  // Records are in the order the saving VM defined its globals, which is the
+  // order they are added back in. Reserving room for all of them up front
+  // saves rehashing the table each time it would double along the way.
+  tableReserve(&vm->globals, vm->globals.count + (int)header->globalCount);
+  for (uint32_t i = 0; i < header->globalCount; i++) {
+    SnapshotGlobal *record = &records[i];
+    Value value;
+    value.type = record->type;
+    switch (value.type) {
+    case VAL_NUMBER: {
+      value.as.number = record->as.number;
+      break;
+    }
+    case VAL_STRING: {
+      value.as.string = &loaded[record->as.string];
+      break;
+    }
+    case VAL_BOOL: {
+      value.as.boolean = record->as.boolean != 0;
+      break;
+    }
+    case VAL_NIL:
+    case VAL_FUNCTION:
+    case VAL_NATIVE:
+    case VAL_ARRAY:
+    case VAL_MAP:
+    case VAL_CLASS:
+    case VAL_INSTANCE:
+    case VAL_FIBER: {
+      break;
+    }
+    }
+    tableSet(&vm->globals, &loaded[record->key], value);
+  }
+
+  snapshot->mapping = mapping;
+  snapshot->size = size;
+  snapshot->strings = loaded;
+  snapshot->next = vm->snapshots;
+  vm->snapshots = snapshot;
+  return true;
+}
+
+void freeSnapshots(Snapshot *snapshot) {
+  while (snapshot != NULL) {
+    Snapshot *next = snapshot->next;
+    munmap(snapshot->mapping, snapshot->size);
+    free(snapshot->strings);
+    free(snapshot);
+    snapshot = next;
+  }
+}
@@ -0,0 +1,19 @@
+#include <stdbool.h>
+
+#pragma once
+
+// Globals loaded from a snapshot file. The strings point into the mapped
+// file, so it stays mapped as long as any global may refer to them.
+typedef struct Snapshot Snapshot;
+
+struct VM;
+
+// Writes every global of vm, with the strings they hold, to path. The file
+// is only meant to be read back by the same build on the same machine.
+// Fails when a global holds a function. Natives are not saved.
+bool saveSnapshot(struct VM *vm, const char *path);
+// Maps the snapshot at path and defines its globals on vm, replacing any of
+// the same name. Failures are reported to vm->err.
+bool loadSnapshot(struct VM *vm, const char *path);
+// Unmaps every snapshot in the list starting at snapshot.
+void freeSnapshots(Snapshot *snapshot);
@@ -7,11 +7,15 @@
 
 void initTable(Table *table) {
   table->count = 0;
-  table->capacity = 0;
+  table->entryCount = 0;
+  table->entryCapacity = 0;
   table->entries = NULL;
+  table->capacity = 0;
+  table->slots = NULL;
+  table->version = 1;
 }
 
-static uint32_t hashString(const char *chars, int length) {
+uint32_t hashString(const char *chars, int length) {
   uint32_t hash = 2166136261u; // FNV-1a hash
 
   for (int i = 0; i < length; i++) {
@@ -22,126 +26,221 @@ static uint32_t hashString(const char *chars, int length) {
   return hash;
 }
 
-static Entry *findEntry(Entry *entries, int capacity, String *key) {
-  uint32_t hash = hashString(key->chars, key->length);
-  uint32_t index = hash % capacity;
-  Entry *tombstone = NULL;
+static uint32_t hashKey(Value key) {
+  switch (key.type) {
+  case VAL_STRING: {
+    return hashString(key.as.string->chars, key.as.string->length);
+  }
+  case VAL_BOOL: {
+    return key.as.boolean ? 0x9e3779b9u : 0x7f4a7c15u;
+  }
+  default: {
+    // -0 equals 0, so it has to hash the same.
+    double number = key.as.number == 0 ? 0 : key.as.number;
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+  }
+  }
+}
 
-  // Linear probing
+static bool keysEqual(Value a, Value b) {
+  if (a.type != b.type) {
+    return false;
+  }
+  switch (a.type) {
+  case VAL_STRING: {
+    return a.as.string->length == b.as.string->length &&
+           memcmp(a.as.string->chars, b.as.string->chars,
+                  a.as.string->length) == 0;
+  }
+  case VAL_BOOL: {
+    return a.as.boolean == b.as.boolean;
+  }
+  default: {
+    return a.as.number == b.as.number;
+  }
+  }
+}
+
+static Value stringKey(String *key) {
+  Value value;
+  value.type = VAL_STRING;
+  value.as.string = key;
+  return value;
+}
+
+// Returns the slot of the entry for key, or the empty slot where it
+// belongs. Deleted entries match no key, so probing passes over them.
+static int *findSlot(int *slots, int capacity, Entry *entries, Value key,
+                     uint32_t hash) {
+  uint32_t index = hash & (capacity - 1);
   for (;;) {
-    Entry *entry = &entries[index];
-
-    if (entry->key == NULL) {
-      // Empty entry
-      if (!entry->isDeleted) {
-        // If it's not a tombstone, this is where we insert
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // Found a tombstone, remember it
-        if (tombstone == NULL)
-          tombstone = entry;
-      }
-    } else if (entry->key->length == key->length &&
-               memcmp(entry->key->chars, key->chars, key->length) == 0) {
-      // We found the key
-      return entry;
+    int *slot = &slots[index];
+    if (*slot == 0) {
+      return slot;
+    }
+    Entry *entry = &entries[*slot - 1];
+    if (entry->hash == hash && keysEqual(entry->key, key)) {
+      return slot;
     }
+    index = (index + 1) & (capacity - 1);
+  }
+}
 
-    index = (index + 1) % capacity;
+// Slots are kept at most three quarters full.
+static int capacityFor(int count) {
+  int capacity = 8;
+  while (count > capacity / 4 * 3) {
+    capacity *= 2;
   }
+  return capacity;
 }
 
-static void adjustCapacity(Table *table, int newCapacity) {
-  // Allocate new array
-  Entry *entries = calloc(newCapacity, sizeof(Entry));
-  table->count = 0; // Will recount as we re-insert
+// Moves the live entries, still in order, into arrays sized for capacity.
+static void adjustCapacity(Table *table, int capacity) {
+  int entryCapacity = capacity / 4 * 3;
+  Entry *entries = malloc(entryCapacity * sizeof(Entry));
+  int *slots = calloc(capacity, sizeof(int));
+  if (entries == NULL || slots == NULL) {
+    exit(1);
+  }
 
-  // Re-insert all existing entries
-  for (int i = 0; i < table->capacity; i++) {
+  int count = 0;
+  for (int i = 0; i < table->entryCount; i++) {
     Entry *entry = &table->entries[i];
-    if (entry->key == NULL || entry->isDeleted)
+    if (entry->key.type == VAL_NIL) {
       continue;
-
-    Entry *dest = findEntry(entries, newCapacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
+    }
+    entries[count] = *entry;
+    *findSlot(slots, capacity, entries, entry->key, entry->hash) = ++count;
   }
 
-  // Free old array
   free(table->entries);
-
+  free(table->slots);
   table->entries = entries;
-  table->capacity = newCapacity;
+  table->entryCount = count;
+  table->entryCapacity = entryCapacity;
+  table->slots = slots;
+  table->capacity = capacity;
+  table->version++;
 }
 
-bool tableSet(Table *table, String *key, Value value) {
-  // Grow if needed
-  if (table->count + 1 > table->capacity * 0.75) {
-    int capacity = table->capacity < 8 ? 8 : table->capacity * 2;
-    adjustCapacity(table, capacity);
+void tableReserve(Table *table, int count) {
+  if (count > table->entryCapacity - table->entryCount + table->count) {
+    int capacity = capacityFor(count);
+    adjustCapacity(table, capacity < table->capacity ? table->capacity
+                                                     : capacity);
+  }
+}
+
+bool tableSetKey(Table *table, Value key, Value value) {
+  uint32_t hash = hashKey(key);
+  if (table->capacity > 0) {
+    int *slot =
+        findSlot(table->slots, table->capacity, table->entries, key, hash);
+    if (*slot != 0) {
+      table->entries[*slot - 1].value = value;
+      return false;
+    }
   }
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && !entry->isDeleted)
-    table->count++;
+  // Full, though some of the entries may only need compacting away. That
+  // only pays when it frees at least half of them; otherwise the table
+  // grows, so deleting and adding at a full table does not copy it each time.
+  if (table->entryCount == table->entryCapacity) {
+    int capacity = capacityFor(table->count + 1);
+    if (table->count >= table->entryCapacity / 2 &&
+        capacity <= table->capacity) {
+      capacity = table->capacity * 2;
+    }
+    adjustCapacity(table, capacity);
+  }
+  int *slot =
+      findSlot(table->slots, table->capacity, table->entries, key, hash);
+  table->entries[table->entryCount] = (Entry){key, value, hash};
+  *slot = ++table->entryCount;
+  table->count++;
+  return true;
+}
 
-  entry->key = key;
-  entry->value = value;
-  entry->isDeleted = false;
-  return isNewKey;
+bool tableSet(Table *table, String *key, Value value) {
+  return tableSetKey(table, stringKey(key), value);
 }
 
-bool tableGet(Table *table, String *key, Value *value) {
+Entry *tableFindKey(Table *table, Value key) {
   if (table->count == 0)
-    return false;
+    return NULL;
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL)
+  int *slot = findSlot(table->slots, table->capacity, table->entries, key,
+                       hashKey(key));
+  if (*slot == 0)
+    return NULL;
+  return &table->entries[*slot - 1];
+}
+
+Entry *tableFindEntry(Table *table, String *key) {
+  return tableFindKey(table, stringKey(key));
+}
+
+bool tableGet(Table *table, String *key, Value *value) {
+  Entry *entry = tableFindEntry(table, key);
+  if (entry == NULL)
     return false;
 
   *value = entry->value;
-  // printValue(*value);
   return true;
 }
 
-bool tableDelete(Table *table, String *key) {
-  if (table->count == 0)
+bool tableDeleteKey(Table *table, Value key) {
+  Entry *entry = tableFindKey(table, key);
+  if (entry == NULL)
     return false;
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL)
+  // The slot stays taken, so probes for keys placed after it go on.
+  entry->key = makeNil();
+  entry->value = makeNil();
+  table->count--;
+  table->version++;
+  return true;
+}
+
+bool tableDelete(Table *table, String *key) {
+  Entry *entry = tableFindEntry(table, key);
+  if (entry == NULL)
     return false;
 
   freeValue(entry->value);
+  return tableDeleteKey(table, entry->key);
+}
 
-  // Place a tombstone
-  entry->key = NULL;
-  entry->isDeleted = true;
-  return true;
+// Removes every entry but keeps the arrays for reuse.
+void tableClear(Table *table) {
+  if (table->capacity > 0) {
+    memset(table->slots, 0, table->capacity * sizeof(int));
+  }
+  table->count = 0;
+  table->entryCount = 0;
+  table->version++;
 }
 
 void freeTable(Table *table) {
-  // Free any string values in the table
-  /* for (int i = 0; i < table->capacity; i++) { */
-  /*   Entry *entry = &table->entries[i]; */
-  /*   if (entry->key != NULL && !entry->isDeleted) { */
-  /*     freeValue(entry->value); */
-  /*     freeString(entry->key); // Free the key string */
-  /*   } */
-  /* } */
-
   free(table->entries);
+  free(table->slots);
   initTable(table);
 }
 
 void debugPrintTable(Table *table) {
   printf("Table contents:\n");
-  for (int i = 0; i < table->capacity; i++) {
+  for (int i = 0; i < table->entryCount; i++) {
     Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->isDeleted) {
-      printf("Key: %s, Value: ", entry->key->chars);
+    if (entry->key.type != VAL_NIL) {
+      printf("Key: ");
+      printValue(entry->key);
+      printf(", Value: ");
       printValue(entry->value);
       printf("\n");
     }
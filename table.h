@@ -1,22 +1,46 @@
 #include "value.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 #pragma once
 
+// Keys are strings, numbers or booleans. A deleted entry keeps its place
+// with a nil key until the table is next resized.
 typedef struct {
-  String *key;
+  Value key;
   Value value;
-  bool isDeleted;
+  uint32_t hash;
 } Entry;
 
-typedef struct {
+// Entries are stored densely in the order they were added, which is the
+// order to iterate them in, and slots indexes them by hash.
+typedef struct Table {
+  // Live entries.
   int count;
-  int capacity;
+  // Entries used so far, deleted ones included, and room for them.
+  int entryCount;
+  int entryCapacity;
   Entry *entries;
+  // A power of two. Each slot holds an entry index plus one, or 0 if empty.
+  int capacity;
+  int *slots;
+  // Bumped whenever entries may move or disappear (resize, delete), which
+  // invalidates every Entry pointer handed out before.
+  uint32_t version;
 } Table;
 
+uint32_t hashString(const char *chars, int length);
 void initTable(Table *table);
 bool tableSet(Table *table, String *key, Value value);
+// Grows the table so count entries fit without another resize.
+void tableReserve(Table *table, int count);
 bool tableGet(Table *table, String *key, Value *value);
+Entry *tableFindEntry(Table *table, String *key);
+bool tableDelete(Table *table, String *key);
+// The same for any key, which must not be a NaN.
+bool tableSetKey(Table *table, Value key, Value value);
+Entry *tableFindKey(Table *table, Value key);
+bool tableDeleteKey(Table *table, Value key);
+void tableClear(Table *table);
 void freeTable(Table *table);
 void debugPrintTable(Table *table);
@@ -0,0 +1,71 @@
+#!/bin/sh
+# usage: run.sh path/to/main
+#
+# Runs every tests/*.lox on each backend and compares what it prints, runtime
+# errors included, with the .expected file beside it. A test with a .prelude
+# file beside it runs on a snapshot of the globals the prelude defines. What
+# saving the snapshot reports comes first, and the test is not run when the
+# snapshot could not be saved. Each tests/*.repl is piped into the REPL
+# instead. Last, the whole directory runs as one batch on several threads,
+# which must print exactly what it prints on one.
+main=$1
+dir=$(dirname "$0")
+snapshot=$(mktemp)
+actual=$(mktemp)
+serial=$(mktemp)
+trap 'rm -f "$snapshot" "$actual" "$serial"' EXIT
+
+failed=0
+count=0
+# Compares $actual with the expected output of test $1 run in mode $2.
+check() {
+  count=$((count + 1))
+  if ! cmp -s "$actual" "${1%.*}.expected"; then
+    echo "FAIL $1 ${2:-(stack)}"
+    diff "${1%.*}.expected" "$actual" | head -20
+    failed=$((failed + 1))
+  fi
+}
+
+for test in "$dir"/*.lox; do
+  [ -f "$test" ] || continue
+  prelude=${test%.lox}.prelude
+  for mode in "" --jit --backend=register; do
+    {
+      options=$mode
+      saved=true
+      if [ -f "$prelude" ]; then
+        rm -f "$snapshot"
+        "$main" --save-snapshot="$snapshot" "$prelude" 2>&1 >/dev/null ||
+          saved=false
+        options="$options --snapshot=$snapshot"
+      fi
+      # -j1 runs the script without dumping its chunks. The batch summary is
+      # the only line that varies between runs.
+      if $saved; then
+        "$main" $options -j1 "$test" 2>&1 | grep -v '^batch: '
+      fi
+    } >"$actual"
+    check "$test" "$mode"
+  done
+done
+
+for test in "$dir"/*.repl; do
+  [ -f "$test" ] || continue
+  for mode in "" --jit --backend=register; do
+    "$main" $mode <"$test" >"$actual" 2>&1
+    check "$test" "$mode"
+  done
+done
+for mode in "" --jit --backend=register; do
+  count=$((count + 1))
+  "$main" $mode -j1 "$dir" >"$serial" 2>/dev/null
+  "$main" $mode -j4 "$dir" >"$actual" 2>/dev/null
+  if ! cmp -s "$serial" "$actual"; then
+    echo "FAIL -j4 $dir ${mode:-(stack)}"
+    diff "$serial" "$actual" | head -20
+    failed=$((failed + 1))
+  fi
+done
+echo "scripts: $count runs, $failed failed"
+[ "$failed" -eq 0 ]
@@ -0,0 +1,60 @@
+#!/bin/sh
+# usage: serve.sh path/to/main path/to/loxc
+#
+# Starts main --serve on a private socket and sends it every tests/*.lox that
+# needs no prelude through loxc, twice by path so the second run hits the
+# chunk cache and once as source on stdin, comparing each with the .expected
+# file. The server must remove its socket when it is stopped.
+main=$1
+client=$2
+dir=$(cd "$(dirname "$0")" && pwd)
+socket=$(mktemp -u)
+actual=$(mktemp)
+"$main" --serve="$socket" 2>/dev/null &
+server=$!
+trap 'kill $server 2>/dev/null; rm -f "$actual"' EXIT
+
+tries=0
+while [ ! -S "$socket" ]; do
+  tries=$((tries + 1))
+  if [ "$tries" -gt 50 ]; then
+    echo "serve: no socket at $socket"
+    exit 1
+  fi
+  sleep 0.1
+done
+
+failed=0
+count=0
+# Compares $actual with the expected output of test $1 sent as $2.
+check() {
+  count=$((count + 1))
+  if ! cmp -s "$actual" "${1%.*}.expected"; then
+    echo "FAIL $1 $2"
+    diff "${1%.*}.expected" "$actual" | head -20
+    failed=$((failed + 1))
+  fi
+}
+
+for test in "$dir"/*.lox; do
+  [ -f "$test" ] || continue
+  [ -f "${test%.lox}.prelude" ] && continue
+  for send in path cached stdin; do
+    if [ "$send" = stdin ]; then
+      "$client" --socket="$socket" <"$test" >"$actual" 2>&1
+    else
+      "$client" --socket="$socket" "$test" >"$actual" 2>&1
+    fi
+    check "$test" "$send"
+  done
+done
+
+kill $server
+wait $server
+count=$((count + 1))
+if [ -e "$socket" ]; then
+  echo "FAIL serve left $socket behind"
+  failed=$((failed + 1))
+fi
+echo "serve: $count runs, $failed failed"
+[ "$failed" -eq 0 ]
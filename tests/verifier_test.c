@@ -0,0 +1,92 @@
+#include "chunk.h"
+#include "value.h"
+#include "verifier.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Hand-assembled chunks the compiler never produces, each checked against
+// whether verifyChunk() should accept it. Script code starts at depth 0 and
+// function code with the function and its arguments on the stack.
+typedef struct {
+  const char *name;
+  uint8_t code[16];
+  int length;
+  // -1 verifies the code as the script, otherwise as a function of this
+  // arity declared in an otherwise empty script.
+  int arity;
+  bool valid;
+} Case;
+
+#define CODE(...) {__VA_ARGS__}, sizeof((uint8_t[]){__VA_ARGS__})
+
+static const Case cases[] = {
+    {"constant and return", CODE(OP_CONSTANT, 0, OP_PRINT, OP_RETURN), -1,
+     true},
+    {"long constant", CODE(OP_CONSTANT_LONG, 0, 0, 0, OP_POP, OP_RETURN), -1,
+     true},
+    {"function returning its argument",
+     CODE(OP_GET_LOCAL, 1, OP_RETURN_VALUE), 1, true},
+    {"unknown opcode", CODE(0xFF, OP_RETURN), -1, false},
+    {"truncated operand", CODE(OP_CONSTANT), -1, false},
+    {"truncated long operand", CODE(OP_CONSTANT_LONG, 0, 0), -1, false},
+    {"constant out of bounds", CODE(OP_CONSTANT, 7, OP_POP, OP_RETURN), -1,
+     false},
+    {"long constant out of bounds",
+     CODE(OP_CONSTANT_LONG, 1, 0, 0, OP_POP, OP_RETURN), -1, false},
+    {"global name not a string", CODE(OP_GET_GLOBAL, 0, OP_POP, OP_RETURN),
+     -1, false},
+    {"stack underflow", CODE(OP_POP, OP_RETURN), -1, false},
+    {"call underflow", CODE(OP_NIL, OP_CALL, 2, OP_POP, OP_RETURN), -1,
+     false},
+    {"local out of bounds", CODE(OP_NIL, OP_GET_LOCAL, 1, OP_POP, OP_RETURN),
+     -1, false},
+    {"jump past the end", CODE(OP_JUMP, 0, 9, OP_RETURN), -1, false},
+    {"jump into an operand", CODE(OP_JUMP, 0, 1, OP_CONSTANT, 0, OP_RETURN),
+     -1, false},
+    {"inconsistent depth at join",
+     CODE(OP_TRUE, OP_JUMP_IF_FALSE, 0, 1, OP_NIL, OP_POP, OP_RETURN), -1,
+     false},
+    {"falls off the end", CODE(OP_NIL, OP_POP), -1, false},
+    {"script returns a value", CODE(OP_NIL, OP_RETURN_VALUE), -1, false},
+    {"function ends the script", CODE(OP_RETURN), 0, false},
+    {"for loop slot out of bounds",
+     CODE(OP_FOR_LOOP, 3, 0, 0, 1, FOR_LESS, 0, 8, OP_RETURN_VALUE), 0,
+     false},
+    {"for loop comparison unknown",
+     CODE(OP_NIL, OP_FOR_LOOP, 0, 1, 0, 1, 9, 0, 8, OP_RETURN_VALUE), 0,
+     false},
+};
+
+static bool runCase(const Case *test) {
+  Chunk script;
+  initChunk(&script);
+  Chunk *chunk = &script;
+  if (test->arity >= 0) {
+    Function *function = newFunction("f", 1);
+    function->arity = test->arity;
+    writeValueArray(&script.constants, makeFunction(function));
+    writeChunk(&script, OP_RETURN, 1);
+    chunk = &function->chunk;
+  } else {
+    writeValueArray(&script.constants, makeNumber(1));
+  }
+  writeChunkBytes(chunk, test->code, test->length, 1);
+  bool valid = verifyChunk(&script);
+  freeChunk(&script);
+  return valid;
+}
+
+int main(void) {
+  int failed = 0;
+  int count = sizeof(cases) / sizeof(cases[0]);
+  for (int i = 0; i < count; i++) {
+    if (runCase(&cases[i]) != cases[i].valid) {
+      printf("FAIL %s: expected the chunk to be %s\n", cases[i].name,
+             cases[i].valid ? "accepted" : "rejected");
+      failed++;
+    }
+  }
+  printf("verifier: %d cases, %d failed\n", count, failed);
+  return failed == 0 ? 0 : 1;
+}
@@ -1,5 +1,10 @@
 #include "value.h"
-#include "vm.h"
+#include "array.h"
+#include "chunk.h"
+#include "class.h"
+#include "fiber.h"
+#include "number.h"
+#include "table.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,7 +39,7 @@ void freeValueArray(ValueArray *constants) {
   initValueArray(constants);
 }
 
-Value addValues(Value a, Value b) {
+Value addValues(ValueArray *strings, Value a, Value b) {
   Value result;
 
   // Number operations
@@ -46,22 +51,27 @@ Value addValues(Value a, Value b) {
 
   // String concatenation
   if (a.type == VAL_STRING && b.type == VAL_STRING) {
-    String *aString = a.as.string;
-    String *bString = b.as.string;
-    int length = aString->length + bString->length;
-    char *chars = malloc(length + 1);
-    memcpy(chars, aString->chars, aString->length);
-    memcpy(chars + aString->length, bString->chars, bString->length);
-    chars[length] = '\0'; // Null terminate
-    result = makeString(chars, length);
-    free(chars);
-    writeValueArray(&vm.tempValues, result);
+    result = concatenateStrings(strings, a.as.string, b.as.string);
   }
 
   // Handle error case - incompatible types
   return result;
 }
 
+// The new string is recorded in strings, which owns it from then on.
+Value concatenateStrings(ValueArray *strings, String *aString,
+                         String *bString) {
+  int length = aString->length + bString->length;
+  char *chars = malloc(length + 1);
+  memcpy(chars, aString->chars, aString->length);
+  memcpy(chars + aString->length, bString->chars, bString->length);
+  chars[length] = '\0'; // Null terminate
+  Value result = makeString(chars, length);
+  free(chars);
+  writeValueArray(strings, result);
+  return result;
+}
+
 Value makeNumber(double num) {
   Value value;
   value.type = VAL_NUMBER;
@@ -69,24 +79,48 @@ Value makeNumber(double num) {
   return value;
 }
 
-void printValue(Value value) {
+void printValue(Value value) { fprintValue(stdout, value); }
+
+void fprintValue(FILE *out, Value value) {
   switch (value.type) {
   case VAL_NUMBER: {
-    double number = value.as.number;
-    printf("%f\n", number);
+    char buffer[NUMBER_BUFFER_SIZE];
+    fwrite(buffer, 1, formatNumber(value.as.number, buffer), out);
+    fputc('\n', out);
     break;
   }
   case VAL_STRING: {
     String *string = value.as.string;
-    printf("%s\n", string->chars);
+    fprintf(out, "%s\n", string->chars);
     break;
   }
   case VAL_BOOL: {
-    printf(value.as.boolean ? "true" : "false");
+    fputs(value.as.boolean ? "true" : "false", out);
     break;
   }
   case VAL_NIL:
-    printf("nil");
+    fputs("nil", out);
+    break;
+  case VAL_FUNCTION:
+    fprintf(out, "<fn %s>\n", value.as.function->name->chars);
+    break;
+  case VAL_NATIVE:
+    fprintf(out, "<native fn %s>\n", value.as.native->name->chars);
+    break;
+  case VAL_ARRAY:
+    fprintf(out, "<array of %d>\n", value.as.array->count);
+    break;
+  case VAL_MAP:
+    fprintf(out, "<map of %d>\n", value.as.map->count);
+    break;
+  case VAL_CLASS:
+    fprintf(out, "<class %s>\n", value.as.klass->name->chars);
+    break;
+  case VAL_INSTANCE:
+    fprintf(out, "<%s instance>\n", value.as.instance->klass->name->chars);
+    break;
+  case VAL_FIBER:
+    fprintf(out, "<fiber>\n");
     break;
   }
 }
@@ -97,6 +131,46 @@ Value makeNil() {
   return value;
 }
 
+Value makeBool(bool boolean) {
+  Value value;
+  value.type = VAL_BOOL;
+  value.as.boolean = boolean;
+  return value;
+}
+
+bool valuesEqual(Value a, Value b) {
+  if (a.type != b.type) {
+    return false;
+  }
+  switch (a.type) {
+  case VAL_NUMBER:
+    return a.as.number == b.as.number;
+  case VAL_STRING:
+    return a.as.string->length == b.as.string->length &&
+           memcmp(a.as.string->chars, b.as.string->chars,
+                  a.as.string->length) == 0;
+  case VAL_BOOL:
+    return a.as.boolean == b.as.boolean;
+  case VAL_NIL:
+    return true;
+  case VAL_FUNCTION:
+    return a.as.function == b.as.function;
+  case VAL_NATIVE:
+    return a.as.native == b.as.native;
+  case VAL_ARRAY:
+    return a.as.array == b.as.array;
+  case VAL_MAP:
+    return a.as.map == b.as.map;
+  case VAL_CLASS:
+    return a.as.klass == b.as.klass;
+  case VAL_INSTANCE:
+    return a.as.instance == b.as.instance;
+  case VAL_FIBER:
+    return a.as.fiber == b.as.fiber;
+  }
+  return false;
+}
+
 String *createString(const char *chars, int length) {
   String *string = (String *)malloc(sizeof(String));
   string->chars = (char *)malloc(length + 1);
@@ -113,6 +187,69 @@ Value makeString(const char *chars, int length) {
   return value;
 }
 
+Value makeFunction(Function *function) {
+  Value value;
+  value.type = VAL_FUNCTION;
+  value.as.function = function;
+  return value;
+}
+
+Value makeNative(Native *native) {
+  Value value;
+  value.type = VAL_NATIVE;
+  value.as.native = native;
+  return value;
+}
+
+Value makeArray(Array *array) {
+  Value value;
+  value.type = VAL_ARRAY;
+  value.as.array = array;
+  return value;
+}
+
+Value makeMap(Table *map) {
+  Value value;
+  value.type = VAL_MAP;
+  value.as.map = map;
+  return value;
+}
+
+Value makeClass(Class *klass) {
+  Value value;
+  value.type = VAL_CLASS;
+  value.as.klass = klass;
+  return value;
+}
+
+Value makeInstance(Instance *instance) {
+  Value value;
+  value.type = VAL_INSTANCE;
+  value.as.instance = instance;
+  return value;
+}
+
+Value makeFiber(Fiber *fiber) {
+  Value value;
+  value.type = VAL_FIBER;
+  value.as.fiber = fiber;
+  return value;
+}
+
+// Natives belong to the VM that registered them, and arrays, maps, classes,
+// instances and fibers to the one that created them, so they are shared.
+Value copyValue(Value value) {
+  switch (value.type) {
+  case VAL_STRING:
+    return makeString(value.as.string->chars, value.as.string->length);
+  case VAL_FUNCTION:
+    return makeFunction(copyFunction(value.as.function));
+  default: {
+    return value;
+  }
+  }
+}
+
 void freeString(String *string) {
   free(string->chars);
   free(string);
@@ -124,6 +261,25 @@ void freeValue(Value value) {
   case VAL_STRING:
     freeString(value.as.string);
     break;
+  case VAL_FUNCTION:
+    freeFunction(value.as.function);
+    break;
+  case VAL_ARRAY:
+    freeArray(value.as.array);
+    break;
+  case VAL_MAP:
+    freeTable(value.as.map);
+    free(value.as.map);
+    break;
+  case VAL_CLASS:
+    freeClass(value.as.klass);
+    break;
+  case VAL_INSTANCE:
+    freeInstance(value.as.instance);
+    break;
+  case VAL_FIBER:
+    freeFiber(value.as.fiber);
+    break;
   default: {
     return;
   }
@@ -157,3 +313,13 @@ Value compareValues(Value a, Value b, char operator_) {
 
   return result;
 }
+
+bool isFalsey(Value value) {
+  if (value.type == VAL_NIL) {
+    return true;
+  }
+  if (value.type == VAL_BOOL) {
+    return !value.as.boolean;
+  }
+  return false;
+}
@@ -1,23 +1,69 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdio.h>
 
-typedef enum { VAL_NUMBER, VAL_STRING, VAL_BOOL, VAL_NIL } ValueType;
+typedef enum {
+  VAL_NUMBER,
+  VAL_STRING,
+  VAL_BOOL,
+  VAL_NIL,
+  VAL_FUNCTION,
+  VAL_NATIVE,
+  VAL_ARRAY,
+  VAL_MAP,
+  VAL_CLASS,
+  VAL_INSTANCE,
+  VAL_FIBER,
+} ValueType;
 
 typedef struct {
   char *chars;
   int length;
 } String;
 
+// Defined in chunk.h, since a function owns its chunk.
+typedef struct Function Function;
+typedef struct Native Native;
+// Defined in array.h, table.h, class.h and fiber.h.
+typedef struct Array Array;
+typedef struct Table Table;
+typedef struct Class Class;
+typedef struct Instance Instance;
+typedef struct Fiber Fiber;
+
 typedef struct {
   ValueType type;
   union {
     double number;
     String *string;
     bool boolean;
+    Function *function;
+    Native *native;
+    Array *array;
+    Table *map;
+    Class *klass;
+    Instance *instance;
+    Fiber *fiber;
   } as;
 } Value;
 
+struct VM;
+
+// A C function callable from Lox. args points at the argCount arguments on
+// the value stack and result at the slot the call's value goes in, which
+// may be read before it is written. Returns false once it has reported a
+// runtime error with nativeError().
+typedef bool (*NativeFn)(struct VM *vm, int argCount, Value *args,
+                         Value *result);
+
+struct Native {
+  NativeFn function;
+  // The argument count it must be called with, -1 for any.
+  int arity;
+  String *name;
+};
+
 typedef struct {
   int count;
   int capacity;
@@ -30,9 +76,23 @@ void freeValueArray(ValueArray *constants);
 void freeValue(Value value);
 void freeString(String *string);
 Value makeNumber(double num);
-Value addValues(Value a, Value b);
+Value addValues(ValueArray *strings, Value a, Value b);
+Value concatenateStrings(ValueArray *strings, String *a, String *b);
 Value makeString(const char *string, int length);
+Value makeFunction(Function *function);
+Value makeNative(Native *native);
+Value makeArray(Array *array);
+Value makeMap(Table *map);
+Value makeClass(Class *klass);
+Value makeInstance(Instance *instance);
+Value makeFiber(Fiber *fiber);
+// Returns a value owning its own copy of whatever value refers to.
+Value copyValue(Value value);
 void printValue(Value value);
+void fprintValue(FILE *out, Value value);
 void negateValue(Value *value);
 Value makeNil();
+Value makeBool(bool boolean);
+bool valuesEqual(Value a, Value b);
+bool isFalsey(Value value);
 Value compareValues(Value a, Value b, char operator_);
@@ -0,0 +1,475 @@
+#include "verifier.h"
+#include "chunk.h"
+#include "value.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+  Chunk *chunk;
+  // The function whose code chunk is, NULL for a script.
+  Function *function;
+  // Stack depth on entry to the instruction at each offset, -1 if unreached.
+  int *depth;
+  // True where an instruction starts, false inside operands.
+  bool *isStart;
+  int *worklist;
+  int worklistCount;
+} Verifier;
+
+// Only opcodes with a handler in run() are listed, so anything else is
+// rejected here instead of falling through the dispatch switch.
+bool opInfo(uint8_t instruction, OpInfo *info) {
+  switch (instruction) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_GET_GLOBAL: {
+    *info = (OpInfo){1, 0, 1};
+    return true;
+  }
+  case OP_CONSTANT_LONG:
+  case OP_GET_LOCAL_LONG:
+  case OP_GET_GLOBAL_LONG: {
+    *info = (OpInfo){3, 0, 1};
+    return true;
+  }
+  case OP_SET_LOCAL:
+  case OP_SET_GLOBAL: {
+    *info = (OpInfo){1, 1, 1};
+    return true;
+  }
+  case OP_SET_LOCAL_LONG:
+  case OP_SET_GLOBAL_LONG: {
+    *info = (OpInfo){3, 1, 1};
+    return true;
+  }
+  case OP_DEFINE_GLOBAL: {
+    *info = (OpInfo){1, 1, 0};
+    return true;
+  }
+  case OP_DEFINE_GLOBAL_LONG: {
+    *info = (OpInfo){3, 1, 0};
+    return true;
+  }
+  case OP_INT8: {
+    *info = (OpInfo){1, 0, 1};
+    return true;
+  }
+  case OP_INT16: {
+    *info = (OpInfo){2, 0, 1};
+    return true;
+  }
+  case OP_ADD_IMM:
+  case OP_LESS_IMM:
+  case OP_GREATER_IMM:
+  case OP_ADD_IMM_UNCHECKED:
+  case OP_LESS_IMM_UNCHECKED:
+  case OP_GREATER_IMM_UNCHECKED: {
+    *info = (OpInfo){2, 1, 1};
+    return true;
+  }
+  case OP_ZERO:
+  case OP_ONE:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE: {
+    *info = (OpInfo){0, 0, 1};
+    return true;
+  }
+  case OP_POP:
+  case OP_PRINT: {
+    *info = (OpInfo){0, 1, 0};
+    return true;
+  }
+  case OP_NOT:
+  case OP_NEGATE:
+  case OP_NEGATE_UNCHECKED: {
+    *info = (OpInfo){0, 1, 1};
+    return true;
+  }
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_EQUAL:
+  case OP_LESS:
+  case OP_GREATER:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+  case OP_LESS_NUM:
+  case OP_GREATER_NUM:
+  case OP_ADD_UNCHECKED:
+  case OP_SUBTRACT_UNCHECKED:
+  case OP_MULTIPLY_UNCHECKED:
+  case OP_DIVIDE_UNCHECKED:
+  case OP_LESS_UNCHECKED:
+  case OP_GREATER_UNCHECKED: {
+    *info = (OpInfo){0, 2, 1};
+    return true;
+  }
+  case OP_JUMP:
+  case OP_LOOP: {
+    *info = (OpInfo){2, 0, 0};
+    return true;
+  }
+  case OP_JUMP_IF_FALSE: {
+    *info = (OpInfo){2, 1, 1};
+    return true;
+  }
+  case OP_RETURN: {
+    *info = (OpInfo){0, 0, 0};
+    return true;
+  }
+  // Only the callee is counted; the arguments come from the operand.
+  case OP_CALL: {
+    *info = (OpInfo){1, 1, 1};
+    return true;
+  }
+  case OP_TAIL_CALL: {
+    *info = (OpInfo){1, 1, 0};
+    return true;
+  }
+  case OP_RETURN_VALUE: {
+    *info = (OpInfo){0, 1, 0};
+    return true;
+  }
+  // The elements are counted from the operand.
+  case OP_ARRAY: {
+    *info = (OpInfo){1, 0, 1};
+    return true;
+  }
+  // Each pair is counted from the operand.
+  case OP_MAP: {
+    *info = (OpInfo){1, 0, 1};
+    return true;
+  }
+  case OP_GET_INDEX: {
+    *info = (OpInfo){0, 2, 1};
+    return true;
+  }
+  case OP_CLASS: {
+    *info = (OpInfo){1, 0, 1};
+    return true;
+  }
+  case OP_CLASS_LONG: {
+    *info = (OpInfo){3, 0, 1};
+    return true;
+  }
+  case OP_METHOD: {
+    *info = (OpInfo){0, 2, 1};
+    return true;
+  }
+  case OP_GET_PROPERTY: {
+    *info = (OpInfo){1, 1, 1};
+    return true;
+  }
+  case OP_GET_PROPERTY_LONG: {
+    *info = (OpInfo){3, 1, 1};
+    return true;
+  }
+  case OP_SET_PROPERTY: {
+    *info = (OpInfo){1, 2, 1};
+    return true;
+  }
+  case OP_SET_PROPERTY_LONG: {
+    *info = (OpInfo){3, 2, 1};
+    return true;
+  }
+  // The name is followed by the argument count, which adds to the pops.
+  case OP_INVOKE: {
+    *info = (OpInfo){2, 1, 1};
+    return true;
+  }
+  case OP_INVOKE_LONG: {
+    *info = (OpInfo){4, 1, 1};
+    return true;
+  }
+  case OP_SET_INDEX: {
+    *info = (OpInfo){0, 3, 1};
+    return true;
+  }
+  case OP_FOR_LOOP: {
+    *info = (OpInfo){7, 0, 0};
+    return true;
+  }
+  default: {
+    return false;
+  }
+  }
+}
+
+static bool verifyError(int offset, const char *message) {
+  fprintf(stderr, "Bytecode verification failed at %04d: %s\n", offset,
+          message);
+  return false;
+}
+
+static bool flowTo(Verifier *verifier, int from, int target, int depth) {
+  if (target < 0 || target >= verifier->chunk->count ||
+      !verifier->isStart[target]) {
+    return verifyError(from, "Jump target out of bounds.");
+  }
+  if (verifier->depth[target] == -1) {
+    verifier->depth[target] = depth;
+    verifier->worklist[verifier->worklistCount++] = target;
+    return true;
+  }
+  if (verifier->depth[target] != depth) {
+    return verifyError(from, "Inconsistent stack depth at jump target.");
+  }
+  return true;
+}
+
+// Reads the one-byte or 24-bit operand following the opcode at offset.
+static int readOperand(Chunk *chunk, int offset, int operandBytes) {
+  if (operandBytes == 1) {
+    return chunk->code[offset + 1];
+  }
+  return (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) |
+         chunk->code[offset + 3];
+}
+
+static bool checkConstant(Chunk *chunk, int offset, int operandBytes,
+                          bool mustBeString) {
+  int index = readOperand(chunk, offset, operandBytes);
+  if (index >= chunk->constants.count) {
+    return verifyError(offset, "Constant index out of bounds.");
+  }
+  if (mustBeString && chunk->constants.values[index].type != VAL_STRING) {
+    return verifyError(offset, "Name is not a string.");
+  }
+  return true;
+}
+
+static bool decode(Verifier *verifier) {
+  Chunk *chunk = verifier->chunk;
+  for (int offset = 0; offset < chunk->count;) {
+    OpInfo info;
+    if (!opInfo(chunk->code[offset], &info)) {
+      return verifyError(offset, "Unknown opcode.");
+    }
+    if (offset + 1 + info.operandBytes > chunk->count) {
+      return verifyError(offset, "Truncated operand.");
+    }
+    verifier->isStart[offset] = true;
+    offset += 1 + info.operandBytes;
+  }
+  return true;
+}
+
+static bool verifyInstruction(Verifier *verifier, int offset) {
+  Chunk *chunk = verifier->chunk;
+  uint8_t instruction = chunk->code[offset];
+  int depth = verifier->depth[offset];
+  OpInfo info;
+  opInfo(instruction, &info);
+  if (instruction == OP_CALL || instruction == OP_TAIL_CALL ||
+      instruction == OP_ARRAY) {
+    info.pops += chunk->code[offset + 1];
+  } else if (instruction == OP_MAP) {
+    info.pops += 2 * chunk->code[offset + 1];
+  } else if (instruction == OP_INVOKE || instruction == OP_INVOKE_LONG) {
+    info.pops += chunk->code[offset + info.operandBytes];
+  }
+
+  if (depth < info.pops) {
+    return verifyError(offset, "Stack underflow.");
+  }
+
+  switch (instruction) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG: {
+    if (!checkConstant(chunk, offset, info.operandBytes, false)) {
+      return false;
+    }
+    break;
+  }
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG:
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG:
+  case OP_DEFINE_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_CLASS:
+  case OP_CLASS_LONG:
+  case OP_GET_PROPERTY:
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY:
+  case OP_SET_PROPERTY_LONG: {
+    if (!checkConstant(chunk, offset, info.operandBytes, true)) {
+      return false;
+    }
+    break;
+  }
+  case OP_INVOKE:
+  case OP_INVOKE_LONG: {
+    if (!checkConstant(chunk, offset, info.operandBytes - 1, true)) {
+      return false;
+    }
+    break;
+  }
+  case OP_GET_LOCAL:
+  case OP_GET_LOCAL_LONG:
+  case OP_SET_LOCAL:
+  case OP_SET_LOCAL_LONG: {
+    if (readOperand(chunk, offset, info.operandBytes) >= depth) {
+      return verifyError(offset, "Local slot out of bounds.");
+    }
+    break;
+  }
+  case OP_FOR_LOOP: {
+    uint8_t *code = chunk->code + offset;
+    if (code[1] >= depth || code[2] >= depth) {
+      return verifyError(offset, "Local slot out of bounds.");
+    }
+    if (code[5] > FOR_GREATER_EQUAL) {
+      return verifyError(offset, "Unknown loop comparison.");
+    }
+    break;
+  }
+  case OP_RETURN: {
+    if (verifier->function != NULL) {
+      return verifyError(offset, "Function ends the script.");
+    }
+    break;
+  }
+  case OP_TAIL_CALL:
+  case OP_RETURN_VALUE: {
+    if (verifier->function == NULL) {
+      return verifyError(offset, "Script returns from a function.");
+    }
+    break;
+  }
+  default: {
+    break;
+  }
+  }
+
+  int newDepth = depth - info.pops + info.pushes;
+  if (newDepth > chunk->maxStack) {
+    chunk->maxStack = newDepth;
+  }
+
+  int next = offset + 1 + info.operandBytes;
+  switch (instruction) {
+  case OP_RETURN:
+  case OP_TAIL_CALL:
+  case OP_RETURN_VALUE: {
+    return true;
+  }
+  case OP_JUMP: {
+    uint16_t jump =
+        (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    return flowTo(verifier, offset, next + jump, newDepth);
+  }
+  case OP_LOOP: {
+    uint16_t jump =
+        (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    return flowTo(verifier, offset, next - jump, newDepth);
+  }
+  case OP_FOR_LOOP: {
+    uint16_t jump =
+        (uint16_t)((chunk->code[offset + 6] << 8) | chunk->code[offset + 7]);
+    if (!flowTo(verifier, offset, next - jump, newDepth)) {
+      return false;
+    }
+    break;
+  }
+  case OP_JUMP_IF_FALSE: {
+    uint16_t jump =
+        (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    if (!flowTo(verifier, offset, next + jump, newDepth)) {
+      return false;
+    }
+    break;
+  }
+  default: {
+    break;
+  }
+  }
+
+  if (next >= chunk->count) {
+    return verifyError(offset, "Execution falls off the end of the chunk.");
+  }
+  return flowTo(verifier, offset, next, newDepth);
+}
+
+// A function's code starts with the function and its arguments on the
+// stack.
+static int *verifyCode(Chunk *chunk, Function *function) {
+  chunk->verified = false;
+  chunk->maxStack = 0;
+  if (chunk->count == 0) {
+    verifyError(0, "Empty chunk.");
+    return NULL;
+  }
+
+  Verifier verifier;
+  verifier.chunk = chunk;
+  verifier.function = function;
+  verifier.depth = malloc(chunk->count * sizeof(int));
+  verifier.isStart = calloc(chunk->count, sizeof(bool));
+  verifier.worklist = malloc(chunk->count * sizeof(int));
+  verifier.worklistCount = 0;
+  if (verifier.depth == NULL || verifier.isStart == NULL ||
+      verifier.worklist == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < chunk->count; i++) {
+    verifier.depth[i] = -1;
+  }
+
+  // Each offset enters the worklist at most once, the first time it is
+  // reached; later arrivals only have to agree on the depth.
+  bool ok = decode(&verifier);
+  if (ok) {
+    verifier.depth[0] = function != NULL ? function->arity + 1 : 0;
+    verifier.worklist[verifier.worklistCount++] = 0;
+  }
+  while (ok && verifier.worklistCount > 0) {
+    int offset = verifier.worklist[--verifier.worklistCount];
+    ok = verifyInstruction(&verifier, offset);
+  }
+
+  free(verifier.isStart);
+  free(verifier.worklist);
+
+  chunk->verified = ok;
+  if (!ok) {
+    free(verifier.depth);
+    return NULL;
+  }
+  return verifier.depth;
+}
+
+int *verifyChunkDepths(Chunk *chunk) { return verifyCode(chunk, NULL); }
+
+static bool verifyFunctions(Chunk *chunk) {
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (constant.type != VAL_FUNCTION) {
+      continue;
+    }
+    Function *function = constant.as.function;
+    int *depths = verifyCode(&function->chunk, function);
+    free(depths);
+    if (depths == NULL || !verifyFunctions(&function->chunk)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool verifyChunk(Chunk *chunk) {
+  int *depths = verifyChunkDepths(chunk);
+  free(depths);
+  if (depths == NULL) {
+    return false;
+  }
+  if (!verifyFunctions(chunk)) {
+    chunk->verified = false;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,27 @@
+#include "chunk.h"
+#include <stdbool.h>
+
+#pragma once
+
+// Operand width and stack effect of an opcode.
+typedef struct {
+  int operandBytes;
+  int pops;
+  int pushes;
+} OpInfo;
+
+// Returns false for opcodes run() has no handler for.
+bool opInfo(uint8_t instruction, OpInfo *info);
+
+// Proves that every constant index, local slot and jump target in the chunk
+// is in bounds and that the stack depth agrees on every path. On success the
+// chunk is marked verified and chunk->maxStack holds the deepest stack the
+// code can reach, so the VM can run it without any runtime checks. The
+// functions declared in the chunk are verified too, each against its own
+// frame.
+bool verifyChunk(Chunk *chunk);
+
+// Like verifyChunk() for the chunk's own code, but also hands back the stack
+// depth on entry to every instruction (-1 inside operands and unreachable
+// code). Returns NULL when verification fails; the caller frees the array.
+int *verifyChunkDepths(Chunk *chunk);
@@ -1,185 +1,1473 @@
 #include "vm.h"
+#include "array.h"
 #include "chunk.h"
+#include "class.h"
 #include "compiler.h"
+#include "fiber.h"
+#include "jit.h"
+#include "natives.h"
+#include "output.h"
+#include "regcompiler.h"
+#include "regvm.h"
+#include "snapshot.h"
 #include "table.h"
 #include "value.h"
+#include "verifier.h"
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-VM vm;
+void initVM(VM *vm) {
+  vm->function = NULL;
+  vm->chunk = NULL;
+  vm->ip = NULL;
+  vm->stackCapacity = STACK_INIT;
+  vm->stack = malloc(vm->stackCapacity * sizeof(Value));
+  vm->frameCapacity = FRAMES_INIT;
+  vm->frames = malloc(vm->frameCapacity * sizeof(CallFrame));
+  if (vm->stack == NULL || vm->frames == NULL) {
+    exit(1);
+  }
+  vm->stackTop = vm->stack;
+  vm->slots = vm->stack;
+  vm->frameCount = 0;
+  vm->mainFiber = newMainFiber();
+  vm->fiber = vm->mainFiber;
+  vm->readyFibers = NULL;
+  vm->readyStart = 0;
+  vm->readyCount = 0;
+  vm->readyCapacity = 0;
+  vm->schedulerCaller = NULL;
+  initTable(&vm->globals);
+  initValueArray(&vm->tempValues);
+  vm->snapshots = NULL;
+  vm->chunks = NULL;
+  vm->chunkCount = 0;
+  vm->chunkCapacity = 0;
+  vm->backend = BACKEND_STACK;
+  vm->jit = false;
+  initOutput(&vm->output);
+  vm->err = stderr;
+  vm->dumpChunks = true;
+  vm->cacheChunks = false;
+  vm->chunkCache = NULL;
+  vm->chunkCacheCount = 0;
+  vm->chunkCacheCapacity = 0;
+  vm->chunkCacheClock = 0;
+  vm->incremental = false;
+  initFragmentCache(&vm->fragments);
+  memset(&vm->jitStats, 0, sizeof(vm->jitStats));
+  vm->natives = NULL;
+  vm->nativeCount = 0;
+  vm->nativeCapacity = 0;
+  defineBuiltinNatives(vm);
+}
+
+static void freeCachedChunk(CachedChunk *cached) {
+  freeChunk(cached->chunk);
+  free(cached->chunk);
+  free(cached->source);
+}
+
+static void leaveFibers(VM *vm);
+
+void freeVM(VM *vm) {
+  leaveFibers(vm);
+  for (int i = 0; i < vm->chunkCount; i++) {
+    freeChunk(vm->chunks[i]);
+    free(vm->chunks[i]);
+  }
+  free(vm->chunks);
+  for (int i = 0; i < vm->chunkCacheCount; i++) {
+    freeCachedChunk(&vm->chunkCache[i]);
+  }
+  free(vm->chunkCache);
+  freeFragmentCache(&vm->fragments);
+  free(vm->stack);
+  free(vm->frames);
+  // Only its registers, since the main fiber's stacks are the VM's.
+  free(vm->mainFiber);
+  free(vm->readyFibers);
+  freeTable(&vm->globals);
+  freeSnapshots(vm->snapshots);
+  freeValueArray(&vm->tempValues);
+  freeOutput(&vm->output);
+  for (int i = 0; i < vm->nativeCount; i++) {
+    freeString(vm->natives[i]->name);
+    free(vm->natives[i]);
+  }
+  free(vm->natives);
+}
+
+// Most recently used first.
+static int compareLastUsed(const void *a, const void *b) {
+  uint64_t x = ((const CachedChunk *)a)->lastUsed;
+  uint64_t y = ((const CachedChunk *)b)->lastUsed;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Only safe once no global can still hold one of the evicted chunks' strings.
+static void trimChunkCache(VM *vm) {
+  if (vm->chunkCacheCount <= CHUNK_CACHE_MAX) {
+    return;
+  }
+  qsort(vm->chunkCache, vm->chunkCacheCount, sizeof(CachedChunk),
+        compareLastUsed);
+  for (int i = CHUNK_CACHE_MAX; i < vm->chunkCacheCount; i++) {
+    freeCachedChunk(&vm->chunkCache[i]);
+  }
+  vm->chunkCacheCount = CHUNK_CACHE_MAX;
+}
+
+void resetVM(VM *vm) {
+  leaveFibers(vm);
+  vm->readyStart = 0;
+  vm->readyCount = 0;
+  for (int i = 0; i < vm->chunkCount; i++) {
+    freeChunk(vm->chunks[i]);
+    free(vm->chunks[i]);
+  }
+  vm->chunkCount = 0;
+  vm->function = NULL;
+  vm->chunk = NULL;
+  vm->ip = NULL;
+  vm->stackTop = vm->stack;
+  vm->slots = vm->stack;
+  vm->frameCount = 0;
+  tableClear(&vm->globals);
+  freeSnapshots(vm->snapshots);
+  vm->snapshots = NULL;
+  for (int i = 0; i < vm->tempValues.count; i++) {
+    freeValue(vm->tempValues.values[i]);
+  }
+  vm->tempValues.count = 0;
+  trimChunkCache(vm);
+  for (int i = 0; i < vm->nativeCount; i++) {
+    Native *native = vm->natives[i];
+    tableSet(&vm->globals, native->name, makeNative(native));
+  }
+}
+
+void defineNative(VM *vm, const char *name, NativeFn function, int arity) {
+  int length = (int)strlen(name);
+  for (int i = 0; i < vm->nativeCount; i++) {
+    Native *native = vm->natives[i];
+    if (native->name->length == length &&
+        memcmp(native->name->chars, name, length) == 0) {
+      native->function = function;
+      native->arity = arity;
+      tableSet(&vm->globals, native->name, makeNative(native));
+      return;
+    }
+  }
+
+  if (vm->nativeCapacity <= vm->nativeCount) {
+    int oldCapacity = vm->nativeCapacity;
+    vm->nativeCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+    vm->natives =
+        realloc(vm->natives, vm->nativeCapacity * sizeof(Native *));
+    if (vm->natives == NULL) {
+      exit(1);
+    }
+  }
+  Native *native = malloc(sizeof(Native));
+  if (native == NULL) {
+    exit(1);
+  }
+  native->function = function;
+  native->arity = arity;
+  native->name = makeString(name, length).as.string;
+  vm->natives[vm->nativeCount++] = native;
+  tableSet(&vm->globals, native->name, makeNative(native));
+}
+
+Value tempString(VM *vm, const char *chars, int length) {
+  Value string = makeString(chars, length);
+  writeValueArray(&vm->tempValues, string);
+  return string;
+}
+
+Value tempArray(VM *vm, int count) {
+  Value array = makeArray(newArray(count));
+  writeValueArray(&vm->tempValues, array);
+  return array;
+}
+
+// Classes live until the VM is reset, as do the shapes of their instances,
+// which is what lets inline caches hold on to a shape.
+static Value tempClass(VM *vm, String *name) {
+  Value klass = makeClass(newClass(name));
+  writeValueArray(&vm->tempValues, klass);
+  return klass;
+}
+
+Value tempMap(VM *vm, int count) {
+  Table *table = malloc(sizeof(Table));
+  if (table == NULL) {
+    exit(1);
+  }
+  initTable(table);
+  tableReserve(table, count);
+  Value map = makeMap(table);
+  writeValueArray(&vm->tempValues, map);
+  return map;
+}
+
+static void push(VM *vm, Value value) {
+  *vm->stackTop = value;
+  vm->stackTop++;
+}
+
+static Value pop(VM *vm) {
+  vm->stackTop--;
+  return *vm->stackTop;
+}
+
+// Grows the value stack so it can hold a verified chunk's deepest stack.
+static void reserveStack(VM *vm, int needed) {
+  if (needed <= vm->stackCapacity) {
+    return;
+  }
+  vm->stackCapacity = needed;
+  vm->stack = realloc(vm->stack, vm->stackCapacity * sizeof(Value));
+  if (vm->stack == NULL) {
+    exit(1);
+  }
+  vm->stackTop = vm->stack;
+}
+
+// Makes room for count values from slots on, moving the stack and every
+// pointer into it when it has to grow. Returns where slots ended up.
+static Value *ensureStack(VM *vm, Value *slots, int count) {
+  ptrdiff_t base = slots - vm->stack;
+  if (base + count <= vm->stackCapacity) {
+    return slots;
+  }
+  int capacity = vm->stackCapacity;
+  while (capacity < base + count) {
+    capacity *= 2;
+  }
+  // A new block rather than realloc(), so the pointers into the old one can
+  // be rebased before it is freed.
+  Value *stack = malloc(capacity * sizeof(Value));
+  if (stack == NULL) {
+    exit(1);
+  }
+  memcpy(stack, vm->stack, vm->stackCapacity * sizeof(Value));
+  vm->stackTop = stack + (vm->stackTop - vm->stack);
+  vm->slots = stack + (vm->slots - vm->stack);
+  for (int i = 0; i < vm->frameCount; i++) {
+    vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+  }
+  free(vm->stack);
+  vm->stack = stack;
+  vm->stackCapacity = capacity;
+  return stack + base;
+}
+
+// Chunks live as long as the VM, since globals may still hold strings from
+// their constant pools after the script that defined them has finished.
+static Chunk *newChunk(VM *vm) {
+  if (vm->chunkCapacity <= vm->chunkCount) {
+    int oldCapacity = vm->chunkCapacity;
+    vm->chunkCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+    vm->chunks = realloc(vm->chunks, vm->chunkCapacity * sizeof(Chunk *));
+    if (vm->chunks == NULL) {
+      exit(1);
+    }
+  }
+  Chunk *chunk = malloc(sizeof(Chunk));
+  if (chunk == NULL) {
+    exit(1);
+  }
+  initChunk(chunk);
+  vm->chunks[vm->chunkCount++] = chunk;
+  return chunk;
+}
+
+static Chunk *findCachedChunk(VM *vm, const char *source, uint32_t hash,
+                              int length) {
+  for (int i = 0; i < vm->chunkCacheCount; i++) {
+    CachedChunk *cached = &vm->chunkCache[i];
+    if (cached->hash == hash && cached->length == length &&
+        memcmp(cached->source, source, length) == 0) {
+      cached->lastUsed = ++vm->chunkCacheClock;
+      return cached->chunk;
+    }
+  }
+  return NULL;
+}
 
-void initVM() {
-  vm.chunk = NULL;
-  vm.ip = NULL;
-  vm.stackCapacity = STACK_INIT;
-  vm.stack = malloc(vm.stackCapacity * sizeof(Value));
-  vm.stackTop = vm.stack;
-  initTable(&vm.globals);
-  initValueArray(&vm.tempValues);
+// Moves the chunk newChunk() just handed out from vm->chunks into the cache.
+static void cacheNewestChunk(VM *vm, const char *source, uint32_t hash,
+                             int length) {
+  if (vm->chunkCacheCapacity <= vm->chunkCacheCount) {
+    int oldCapacity = vm->chunkCacheCapacity;
+    vm->chunkCacheCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+    vm->chunkCache = realloc(vm->chunkCache,
+                             vm->chunkCacheCapacity * sizeof(CachedChunk));
+    if (vm->chunkCache == NULL) {
+      exit(1);
+    }
+  }
+  CachedChunk *cached = &vm->chunkCache[vm->chunkCacheCount++];
+  cached->hash = hash;
+  cached->length = length;
+  cached->source = malloc(length);
+  if (cached->source == NULL) {
+    exit(1);
+  }
+  memcpy(cached->source, source, length);
+  cached->chunk = vm->chunks[--vm->chunkCount];
+  cached->lastUsed = ++vm->chunkCacheClock;
 }
 
-void push(Value value) {
-  *vm.stackTop = value;
-  vm.stackTop++;
+#define TRACE_FRAMES 16
+
+void reportRuntimeError(VM *vm, int line, const char *format,
+                        va_list args) {
+  flushOutput(&vm->output);
+  vfprintf(vm->err, format, args);
+  fputs("\n", vm->err);
+  // Innermost first. Deep recursion would bury the error under thousands of
+  // identical lines, so the middle of a long trace is left out.
+  Function *function = vm->function;
+  for (int i = vm->frameCount;; i--) {
+    if (function == NULL) {
+      fprintf(vm->err, "[line %d] in script\n", line);
+    } else {
+      fprintf(vm->err, "[line %d] in %s()\n", line, function->name->chars);
+    }
+    if (i == 0) {
+      break;
+    }
+    if (i == vm->frameCount - TRACE_FRAMES && i > TRACE_FRAMES) {
+      fprintf(vm->err, "... %d more calls\n", i - TRACE_FRAMES);
+      i = TRACE_FRAMES;
+    }
+    CallFrame *frame = &vm->frames[i - 1];
+    function = frame->function;
+    line = getLine(frame->chunk, (int)(frame->ip - frame->chunk->code - 1));
+  }
 }
 
-Value pop() {
-  vm.stackTop--;
-  return *vm.stackTop;
+static void runtimeError(VM *vm, const char *format, ...) {
+  // ip has already moved past the opcode, so step back into the instruction.
+  int offset = (int)(vm->ip - vm->chunk->code - 1);
+  va_list args;
+  va_start(args, format);
+  reportRuntimeError(vm, getLine(vm->chunk, offset), format, args);
+  va_end(args);
 }
 
-static void freeVM() {
-  free(vm.stack);
-  freeTable(&vm.globals);
-  freeValueArray(&vm.tempValues);
-  initVM();
-};
+void nativeError(VM *vm, const char *format, ...) {
+  int offset = (int)(vm->ip - vm->chunk->code - 1);
+  va_list args;
+  va_start(args, format);
+  reportRuntimeError(vm, getLine(vm->chunk, offset), format, args);
+  va_end(args);
+}
 
-static bool isFalsey(Value value) {
-  if (value.type == VAL_NIL) {
+static bool checkNumberOperands(VM *vm, Value a, Value b) {
+  if (a.type != VAL_NUMBER || b.type != VAL_NUMBER) {
+    runtimeError(vm, "Operands must be numbers.");
+    return false;
+  }
+  return true;
+}
+
+// Rewrites the quickened instruction just read back to its generic form and
+// re-dispatches it, so the generic handler can requicken for the new types.
+static void despecialize(VM *vm, uint8_t generic) {
+  vm->ip--;
+  *vm->ip = generic;
+}
+
+// Reads the 24-bit operand of a _LONG instruction.
+static uint32_t readLong(VM *vm) {
+  uint32_t operand = (vm->ip[0] << 16) | (vm->ip[1] << 8) | vm->ip[2];
+  vm->ip += 3;
+  return operand;
+}
+
+static int16_t readImmediate(VM *vm) {
+  int16_t immediate = (int16_t)((vm->ip[0] << 8) | vm->ip[1]);
+  vm->ip += 2;
+  return immediate;
+}
+
+void bindGlobal(VM *vm, String *name, Value value) {
+  tableSet(&vm->globals, name, value);
+}
+
+static void defineGlobal(VM *vm, uint32_t index) {
+  Value key = vm->chunk->constants.values[index];
+  bindGlobal(vm, key.as.string, pop(vm));
+}
+
+// The inline cache of the instruction whose opcode was just read.
+static GlobalCache *currentGlobalCache(VM *vm) {
+  return &vm->chunk->globalCaches[vm->ip - vm->chunk->code - 1];
+}
+
+static Entry *findGlobal(VM *vm, GlobalCache *cache, uint32_t index) {
+  Value key = vm->chunk->constants.values[index];
+  Entry *entry = tableFindEntry(&vm->globals, key.as.string);
+  if (entry != NULL) {
+    cache->entry = entry;
+    cache->version = vm->globals.version;
+  }
+  return entry;
+}
+
+// Looks the global up in the table and remembers its entry in cache.
+static Entry *lookupGlobal(VM *vm, GlobalCache *cache, uint32_t index) {
+  Entry *entry = findGlobal(vm, cache, index);
+  if (entry == NULL) {
+    Value key = vm->chunk->constants.values[index];
+    runtimeError(vm, "Undefined variable '%s'.", key.as.string->chars);
+  }
+  return entry;
+}
+
+Entry *resolveGlobalAt(VM *vm, int offset) {
+  GlobalCache *cache = &vm->chunk->globalCaches[offset];
+  if (cache->version == vm->globals.version) {
+    return cache->entry;
+  }
+  uint8_t *operand = vm->chunk->code + offset + 1;
+  uint32_t index = operand[0];
+  if (vm->chunk->code[offset] == OP_GET_GLOBAL_LONG ||
+      vm->chunk->code[offset] == OP_SET_GLOBAL_LONG) {
+    index = (operand[0] << 16) | (operand[1] << 8) | operand[2];
+  }
+  return findGlobal(vm, cache, index);
+}
+
+static bool setGlobal(VM *vm, GlobalCache *cache, uint32_t index) {
+  Entry *entry = cache->entry;
+  if (cache->version != vm->globals.version) {
+    entry = lookupGlobal(vm, cache, index);
+    if (entry == NULL) {
+      return false;
+    }
+  }
+  entry->value = vm->stackTop[-1];
+  return true;
+}
+
+static bool getGlobal(VM *vm, GlobalCache *cache, uint32_t index) {
+  Entry *entry = cache->entry;
+  if (cache->version != vm->globals.version) {
+    entry = lookupGlobal(vm, cache, index);
+    if (entry == NULL) {
+      return false;
+    }
+  }
+  push(vm, entry->value);
+  return true;
+}
+
+// Runs the native below the argCount arguments on top of the stack and
+// leaves its result in their place. Natives get no frame of their own, so
+// this is the whole call.
+static bool callNative(VM *vm, Native *native, int argCount) {
+  if (native->arity != -1 && argCount != native->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d.", native->arity,
+                 argCount);
+    return false;
+  }
+  Value *args = vm->stackTop - argCount;
+  // The arguments are popped before the native runs, so one that switches
+  // fibers leaves this fiber waiting with its result on top.
+  vm->stackTop = args;
+  return native->function(vm, argCount, args, args - 1);
+}
+
+static bool checkArity(VM *vm, Function *function, int argCount) {
+  if (argCount != function->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d.", function->arity,
+                 argCount);
+    return false;
+  }
+  return true;
+}
+
+// Checks that the value argCount slots below the top can be called with
+// that many arguments, and sets function to the one to run. A class is
+// replaced by a new instance of it, which its initializer runs on; without
+// one, function is NULL and the instance is the result already.
+static bool resolveCall(VM *vm, int argCount, Function **function) {
+  Value *callee = vm->stackTop - 1 - argCount;
+  if (callee->type == VAL_FUNCTION) {
+    *function = callee->as.function;
+    return checkArity(vm, *function, argCount);
+  }
+  if (callee->type != VAL_CLASS) {
+    runtimeError(vm, "Can only call functions and classes.");
+    return false;
+  }
+  Class *klass = callee->as.klass;
+  *callee = makeInstance(newInstance(klass));
+  writeValueArray(&vm->tempValues, *callee);
+  static String init = {(char *)"init", 4};
+  Value initializer;
+  if (tableGet(&klass->methods, &init, &initializer)) {
+    *function = initializer.as.function;
+    return checkArity(vm, *function, argCount);
+  }
+  *function = NULL;
+  if (argCount != 0) {
+    runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
+    return false;
+  }
+  return true;
+}
+
+// Starts running function in a frame whose slots begin at slots.
+static void enterFunction(VM *vm, Function *function, Value *slots) {
+  vm->slots = ensureStack(vm, slots, function->chunk.maxStack);
+  vm->function = function;
+  vm->chunk = &function->chunk;
+  vm->ip = function->chunk.code;
+}
+
+// Pushes a frame for the caller and runs function on the argCount arguments
+// on top of the stack.
+static bool callFunction(VM *vm, Function *function, int argCount) {
+  if (vm->frameCount == vm->frameCapacity) {
+    if (vm->frameCapacity == FRAMES_MAX) {
+      runtimeError(vm, "Stack overflow.");
+      return false;
+    }
+    vm->frameCapacity *= 2;
+    if (vm->frameCapacity > FRAMES_MAX) {
+      vm->frameCapacity = FRAMES_MAX;
+    }
+    vm->frames = realloc(vm->frames, vm->frameCapacity * sizeof(CallFrame));
+    if (vm->frames == NULL) {
+      exit(1);
+    }
+  }
+  vm->frames[vm->frameCount++] =
+      (CallFrame){vm->function, vm->chunk, vm->ip, vm->slots};
+  enterFunction(vm, function, vm->stackTop - argCount - 1);
+  return true;
+}
+
+static bool callValue(VM *vm, int argCount) {
+  Value callee = vm->stackTop[-1 - argCount];
+  if (callee.type == VAL_NATIVE) {
+    return callNative(vm, callee.as.native, argCount);
+  }
+  Function *function;
+  if (!resolveCall(vm, argCount, &function)) {
+    return false;
+  }
+  return function == NULL || callFunction(vm, function, argCount);
+}
+
+// The inline cache of the instruction whose opcode was just read.
+static PropertyCache *currentPropertyCache(VM *vm) {
+  return &vm->chunk->propertyCaches[vm->ip - vm->chunk->code - 1];
+}
+
+static String *nameConstant(VM *vm, uint32_t index) {
+  return vm->chunk->constants.values[index].as.string;
+}
+
+static bool getProperty(VM *vm, PropertyCache *cache, uint32_t index) {
+  Value *receiver = vm->stackTop - 1;
+  if (receiver->type != VAL_INSTANCE) {
+    runtimeError(vm, "Only instances have properties.");
+    return false;
+  }
+  Instance *instance = receiver->as.instance;
+  if (instance->shape != cache->shape) {
+    String *name = nameConstant(vm, index);
+    int slot = findField(instance->shape, name);
+    if (slot == -1) {
+      if (tableFindEntry(&instance->klass->methods, name) != NULL) {
+        runtimeError(vm, "Method '%s' can only be called.", name->chars);
+      } else {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
+      }
+      return false;
+    }
+    *cache = (PropertyCache){instance->shape, NULL, slot, NULL};
+  }
+  *receiver = instance->fields[cache->slot];
+  return true;
+}
+
+static bool setProperty(VM *vm, PropertyCache *cache, uint32_t index) {
+  Value value = vm->stackTop[-1];
+  Value *receiver = vm->stackTop - 2;
+  if (receiver->type != VAL_INSTANCE) {
+    runtimeError(vm, "Only instances have fields.");
+    return false;
+  }
+  Instance *instance = receiver->as.instance;
+  if (instance->shape != cache->shape) {
+    Shape *shape = instance->shape;
+    String *name = nameConstant(vm, index);
+    int slot = findField(shape, name);
+    if (slot == -1) {
+      *cache = (PropertyCache){shape, addField(shape, name), shape->slotCount,
+                               NULL};
+    } else {
+      *cache = (PropertyCache){shape, NULL, slot, NULL};
+    }
+  }
+  if (cache->next != NULL) {
+    appendField(instance, cache->next, value);
+  } else {
+    instance->fields[cache->slot] = value;
+  }
+  *receiver = value;
+  vm->stackTop--;
+  return true;
+}
+
+// Calls the method, or the value of the field, called name on the receiver
+// below the argCount arguments. A cache hit with no method is a field.
+static bool invoke(VM *vm, PropertyCache *cache, uint32_t index,
+                   int argCount) {
+  Value *receiver = vm->stackTop - 1 - argCount;
+  if (receiver->type != VAL_INSTANCE) {
+    runtimeError(vm, "Only instances have methods.");
+    return false;
+  }
+  Instance *instance = receiver->as.instance;
+  if (instance->shape != cache->shape) {
+    String *name = nameConstant(vm, index);
+    int slot = findField(instance->shape, name);
+    Value method;
+    if (slot != -1) {
+      *cache = (PropertyCache){instance->shape, NULL, slot, NULL};
+    } else if (tableGet(&instance->klass->methods, name, &method)) {
+      *cache = (PropertyCache){instance->shape, NULL, 0, method.as.function};
+    } else {
+      runtimeError(vm, "Undefined property '%s'.", name->chars);
+      return false;
+    }
+  }
+  if (cache->method == NULL) {
+    *receiver = instance->fields[cache->slot];
+    return callValue(vm, argCount);
+  }
+  return checkArity(vm, cache->method, argCount) &&
+         callFunction(vm, cache->method, argCount);
+}
+
+static void finishFiber(VM *vm, Value result);
+
+// Pops the running function's frame, leaving the value on top of the stack
+// as the result of the call.
+static void returnToCaller(VM *vm) {
+  Value result = vm->stackTop[-1];
+  // Scripts end in OP_RETURN, so only a fiber's function has no caller.
+  if (vm->frameCount == 0) {
+    finishFiber(vm, result);
+    return;
+  }
+  vm->stackTop = vm->slots;
+  push(vm, result);
+  CallFrame *frame = &vm->frames[--vm->frameCount];
+  vm->function = frame->function;
+  vm->chunk = frame->chunk;
+  vm->ip = frame->ip;
+  vm->slots = frame->slots;
+}
+
+static void saveRegisters(VM *vm, Fiber *fiber) {
+  fiber->function = vm->function;
+  fiber->chunk = vm->chunk;
+  fiber->ip = vm->ip;
+  fiber->slots = vm->slots;
+  fiber->frames = vm->frames;
+  fiber->frameCount = vm->frameCount;
+  fiber->frameCapacity = vm->frameCapacity;
+  fiber->stack = vm->stack;
+  fiber->stackTop = vm->stackTop;
+  fiber->stackCapacity = vm->stackCapacity;
+}
+
+static void loadRegisters(VM *vm, Fiber *fiber) {
+  vm->function = fiber->function;
+  vm->chunk = fiber->chunk;
+  vm->ip = fiber->ip;
+  vm->slots = fiber->slots;
+  vm->frames = fiber->frames;
+  vm->frameCount = fiber->frameCount;
+  vm->frameCapacity = fiber->frameCapacity;
+  vm->stack = fiber->stack;
+  vm->stackTop = fiber->stackTop;
+  vm->stackCapacity = fiber->stackCapacity;
+  vm->fiber = fiber;
+}
+
+// Suspends the running fiber and runs fiber, sending it value as the result
+// of the native call it is waiting in. A new fiber ignores value and starts
+// by calling its function.
+static void switchFiber(VM *vm, Fiber *fiber, Value value) {
+  saveRegisters(vm, vm->fiber);
+  loadRegisters(vm, fiber);
+  FiberState state = fiber->state;
+  fiber->state = FIBER_RUNNING;
+  if (state == FIBER_NEW) {
+    enterFunction(vm, vm->stack[0].as.function, vm->stack);
+    return;
+  }
+  vm->stackTop[-1] = value;
+  if (fiber->returnOnResume) {
+    fiber->returnOnResume = false;
+    returnToCaller(vm);
+  }
+}
+
+static void readyFiber(VM *vm, Fiber *fiber) {
+  if (vm->readyCapacity <= vm->readyCount) {
+    int capacity = vm->readyCapacity < 8 ? 8 : vm->readyCapacity * 2;
+    Fiber **ready = malloc(capacity * sizeof(Fiber *));
+    if (ready == NULL) {
+      exit(1);
+    }
+    for (int i = 0; i < vm->readyCount; i++) {
+      ready[i] =
+          vm->readyFibers[(vm->readyStart + i) & (vm->readyCapacity - 1)];
+    }
+    free(vm->readyFibers);
+    vm->readyFibers = ready;
+    vm->readyCapacity = capacity;
+    vm->readyStart = 0;
+  }
+  int end = (vm->readyStart + vm->readyCount++) & (vm->readyCapacity - 1);
+  vm->readyFibers[end] = fiber;
+}
+
+// Gives the scheduler's turn to the next queued fiber, or back to the one
+// waiting in run() once the queue is empty.
+static void runNextFiber(VM *vm) {
+  if (vm->readyCount == 0) {
+    Fiber *caller = vm->schedulerCaller;
+    vm->schedulerCaller = NULL;
+    switchFiber(vm, caller, makeNil());
+    return;
+  }
+  Fiber *next = vm->readyFibers[vm->readyStart];
+  vm->readyStart = (vm->readyStart + 1) & (vm->readyCapacity - 1);
+  vm->readyCount--;
+  switchFiber(vm, next, makeNil());
+}
+
+static void finishFiber(VM *vm, Value result) {
+  Fiber *fiber = vm->fiber;
+  fiber->state = FIBER_DONE;
+  if (fiber->scheduled) {
+    runNextFiber(vm);
+  } else {
+    Fiber *resumer = fiber->resumer;
+    fiber->resumer = NULL;
+    switchFiber(vm, resumer, result);
+  }
+  freeFiberStacks(fiber);
+}
+
+// Gives up on the fiber a runtime error stopped in, on every fiber waiting
+// for it and on the queue, and goes back to the main fiber.
+static void leaveFibers(VM *vm) {
+  if (vm->fiber == vm->mainFiber) {
+    return;
+  }
+  saveRegisters(vm, vm->fiber);
+  for (Fiber *fiber = vm->fiber; fiber != vm->mainFiber;) {
+    Fiber *waiting = fiber->scheduled ? vm->schedulerCaller : fiber->resumer;
+    fiber->state = FIBER_DONE;
+    fiber->resumer = NULL;
+    freeFiberStacks(fiber);
+    fiber = waiting;
+  }
+  for (; vm->readyCount > 0; vm->readyCount--) {
+    Fiber *fiber = vm->readyFibers[vm->readyStart];
+    vm->readyStart = (vm->readyStart + 1) & (vm->readyCapacity - 1);
+    fiber->state = FIBER_DONE;
+    freeFiberStacks(fiber);
+  }
+  vm->schedulerCaller = NULL;
+  loadRegisters(vm, vm->mainFiber);
+  vm->mainFiber->state = FIBER_RUNNING;
+}
+
+Value tempFiber(VM *vm, Value function, int argCount, Value *args,
+                bool scheduled) {
+  Fiber *fiber = newFiber(function, argCount, args);
+  fiber->scheduled = scheduled;
+  Value value = makeFiber(fiber);
+  writeValueArray(&vm->tempValues, value);
+  if (scheduled) {
+    readyFiber(vm, fiber);
+  }
+  return value;
+}
+
+bool resumeFiber(VM *vm, Fiber *fiber, Value value) {
+  if (fiber->scheduled) {
+    runtimeError(vm, "Can't resume a scheduled fiber.");
+    return false;
+  }
+  if (fiber->state == FIBER_DONE) {
+    runtimeError(vm, "Can't resume a finished fiber.");
+    return false;
+  }
+  if (fiber->state == FIBER_RUNNING) {
+    runtimeError(vm, "Can't resume a running fiber.");
+    return false;
+  }
+  fiber->resumer = vm->fiber;
+  switchFiber(vm, fiber, value);
+  return true;
+}
+
+bool yieldFiber(VM *vm, Value value) {
+  Fiber *fiber = vm->fiber;
+  if (fiber == vm->mainFiber) {
+    runtimeError(vm, "Can't yield outside a fiber.");
+    return false;
+  }
+  fiber->state = FIBER_SUSPENDED;
+  if (fiber->scheduled) {
+    readyFiber(vm, fiber);
+    runNextFiber(vm);
     return true;
   }
-  if (value.type == VAL_BOOL) {
-    return !value.as.boolean;
+  Fiber *resumer = fiber->resumer;
+  fiber->resumer = NULL;
+  switchFiber(vm, resumer, value);
+  return true;
+}
+
+bool runFibers(VM *vm) {
+  if (vm->schedulerCaller != NULL) {
+    runtimeError(vm, "The scheduler is already running.");
+    return false;
+  }
+  if (vm->readyCount > 0) {
+    vm->schedulerCaller = vm->fiber;
+    runNextFiber(vm);
+  }
+  return true;
+}
+
+bool checkMapKey(VM *vm, Value key) {
+  if (key.type != VAL_STRING && key.type != VAL_NUMBER &&
+      key.type != VAL_BOOL) {
+    runtimeError(vm, "Map keys must be strings, numbers or booleans.");
+    return false;
+  }
+  if (key.type == VAL_NUMBER && key.as.number != key.as.number) {
+    runtimeError(vm, "Map keys can't be NaN.");
+    return false;
+  }
+  return true;
+}
+
+// The element of array that index selects, or -1 after reporting why there
+// is none.
+static int checkIndex(VM *vm, Value array, Value index) {
+  if (array.type != VAL_ARRAY) {
+    runtimeError(vm, "Can only index arrays and maps.");
+    return -1;
+  }
+  if (index.type != VAL_NUMBER) {
+    runtimeError(vm, "Index must be a number.");
+    return -1;
+  }
+  int element = arrayIndex(array.as.array, index);
+  if (element == -1) {
+    runtimeError(vm, "Index %g is outside an array of %d.", index.as.number,
+                 array.as.array->count);
   }
-  return false;
+  return element;
 }
 
-static InterpretResult run() {
+static InterpretResult run(VM *vm) {
   for (;;) {
-    switch (*vm.ip++) {
+    switch (*vm->ip++) {
     case OP_CONSTANT: {
-      uint8_t index = *vm.ip++;
-      Value value = vm.chunk->constants.values[index];
-      push(value);
+      uint8_t index = *vm->ip++;
+      Value value = vm->chunk->constants.values[index];
+      push(vm, value);
+      break;
+    }
+    case OP_CONSTANT_LONG: {
+      uint32_t index = readLong(vm);
+      push(vm, vm->chunk->constants.values[index]);
       break;
     }
     case OP_PRINT: {
-      Value value = pop();
-      printValue(value);
+      Value value = pop(vm);
+      writeValue(&vm->output, value);
       break;
     }
     case OP_DEFINE_GLOBAL: {
-      uint8_t index = *vm.ip++;
-      Value key = vm.chunk->constants.values[index];
-      Value value = pop();
-      if (!tableSet(&vm.globals, key.as.string, value)) {
-        printf("Failed to define global variable '%s' \n",
-               key.as.string->chars);
+      defineGlobal(vm, *vm->ip++);
+      break;
+    }
+    case OP_DEFINE_GLOBAL_LONG: {
+      defineGlobal(vm, readLong(vm));
+      break;
+    }
+    case OP_ADD: {
+      Value b = vm->stackTop[-1];
+      Value a = vm->stackTop[-2];
+      if (a.type == VAL_NUMBER && b.type == VAL_NUMBER) {
+        vm->ip[-1] = OP_ADD_NUM;
+      } else if (a.type == VAL_STRING && b.type == VAL_STRING) {
+        vm->ip[-1] = OP_ADD_STR;
+      } else {
+        runtimeError(vm, "Operands must be two numbers or two strings.");
         return INTERPRET_RUNTIME_ERROR;
       }
+      vm->stackTop -= 2;
+      push(vm, addValues(&vm->tempValues, a, b));
       break;
     }
-    case OP_ADD: {
-      Value b = pop();
-      Value a = pop();
-      push(addValues(a, b));
+    case OP_ADD_NUM: {
+      Value *a = vm->stackTop - 2;
+      Value *b = vm->stackTop - 1;
+      if (a->type != VAL_NUMBER || b->type != VAL_NUMBER) {
+        despecialize(vm, OP_ADD);
+        break;
+      }
+      a->as.number += b->as.number;
+      vm->stackTop--;
+      break;
+    }
+    case OP_ADD_STR: {
+      Value *a = vm->stackTop - 2;
+      Value *b = vm->stackTop - 1;
+      if (a->type != VAL_STRING || b->type != VAL_STRING) {
+        despecialize(vm, OP_ADD);
+        break;
+      }
+      *a = concatenateStrings(&vm->tempValues, a->as.string, b->as.string);
+      vm->stackTop--;
+      break;
+    }
+    case OP_SUBTRACT: {
+      Value *a = vm->stackTop - 2;
+      Value *b = vm->stackTop - 1;
+      if (!checkNumberOperands(vm, *a, *b)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      a->as.number -= b->as.number;
+      vm->stackTop--;
+      break;
+    }
+    case OP_MULTIPLY: {
+      Value *a = vm->stackTop - 2;
+      Value *b = vm->stackTop - 1;
+      if (!checkNumberOperands(vm, *a, *b)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      a->as.number *= b->as.number;
+      vm->stackTop--;
+      break;
+    }
+    case OP_DIVIDE: {
+      Value *a = vm->stackTop - 2;
+      Value *b = vm->stackTop - 1;
+      if (!checkNumberOperands(vm, *a, *b)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      a->as.number /= b->as.number;
+      vm->stackTop--;
+      break;
+    }
+    case OP_ADD_UNCHECKED: {
+      vm->stackTop[-2].as.number += vm->stackTop[-1].as.number;
+      vm->stackTop--;
+      break;
+    }
+    case OP_SUBTRACT_UNCHECKED: {
+      vm->stackTop[-2].as.number -= vm->stackTop[-1].as.number;
+      vm->stackTop--;
+      break;
+    }
+    case OP_MULTIPLY_UNCHECKED: {
+      vm->stackTop[-2].as.number *= vm->stackTop[-1].as.number;
+      vm->stackTop--;
+      break;
+    }
+    case OP_DIVIDE_UNCHECKED: {
+      vm->stackTop[-2].as.number /= vm->stackTop[-1].as.number;
+      vm->stackTop--;
+      break;
+    }
+    case OP_LESS_UNCHECKED: {
+      Value *a = vm->stackTop - 2;
+      a->as.boolean = a->as.number < vm->stackTop[-1].as.number;
+      a->type = VAL_BOOL;
+      vm->stackTop--;
+      break;
+    }
+    case OP_GREATER_UNCHECKED: {
+      Value *a = vm->stackTop - 2;
+      a->as.boolean = a->as.number > vm->stackTop[-1].as.number;
+      a->type = VAL_BOOL;
+      vm->stackTop--;
+      break;
+    }
+    case OP_NEGATE_UNCHECKED: {
+      vm->stackTop[-1].as.number = -vm->stackTop[-1].as.number;
+      break;
+    }
+    case OP_ADD_IMM_UNCHECKED: {
+      int16_t immediate = readImmediate(vm);
+      vm->stackTop[-1].as.number += immediate;
+      break;
+    }
+    case OP_LESS_IMM_UNCHECKED: {
+      int16_t immediate = readImmediate(vm);
+      Value *a = vm->stackTop - 1;
+      a->as.boolean = a->as.number < immediate;
+      a->type = VAL_BOOL;
+      break;
+    }
+    case OP_GREATER_IMM_UNCHECKED: {
+      int16_t immediate = readImmediate(vm);
+      Value *a = vm->stackTop - 1;
+      a->as.boolean = a->as.number > immediate;
+      a->type = VAL_BOOL;
+      break;
+    }
+    case OP_NEGATE: {
+      Value *value = vm->stackTop - 1;
+      if (value->type != VAL_NUMBER) {
+        runtimeError(vm, "Operand must be a number.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      negateValue(value);
+      break;
+    }
+    case OP_EQUAL: {
+      Value b = pop(vm);
+      Value a = pop(vm);
+      push(vm, makeBool(valuesEqual(a, b)));
+      break;
+    }
+    case OP_ADD_IMM: {
+      int16_t immediate = readImmediate(vm);
+      Value *a = vm->stackTop - 1;
+      // Reports the same error as OP_ADD, as the register backend does.
+      if (a->type != VAL_NUMBER) {
+        runtimeError(vm, "Operands must be two numbers or two strings.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      a->as.number += immediate;
+      break;
+    }
+    case OP_LESS_IMM: {
+      int16_t immediate = readImmediate(vm);
+      Value *a = vm->stackTop - 1;
+      if (a->type != VAL_NUMBER) {
+        runtimeError(vm, "Operands must be numbers.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      a->as.boolean = a->as.number < immediate;
+      a->type = VAL_BOOL;
+      break;
+    }
+    case OP_GREATER_IMM: {
+      int16_t immediate = readImmediate(vm);
+      Value *a = vm->stackTop - 1;
+      if (a->type != VAL_NUMBER) {
+        runtimeError(vm, "Operands must be numbers.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      a->as.boolean = a->as.number > immediate;
+      a->type = VAL_BOOL;
       break;
     }
     case OP_LESS: {
-      Value b = pop();
-      Value a = pop();
+      Value b = pop(vm);
+      Value a = pop(vm);
+      if (!checkNumberOperands(vm, a, b)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      vm->ip[-1] = OP_LESS_NUM;
       Value result = compareValues(a, b, '<');
-      push(result);
+      push(vm, result);
+      break;
+    }
+    case OP_LESS_NUM: {
+      Value *a = vm->stackTop - 2;
+      Value *b = vm->stackTop - 1;
+      if (a->type != VAL_NUMBER || b->type != VAL_NUMBER) {
+        despecialize(vm, OP_LESS);
+        break;
+      }
+      a->as.boolean = a->as.number < b->as.number;
+      a->type = VAL_BOOL;
+      vm->stackTop--;
       break;
     }
     case OP_GREATER: {
-      Value b = pop();
-      Value a = pop();
+      Value b = pop(vm);
+      Value a = pop(vm);
+      if (!checkNumberOperands(vm, a, b)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      vm->ip[-1] = OP_GREATER_NUM;
       Value result = compareValues(a, b, '>');
-      push(result);
+      push(vm, result);
+      break;
+    }
+    case OP_GREATER_NUM: {
+      Value *a = vm->stackTop - 2;
+      Value *b = vm->stackTop - 1;
+      if (a->type != VAL_NUMBER || b->type != VAL_NUMBER) {
+        despecialize(vm, OP_GREATER);
+        break;
+      }
+      a->as.boolean = a->as.number > b->as.number;
+      a->type = VAL_BOOL;
+      vm->stackTop--;
       break;
     }
     case OP_SET_GLOBAL: {
-      uint8_t index = *vm.ip++;
-      Value key = vm.chunk->constants.values[index];
-      Value value = vm.stackTop[-1];
-
-      if (tableSet(&vm.globals, key.as.string, value)) {
-        printf("Failed to set global variable '%s' \n", key.as.string->chars);
+      GlobalCache *cache = currentGlobalCache(vm);
+      uint8_t index = *vm->ip++;
+      if (!setGlobal(vm, cache, index)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+    case OP_SET_GLOBAL_LONG: {
+      GlobalCache *cache = currentGlobalCache(vm);
+      if (!setGlobal(vm, cache, readLong(vm))) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      // pop();
       break;
     }
     case OP_GET_GLOBAL: {
-      Value value;
-      uint8_t index = *vm.ip++;
-      Value key = vm.chunk->constants.values[index];
-
-      if (!tableGet(&vm.globals, key.as.string, &value)) {
-        printf("Undefined variable '%s'\n", key.as.string->chars);
+      GlobalCache *cache = currentGlobalCache(vm);
+      uint8_t index = *vm->ip++;
+      if (!getGlobal(vm, cache, index)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+    case OP_GET_GLOBAL_LONG: {
+      GlobalCache *cache = currentGlobalCache(vm);
+      if (!getGlobal(vm, cache, readLong(vm))) {
         return INTERPRET_RUNTIME_ERROR;
       }
-
-      //  printValue(value);
-      push(value);
       break;
     }
     case OP_GET_LOCAL: {
-      uint8_t slot = *vm.ip++;
-      push(vm.stack[slot]);
+      uint8_t slot = *vm->ip++;
+      push(vm, vm->slots[slot]);
+      break;
+    }
+    case OP_GET_LOCAL_LONG: {
+      uint32_t slot = readLong(vm);
+      push(vm, vm->slots[slot]);
       break;
     }
     case OP_SET_LOCAL: {
-      uint8_t slot = *vm.ip++;
-      Value value = vm.stackTop[-1];
-      vm.stack[slot] = value;
+      uint8_t slot = *vm->ip++;
+      Value value = vm->stackTop[-1];
+      vm->slots[slot] = value;
+      break;
+    }
+    case OP_SET_LOCAL_LONG: {
+      uint32_t slot = readLong(vm);
+      vm->slots[slot] = vm->stackTop[-1];
       break;
     }
     case OP_NIL: {
-      push(makeNil());
+      push(vm, makeNil());
+      break;
+    }
+    case OP_ZERO: {
+      push(vm, makeNumber(0));
+      break;
+    }
+    case OP_ONE: {
+      push(vm, makeNumber(1));
+      break;
+    }
+    case OP_INT8: {
+      int8_t immediate = (int8_t)*vm->ip++;
+      push(vm, makeNumber(immediate));
+      break;
+    }
+    case OP_INT16: {
+      push(vm, makeNumber(readImmediate(vm)));
       break;
     }
     case OP_POP: {
-      pop();
+      pop(vm);
       break;
     }
     case OP_TRUE: {
       Value value;
       value.type = VAL_BOOL;
       value.as.boolean = true;
-      push(value);
+      push(vm, value);
       break;
     }
     case OP_FALSE: {
       Value value;
       value.type = VAL_BOOL;
       value.as.boolean = false;
-      push(value);
+      push(vm, value);
       break;
     }
     case OP_LOOP: {
-      uint16_t offset = (uint16_t)((*vm.ip << 8) | *(vm.ip + 1));
-      vm.ip += 2;
-      vm.ip -= offset;
+      uint16_t offset = (uint16_t)((*vm->ip << 8) | *(vm->ip + 1));
+      int loopOffset = (int)(vm->ip - vm->chunk->code) - 1;
+      vm->ip += 2;
+      vm->ip -= offset;
+      if (vm->jit) {
+        jitOnBackEdge(vm, loopOffset);
+      }
+      break;
+    }
+    case OP_FOR_LOOP: {
+      uint8_t *operands = vm->ip;
+      int loopOffset = (int)(operands - vm->chunk->code) - 1;
+      double *counter = &vm->slots[operands[0]].as.number;
+      double limit = vm->slots[operands[1]].as.number;
+      *counter += (int16_t)((operands[2] << 8) | operands[3]);
+      bool loops;
+      switch (operands[4]) {
+      case FOR_LESS: {
+        loops = *counter < limit;
+        break;
+      }
+      case FOR_LESS_EQUAL: {
+        loops = !(*counter > limit);
+        break;
+      }
+      case FOR_GREATER: {
+        loops = *counter > limit;
+        break;
+      }
+      default: {
+        loops = !(*counter < limit);
+        break;
+      }
+      }
+      vm->ip += 7;
+      if (loops) {
+        vm->ip -= (uint16_t)((operands[5] << 8) | operands[6]);
+        if (vm->jit) {
+          jitOnBackEdge(vm, loopOffset);
+        }
+      }
       break;
     }
     case OP_JUMP: {
-      uint16_t offset = (uint16_t)((*vm.ip << 8) | *(vm.ip + 1));
-      vm.ip += offset + 2;
+      uint16_t offset = (uint16_t)((*vm->ip << 8) | *(vm->ip + 1));
+      vm->ip += offset + 2;
       break;
     }
     case OP_JUMP_IF_FALSE: {
-      uint16_t offset = (uint16_t)((*vm.ip << 8) | *(vm.ip + 1));
-      vm.ip += 2;
+      uint16_t offset = (uint16_t)((*vm->ip << 8) | *(vm->ip + 1));
+      vm->ip += 2;
 
-      if (isFalsey(vm.stackTop[-1])) {
-        vm.ip += offset;
+      if (isFalsey(vm->stackTop[-1])) {
+        vm->ip += offset;
       }
       break;
     }
     case OP_RETURN: {
       return INTERPRET_OK;
     }
+    case OP_CALL: {
+      int argCount = *vm->ip++;
+      if (!callValue(vm, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+    case OP_TAIL_CALL: {
+      int argCount = *vm->ip++;
+      Value callee = vm->stackTop[-1 - argCount];
+      if (callee.type == VAL_NATIVE) {
+        // Natives have no frame to reuse, so return their result at once, or
+        // once it arrives if the native switched fibers.
+        Fiber *fiber = vm->fiber;
+        if (!callNative(vm, callee.as.native, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        if (vm->fiber != fiber) {
+          fiber->returnOnResume = true;
+          break;
+        }
+        returnToCaller(vm);
+        break;
+      }
+      Function *function;
+      if (!resolveCall(vm, argCount, &function)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (function == NULL) {
+        returnToCaller(vm);
+        break;
+      }
+      // The callee and its arguments take over the running frame's slots.
+      memmove(vm->slots, vm->stackTop - argCount - 1,
+              (argCount + 1) * sizeof(Value));
+      vm->stackTop = vm->slots + argCount + 1;
+      enterFunction(vm, function, vm->slots);
+      break;
+    }
+    case OP_RETURN_VALUE: {
+      returnToCaller(vm);
+      break;
+    }
+    case OP_ARRAY: {
+      int count = *vm->ip++;
+      Value value = tempArray(vm, count);
+      Value *elements = vm->stackTop - count;
+      for (int i = 0; i < count; i++) {
+        arraySet(value.as.array, i, elements[i]);
+      }
+      vm->stackTop = elements;
+      push(vm, value);
+      break;
+    }
+    case OP_CLASS: {
+      uint8_t index = *vm->ip++;
+      push(vm, tempClass(vm, nameConstant(vm, index)));
+      break;
+    }
+    case OP_CLASS_LONG: {
+      push(vm, tempClass(vm, nameConstant(vm, readLong(vm))));
+      break;
+    }
+    case OP_METHOD: {
+      Function *method = pop(vm).as.function;
+      Class *klass = vm->stackTop[-1].as.klass;
+      tableSet(&klass->methods, method->name, makeFunction(method));
+      break;
+    }
+    case OP_GET_PROPERTY: {
+      PropertyCache *cache = currentPropertyCache(vm);
+      uint8_t index = *vm->ip++;
+      if (!getProperty(vm, cache, index)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+    case OP_GET_PROPERTY_LONG: {
+      PropertyCache *cache = currentPropertyCache(vm);
+      if (!getProperty(vm, cache, readLong(vm))) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+    case OP_SET_PROPERTY: {
+      PropertyCache *cache = currentPropertyCache(vm);
+      uint8_t index = *vm->ip++;
+      if (!setProperty(vm, cache, index)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+    case OP_SET_PROPERTY_LONG: {
+      PropertyCache *cache = currentPropertyCache(vm);
+      if (!setProperty(vm, cache, readLong(vm))) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+    case OP_INVOKE: {
+      PropertyCache *cache = currentPropertyCache(vm);
+      uint8_t index = *vm->ip++;
+      int argCount = *vm->ip++;
+      if (!invoke(vm, cache, index, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+    case OP_INVOKE_LONG: {
+      PropertyCache *cache = currentPropertyCache(vm);
+      uint32_t index = readLong(vm);
+      int argCount = *vm->ip++;
+      if (!invoke(vm, cache, index, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+    case OP_MAP: {
+      int count = *vm->ip++;
+      Value map = tempMap(vm, count);
+      Value *pairs = vm->stackTop - 2 * count;
+      for (int i = 0; i < count; i++) {
+        if (!checkMapKey(vm, pairs[2 * i])) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        tableSetKey(map.as.map, pairs[2 * i], pairs[2 * i + 1]);
+      }
+      vm->stackTop = pairs;
+      push(vm, map);
+      break;
+    }
+    case OP_GET_INDEX: {
+      Value index = pop(vm);
+      Value *target = vm->stackTop - 1;
+      if (target->type == VAL_MAP) {
+        if (!checkMapKey(vm, index)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        Entry *entry = tableFindKey(target->as.map, index);
+        *target = entry != NULL ? entry->value : makeNil();
+        break;
+      }
+      int element = checkIndex(vm, *target, index);
+      if (element == -1) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      *target = arrayGet(target->as.array, element);
+      break;
+    }
+    case OP_SET_INDEX: {
+      Value value = pop(vm);
+      Value index = pop(vm);
+      Value *target = vm->stackTop - 1;
+      if (target->type == VAL_MAP) {
+        if (!checkMapKey(vm, index)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        tableSetKey(target->as.map, index, value);
+        *target = value;
+        break;
+      }
+      int element = checkIndex(vm, *target, index);
+      if (element == -1) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      arraySet(target->as.array, element, value);
+      *target = value;
+      break;
+    }
     case OP_NOT: {
-      // Value value = *(vm.stackTop - 1);
-      Value *value = vm.stackTop - 1;
-      negateValue(value);
+      Value *value = vm->stackTop - 1;
+      *value = makeBool(isFalsey(*value));
       break;
     }
+    default: {
+      // verifyChunk() rejects every opcode without a handler above.
+      __builtin_unreachable();
+    }
     }
   }
   return INTERPRET_OK;
@@ -204,22 +1492,53 @@ void debugStack(VM *vm) {
   printf("===========\n");
 }
 
-InterpretResult interpret(const char *source) {
-  Chunk chunk;
-  initChunk(&chunk);
-  initVM();
+static InterpretResult runSource(VM *vm, const char *source) {
+  int length = (int)strlen(source);
+  uint32_t hash = vm->cacheChunks ? hashString(source, length) : 0;
+  Chunk *chunk =
+      vm->cacheChunks ? findCachedChunk(vm, source, hash, length) : NULL;
+  if (chunk == NULL) {
+    chunk = newChunk(vm);
+    FragmentCache *fragments = vm->incremental ? &vm->fragments : NULL;
+    if (!compile(source, chunk, vm->err, fragments) || !verifyChunk(chunk)) {
+      return INTERPRET_COMPILE_ERROR;
+    }
+    if (vm->cacheChunks) {
+      cacheNewestChunk(vm, source, hash, length);
+    }
+  }
+  leaveFibers(vm);
+  vm->function = NULL;
+  vm->chunk = chunk;
+  vm->ip = chunk->code;
+  vm->stackTop = vm->stack;
+  vm->slots = vm->stack;
+  vm->frameCount = 0;
+  if (vm->dumpChunks) {
+    debugChunk(chunk);
+  }
 
-  if (!compile(source, &chunk)) {
-    freeChunk(&chunk);
-    return INTERPRET_COMPILE_ERROR;
+  // Both backends need the caches of the functions the chunk declares, which
+  // may be called from later chunks run on the stack VM.
+  resetInlineCaches(chunk);
+  if (vm->backend == BACKEND_REGISTER && canCompileRegisters(chunk)) {
+    RegChunk regChunk;
+    if (!compileRegisters(chunk, &regChunk)) {
+      return INTERPRET_COMPILE_ERROR;
+    }
+    reserveStack(vm, regChunk.registerCount + regChunk.constants.count);
+    InterpretResult result = runRegisters(vm, &regChunk);
+    freeRegChunk(&regChunk);
+    return result;
   }
-  vm.chunk = &chunk;
-  vm.ip = chunk.code;
-  debugChunk(vm.chunk);
 
-  InterpretResult result = run();
+  reserveStack(vm, chunk->maxStack);
+  vm->slots = vm->stack;
+  return run(vm);
+}
 
-  freeChunk(&chunk);
-  freeVM();
+InterpretResult interpret(VM *vm, const char *source) {
+  InterpretResult result = runSource(vm, source);
+  flushOutput(&vm->output);
   return result;
 }
@@ -1,10 +1,24 @@
 #include "chunk.h"
+#include "fragment.h"
+#include "jit.h"
+#include "output.h"
+#include "snapshot.h"
 #include "table.h"
 #include "value.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
 
 #pragma once
 
 #define STACK_INIT 256
+#define FRAMES_INIT 64
+// Calls nested deeper than this are reported as a stack overflow. Tail calls
+// reuse their caller's frame, so they do not count.
+#define FRAMES_MAX 4096
+// Cached chunks beyond this many are dropped, least recently used first,
+// the next time the VM is reset.
+#define CHUNK_CACHE_MAX 128
 
 typedef enum {
   INTERPRET_OK,
@@ -12,23 +26,150 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
+typedef enum {
+  BACKEND_STACK,
+  // Translates the verified stack code to register code before running it.
+  BACKEND_REGISTER,
+} Backend;
+
+// A compiled and verified chunk kept across resetVM for scripts that are run
+// again with the same source text.
+typedef struct {
+  uint32_t hash;
+  char *source;
+  int length;
+  Chunk *chunk;
+  uint64_t lastUsed;
+} CachedChunk;
+
+// A caller suspended by a call. The running function's state is kept in the
+// VM itself, so a call only has to save its caller's.
 typedef struct {
+  Function *function;
   Chunk *chunk;
   uint8_t *ip;
+  Value *slots;
+} CallFrame;
+
+typedef struct VM {
+  // the running code, NULL function for the script
+  Function *function;
+  Chunk *chunk;
+  uint8_t *ip;
+  // local slot 0 of the running code
+  Value *slots;
+
+  // callers of the running function, innermost last
+  CallFrame *frames;
+  int frameCount;
+  int frameCapacity;
 
   // stack
   Value *stack;
   Value *stackTop;
   int stackCapacity;
 
+  // the fiber the registers above belong to, and the one scripts run in
+  Fiber *fiber;
+  Fiber *mainFiber;
+  // spawned fibers waiting for their turn, a ring buffer of power-of-two
+  // capacity
+  Fiber **readyFibers;
+  int readyStart;
+  int readyCount;
+  int readyCapacity;
+  // the fiber waiting in run() while the scheduler runs, or NULL
+  Fiber *schedulerCaller;
+
   // globals
   Table globals;
 
   // temporary values
   ValueArray tempValues;
 
+  // snapshots whose strings globals may point into
+  Snapshot *snapshots;
+
+  // every native registered, defined again as globals after each reset
+  Native **natives;
+  int nativeCount;
+  int nativeCapacity;
+
+  // every chunk interpreted so far
+  Chunk **chunks;
+  int chunkCount;
+  int chunkCapacity;
+
+  // chunks kept across resets when cacheChunks is on
+  CachedChunk *chunkCache;
+  int chunkCacheCount;
+  int chunkCacheCapacity;
+  uint64_t chunkCacheClock;
+
+  // options
+  Backend backend;
+  bool jit;
+  JitStats jitStats;
+  // where print output and error messages go
+  OutputBuffer output;
+  FILE *err;
+  // disassemble each chunk to stdout before running it
+  bool dumpChunks;
+  // reuse the compiled chunk when the same source is interpreted again
+  bool cacheChunks;
+  // reuse the code of unchanged top-level statements when compiling
+  bool incremental;
+  FragmentCache fragments;
 } VM;
 
-extern VM vm;
-InterpretResult interpret(const char *source);
+void initVM(VM *vm);
+void freeVM(VM *vm);
+// Forgets every global, string, snapshot and chunk earlier scripts left
+// behind while keeping the stack, globals table, chunk and fragment caches and
+// options, so the VM can run an unrelated script without reallocating or
+// recompiling.
+void resetVM(VM *vm);
+// Runs source on vm. Globals defined by earlier calls remain visible.
+InterpretResult interpret(VM *vm, const char *source);
 void debugStack(VM *vm);
+
+// Resolves the global read or written by the instruction at offset through its
+// inline cache. Returns NULL, without reporting, when it is undefined.
+Entry *resolveGlobalAt(VM *vm, int offset);
+
+// Declares the global name. Declaring one that already exists, a native
+// included, replaces its value, so the REPL can redefine what it declared.
+void bindGlobal(VM *vm, String *name, Value value);
+
+// Makes function callable from Lox as the global name. Registering a name
+// again replaces the function, even where scripts already hold it.
+void defineNative(VM *vm, const char *name, NativeFn function, int arity);
+// Reports a runtime error at the native call being run.
+void nativeError(VM *vm, const char *format, ...);
+// Returns a string the VM owns until it is reset.
+Value tempString(VM *vm, const char *chars, int length);
+// Returns a numeric array of count zeros, owned the same way.
+Value tempArray(VM *vm, int count);
+// Returns an empty map with room for count entries, owned the same way.
+Value tempMap(VM *vm, int count);
+// Whether key can index a map, reporting a runtime error if not.
+bool checkMapKey(VM *vm, Value key);
+// Returns a fiber that will call function, a Function taking argCount
+// arguments, with the values at args. It is owned like tempString(), and a
+// scheduled one is queued for runFibers().
+Value tempFiber(VM *vm, Value function, int argCount, Value *args,
+                bool scheduled);
+// These end the native call being run by switching to another fiber, or
+// report a runtime error and return false without switching. The call's
+// result is what its fiber is sent when it runs again, so natives set it
+// beforehand only for when no switch happens.
+bool resumeFiber(VM *vm, Fiber *fiber, Value value);
+// Sends value back to the fiber that resumed the running one. A scheduled
+// fiber goes to the back of the queue instead, and its yield returns nil.
+bool yieldFiber(VM *vm, Value value);
+// Runs the queued fibers in turn until every one has returned.
+bool runFibers(VM *vm);
+
+// Prints a runtime error at line the way the stack VM does.
+void reportRuntimeError(VM *vm, int line, const char *format,
+                        va_list args);
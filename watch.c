@@ -0,0 +1,162 @@
+#include "watch.h"
+#include "lox.h"
+#include <stdio.h>
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+// Saves usually arrive as a burst of events; a change is acted on once the
+// file has been quiet for this long.
+#define SETTLE_MS 20
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signal) {
+  (void)signal;
+  stopping = 1;
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void runOnce(LoxVM *vm, const char *path, const char *snapshot) {
+  double start = now();
+  char *source = loxReadFile(path, stderr);
+  if (source == NULL) {
+    return;
+  }
+  const char *outcome = "ok";
+  if (snapshot != NULL && !loxLoadSnapshot(vm, snapshot)) {
+    outcome = "snapshot failed";
+  } else {
+    switch (loxInterpret(vm, source)) {
+    case LOX_COMPILE_ERROR: {
+      outcome = "compile error";
+      break;
+    }
+    case LOX_RUNTIME_ERROR: {
+      outcome = "runtime error";
+      break;
+    }
+    default: {
+      break;
+    }
+    }
+  }
+  loxResetVM(vm);
+  free(source);
+  fflush(stdout);
+  fprintf(stderr, "watch: %s, %.2f ms; waiting for changes to %s\n", outcome,
+          (now() - start) * 1000, path);
+}
+
+// Reads the pending events and reports whether any of them was about the
+// file called name in the watched directory.
+static bool readEvents(int fd, const char *name) {
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool changed = false;
+  for (;;) {
+    ssize_t length = read(fd, buffer, sizeof(buffer));
+    if (length <= 0) {
+      return changed;
+    }
+    for (char *next = buffer; next < buffer + length;) {
+      struct inotify_event *event = (struct inotify_event *)next;
+      if (event->len > 0 && strcmp(event->name, name) == 0) {
+        changed = true;
+      }
+      next += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+int runWatch(LoxVM *vm, const char *path, const char *snapshot) {
+  // Editors often save by writing a new file and renaming it over the old
+  // one, which a watch on the file itself would lose, so the directory is
+  // watched instead.
+  char directory[PATH_MAX];
+  const char *slash = strrchr(path, '/');
+  const char *name = slash != NULL ? slash + 1 : path;
+  if (slash == NULL) {
+    strcpy(directory, ".");
+  } else if (slash == path) {
+    strcpy(directory, "/");
+  } else if (slash - path < PATH_MAX) {
+    memcpy(directory, path, slash - path);
+    directory[slash - path] = '\0';
+  } else {
+    fprintf(stderr, "Path '%s' is too long.\n", path);
+    return 64;
+  }
+
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, directory,
+                                  IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) <
+                    0) {
+    fprintf(stderr, "Could not watch '%s': %s\n", directory, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 71;
+  }
+
+  // No SA_RESTART, so a signal breaks out of poll().
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  loxSetDumpChunks(vm, false);
+  loxSetIncremental(vm, true);
+  runOnce(vm, path, snapshot);
+
+  struct pollfd watched = {fd, POLLIN, 0};
+  bool pending = false;
+  while (!stopping) {
+    int ready = poll(&watched, 1, pending ? SETTLE_MS : -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      close(fd);
+      return 71;
+    }
+    if (ready > 0) {
+      pending = readEvents(fd, name) || pending;
+    } else if (pending) {
+      pending = false;
+      runOnce(vm, path, snapshot);
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+#else
+
+int runWatch(LoxVM *vm, const char *path, const char *snapshot) {
+  (void)vm;
+  (void)path;
+  (void)snapshot;
+  fprintf(stderr, "--watch is not supported on this platform.\n");
+  return 64;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#include "lox.h"
+
+#pragma once
+
+// Runs the script at path, then runs it again on a reset vm every time the
+// file is saved, until SIGINT or SIGTERM. Compilation is incremental, so only
+// the top-level statements that changed since the last run are compiled.
+// snapshot, when not NULL, is loaded before every run. Returns the process
+// exit status.
+int runWatch(LoxVM *vm, const char *path, const char *snapshot);